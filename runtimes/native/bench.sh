@@ -0,0 +1,34 @@
+#!/bin/sh -e
+#
+# Benchmarks the example carts with each wasm backend, and writes a JSON report for each backend to
+# bench-<backend>.json. The examples need to be built first. An example's input is replayed from
+# bench/<example>.w4m if it exists, which can be recorded with wasm4 --record.
+#
+# Usage: ./bench.sh [backend...]
+
+cd "$(dirname "$0")"
+backends="${*:-wasm3 toywasm}"
+
+set --
+for example in watris platformer-test sound-demo snake; do
+    cart="../../examples/$example/build/cart.wasm"
+    if [ ! -f "$cart" ]; then
+        echo "Skipping $example, $cart has not been built" >&2
+        continue
+    fi
+    if [ -f "bench/$example.w4m" ]; then
+        set -- "$@" --movie "bench/$example.w4m"
+    fi
+    set -- "$@" "$cart"
+done
+if [ $# -eq 0 ]; then
+    echo "None of the examples have been built" >&2
+    exit 1
+fi
+
+for backend in $backends; do
+    cmake -B "build-bench-$backend" -DWASM_BACKEND="$backend" -DCMAKE_BUILD_TYPE=Release > /dev/null
+    cmake --build "build-bench-$backend" --target wasm4_bench > /dev/null
+    "./build-bench-$backend/wasm4_bench" -o "bench-$backend.json" "$@"
+    echo "Wrote bench-$backend.json" >&2
+done
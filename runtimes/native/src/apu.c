@@ -1,8 +1,27 @@
 #include "apu.h"
 
+#include <limits.h>
 #include <stdlib.h>
+#include <string.h>
 #include <math.h>
 
+#include "util.h"
+
+// The mixer is written with GCC/Clang vector extensions like hash.c, four frames at a time, with
+// intrinsics to saturate and interleave the output
+#if defined(__GNUC__) && ((defined(__x86_64__) || defined(__i386__)) && defined(__SSE2__) \
+    || defined(__ARM_NEON))
+#define MIX_VECTOR
+
+typedef int32_t Lanes __attribute__((vector_size(16)));
+
+#if defined(__ARM_NEON)
+#include <arm_neon.h>
+#else
+#include <emmintrin.h>
+#endif
+#endif
+
 #define SAMPLE_RATE 44100
 #define MAX_VOLUME 0x1333 // ~15% of INT16_MAX
 // The triangle channel sounds a bit quieter than the others, so give it higher amplitude
@@ -10,12 +29,44 @@
 // Also the triangle channel prevent popping on hard stops by adding a 1 ms release
 #define RELEASE_TIME_TRIANGLE (SAMPLE_RATE / 1000)
 
+// Channels are rendered this many frames at a time before being mixed
+#define MIX_FRAMES 256
+
+// Bump when the serialized layout changes
+#define SERIALIZED_VERSION 1
+
+#if defined(W4_APU_FIXED)
+// Without floats, frequencies are kept in 1/256 Hz and phases in 1/2^24 of a cycle, so channels
+// render the same samples on every platform. Both convert exactly to the floats they're
+// serialized as.
+typedef uint32_t Frequency;
+typedef int64_t Phase;
+typedef int64_t RampValue;
+#define FREQ_ONE 256
+#define PHASE_ONE (1 << 24)
+
+// The highest frequency, past which it wouldn't convert exactly to a float
+#define MAX_FREQUENCY 0xffffff
+
+// Ramps carry this many more bits of fraction than the values they ramp between
+#define RAMP_SHIFT 16
+
+// The polyBLEP's level at the edges of the pulse channels
+#define LEVEL_ONE (1 << 16)
+#else
+typedef float Frequency;
+typedef float Phase;
+typedef float RampValue;
+#define FREQ_ONE 1
+#define PHASE_ONE 1.f
+#endif
+
 typedef struct {
     /** Starting frequency. */
-    float freq1;
+    Frequency freq1;
 
     /** Ending frequency, or zero for no frequency transition. */
-    float freq2;
+    Frequency freq2;
 
     /** Time the tone was started. */
     unsigned long long startTime;
@@ -42,7 +93,7 @@ typedef struct {
     int16_t peakVolume;
 
     /** Used for time tracking. */
-    float phase;
+    Phase phase;
 
     /** Tone panning. 0 = center, 1 = only left, 2 = only right. */
     uint8_t pan;
@@ -50,7 +101,7 @@ typedef struct {
     union {
         struct {
             /** Duty cycle for pulse channels. */
-            float dutyCycle;
+            Phase dutyCycle;
         } pulse;
 
         struct {
@@ -63,83 +114,241 @@ typedef struct {
     };
 } Channel;
 
-static Channel channels[4] = { 0 };
+struct w4_Apu {
+    Channel channels[4];
 
-/** The current time in samples and ticks respectively. */
-static unsigned long long time = 0;
-static unsigned long long ticks = 0;
+    /** The current time in samples and ticks respectively. */
+    unsigned long long time;
+    unsigned long long ticks;
+};
 
 static int w4_min (int a, int b) {
     return a < b ? a : b;
 }
 
-static int lerp (int value1, int value2, float t) {
-    return value1 + t * (value2 - value1);
-}
-static float lerpf (float value1, float value2, float t) {
-    return value1 + t * (value2 - value1);
+/** A value that changes linearly over a block of samples. */
+typedef struct {
+    /** In fixed point builds, with RAMP_SHIFT bits of fraction. */
+    RampValue value;
+
+    /** The change per sample. */
+    RampValue step;
+} Ramp;
+
+/** A ramp that holds at a value. */
+static Ramp hold (RampValue value) {
+#if defined(W4_APU_FIXED)
+    Ramp ramp = { value * (1 << RAMP_SHIFT), 0 };
+#else
+    Ramp ramp = { value, 0 };
+#endif
+    return ramp;
 }
 
-static int ramp (int value1, int value2, unsigned long long time1, unsigned long long time2) {
-    if (time >= time2) return value2;
-    float t = (float)(time - time1) / (time2 - time1);
-    return lerp(value1, value2, t);
-}
-static float rampf (float value1, float value2, unsigned long long time1, unsigned long long time2) {
-    if (time >= time2) return value2;
-    float t = (float)(time - time1) / (time2 - time1);
-    return lerpf(value1, value2, t);
+/** The point on a ramp from value1 at time1 to value2 at time2, which holds at value2 after. */
+static Ramp ramp (unsigned long long time, RampValue value1, RampValue value2, unsigned long long time1, unsigned long long time2) {
+    Ramp ramp = hold(value2);
+    if (time < time2) {
+#if defined(W4_APU_FIXED)
+        ramp.step = (value2 - value1) * (1 << RAMP_SHIFT) / (long long)(time2 - time1);
+        ramp.value = value1 * (1 << RAMP_SHIFT) + (long long)(time - time1) * ramp.step;
+#else
+        ramp.step = (value2 - value1) / (time2 - time1);
+        ramp.value = value1 + (time - time1) * ramp.step;
+#endif
+    }
+    return ramp;
 }
 
-static float getCurrentFrequency (const Channel* channel) {
-    if (channel->freq2 > 0) {
-        return rampf(channel->freq1, channel->freq2, channel->startTime, channel->releaseTime);
-    } else {
-        return channel->freq1;
+/** The frequency from the given time. Returns the time it next changes course. */
+static unsigned long long getFrequencyRamp (const Channel* channel, unsigned long long time, Ramp* freq) {
+    if (channel->freq2 > 0 && time < channel->releaseTime) {
+        *freq = ramp(time, channel->freq1, channel->freq2, channel->startTime, channel->releaseTime);
+        return channel->releaseTime;
     }
+    *freq = hold(channel->freq2 > 0 ? channel->freq2 : channel->freq1);
+    return ULLONG_MAX;
 }
 
-static int16_t getCurrentVolume (const Channel* channel) {
-    if (time >= channel->sustainTime && (channel->releaseTime - channel->sustainTime) > RELEASE_TIME_TRIANGLE) {
+/** The volume from the given time. Returns the time the envelope moves to its next phase. */
+static unsigned long long getVolumeRamp (const Channel* channel, unsigned long long time, Ramp* volume) {
+    bool hasRelease = (channel->releaseTime - channel->sustainTime) > RELEASE_TIME_TRIANGLE;
+    if (time >= channel->sustainTime && hasRelease) {
         // Release
-        return ramp(channel->sustainVolume, 0, channel->sustainTime, channel->releaseTime);
+        *volume = ramp(time, channel->sustainVolume, 0, channel->sustainTime, channel->releaseTime);
+        return time < channel->releaseTime ? channel->releaseTime : ULLONG_MAX;
     } else if (time >= channel->decayTime) {
         // Sustain
-        return channel->sustainVolume;
+        *volume = hold(channel->sustainVolume);
+        return hasRelease ? channel->sustainTime : ULLONG_MAX;
     } else if (time >= channel->attackTime) {
         // Decay
-        return ramp(channel->peakVolume, channel->sustainVolume, channel->attackTime, channel->decayTime);
+        *volume = ramp(time, channel->peakVolume, channel->sustainVolume, channel->attackTime, channel->decayTime);
+        return channel->decayTime;
     } else {
         // Attack
-        return ramp(0, channel->peakVolume, channel->startTime, channel->attackTime);
+        *volume = ramp(time, 0, channel->peakVolume, channel->startTime, channel->attackTime);
+        return channel->attackTime;
     }
 }
 
-static float polyblep (float phase, float phaseInc) {
-    if (phase < phaseInc) {
-        float t = phase / phaseInc;
-        return t+t - t*t;
-    } else if (phase > 1.f - phaseInc) {
-        float t = (phase - (1.f - phaseInc)) / phaseInc;
-        return 1.f - (t+t - t*t);
-    } else {
-        return 1.f;
+#if defined(W4_APU_FIXED)
+
+// The frequency of each MIDI note in 1/256 Hz, 440 * 2^((note - 69) / 12) * 256
+static const uint32_t noteFrequencies[128] = {
+    2093, 2217, 2349, 2489, 2637, 2794, 2960, 3136, 3322, 3520,
+    3729, 3951, 4186, 4435, 4699, 4978, 5274, 5588, 5920, 6272,
+    6645, 7040, 7459, 7902, 8372, 8870, 9397, 9956, 10548, 11175,
+    11840, 12544, 13290, 14080, 14917, 15804, 16744, 17740, 18795, 19912,
+    21096, 22351, 23680, 25088, 26580, 28160, 29834, 31609, 33488, 35479,
+    37589, 39824, 42192, 44701, 47359, 50175, 53159, 56320, 59669, 63217,
+    66976, 70959, 75178, 79649, 84385, 89402, 94719, 100351, 106318, 112640,
+    119338, 126434, 133952, 141918, 150356, 159297, 168769, 178805, 189437, 200702,
+    212636, 225280, 238676, 252868, 267905, 283835, 300713, 318594, 337539, 357610,
+    378874, 401403, 425272, 450560, 477352, 505737, 535809, 567670, 601425, 637188,
+    675077, 715219, 757749, 802807, 850544, 901120, 954703, 1011473, 1071618, 1135340,
+    1202851, 1274376, 1350154, 1430439, 1515497, 1605613, 1701088, 1802240, 1909407, 2022946,
+    2143237, 2270680, 2405702, 2548752, 2700309, 2860878, 3030994, 3211227,
+};
+
+// The ratio of each step of pitch bend in 1/65536, 2^(bend / 256 / 12) * 65536
+static const uint32_t bendRatios[256] = {
+    65536, 65551, 65566, 65580, 65595, 65610, 65625, 65640, 65654, 65669, 65684, 65699,
+    65714, 65729, 65743, 65758, 65773, 65788, 65803, 65818, 65832, 65847, 65862, 65877,
+    65892, 65907, 65922, 65936, 65951, 65966, 65981, 65996, 66011, 66026, 66041, 66056,
+    66071, 66085, 66100, 66115, 66130, 66145, 66160, 66175, 66190, 66205, 66220, 66235,
+    66250, 66265, 66280, 66294, 66309, 66324, 66339, 66354, 66369, 66384, 66399, 66414,
+    66429, 66444, 66459, 66474, 66489, 66504, 66519, 66534, 66549, 66564, 66579, 66594,
+    66609, 66624, 66639, 66654, 66670, 66685, 66700, 66715, 66730, 66745, 66760, 66775,
+    66790, 66805, 66820, 66835, 66850, 66865, 66880, 66896, 66911, 66926, 66941, 66956,
+    66971, 66986, 67001, 67016, 67032, 67047, 67062, 67077, 67092, 67107, 67122, 67137,
+    67153, 67168, 67183, 67198, 67213, 67228, 67244, 67259, 67274, 67289, 67304, 67320,
+    67335, 67350, 67365, 67380, 67395, 67411, 67426, 67441, 67456, 67472, 67487, 67502,
+    67517, 67532, 67548, 67563, 67578, 67593, 67609, 67624, 67639, 67655, 67670, 67685,
+    67700, 67716, 67731, 67746, 67761, 67777, 67792, 67807, 67823, 67838, 67853, 67869,
+    67884, 67899, 67915, 67930, 67945, 67961, 67976, 67991, 68007, 68022, 68037, 68053,
+    68068, 68083, 68099, 68114, 68129, 68145, 68160, 68176, 68191, 68206, 68222, 68237,
+    68252, 68268, 68283, 68299, 68314, 68330, 68345, 68360, 68376, 68391, 68407, 68422,
+    68438, 68453, 68468, 68484, 68499, 68515, 68530, 68546, 68561, 68577, 68592, 68608,
+    68623, 68639, 68654, 68670, 68685, 68701, 68716, 68732, 68747, 68763, 68778, 68794,
+    68809, 68825, 68840, 68856, 68871, 68887, 68902, 68918, 68933, 68949, 68965, 68980,
+    68996, 69011, 69027, 69042, 69058, 69074, 69089, 69105, 69120, 69136, 69152, 69167,
+    69183, 69198, 69214, 69230, 69245, 69261, 69276, 69292, 69308, 69323, 69339, 69355,
+    69370, 69386, 69402, 69417,
+};
+
+static Frequency midiFreq (uint8_t note, uint8_t bend) {
+    // Out of MIDI's range, too high to hear, so shift up from the octaves in range
+    int octaves = 0;
+    for (; note >= 128; note -= 12) {
+        ++octaves;
     }
+    uint64_t freq = ((uint64_t)noteFrequencies[note] * bendRatios[bend] >> 16) << octaves;
+    return freq < MAX_FREQUENCY ? freq : MAX_FREQUENCY;
 }
 
+#else
+
+// The frequency of each MIDI note, 440 * 2^((note - 69) / 12), rounded the same as the powf in
+// midiFreq so notes without bend keep the frequencies they had when it was used for every note
+static const float noteFrequencies[128] = {
+    8.17579842f, 8.66195774f, 9.17702293f, 9.72271824f, 10.3008623f, 10.9133816f,
+    11.5623255f, 12.2498589f, 12.9782696f, 13.75f, 14.5676203f, 15.4338512f,
+    16.3515968f, 17.3239155f, 18.3540459f, 19.4454365f, 20.6017246f, 21.8267632f,
+    23.124651f, 24.4997177f, 25.9565392f, 27.5f, 29.1352329f, 30.8677101f,
+    32.7031937f, 34.6478271f, 36.7080994f, 38.890873f, 41.2034416f, 43.6535301f,
+    46.2493019f, 48.999424f, 51.9130898f, 55.0f, 58.2704659f, 61.7354202f,
+    65.4063873f, 69.2956543f, 73.4161987f, 77.7817459f, 82.4068832f, 87.3070602f,
+    92.4986038f, 97.998848f, 103.82618f, 110.0f, 116.540947f, 123.470825f,
+    130.812775f, 138.591324f, 146.832382f, 155.563492f, 164.813782f, 174.61412f,
+    184.997208f, 195.997726f, 207.652344f, 220.0f, 233.081863f, 246.94165f,
+    261.625549f, 277.182648f, 293.664764f, 311.126984f, 329.627563f, 349.228241f,
+    369.994415f, 391.995422f, 415.304688f, 440.0f, 466.163788f, 493.883301f,
+    523.251099f, 554.365295f, 587.329529f, 622.253967f, 659.255127f, 698.456482f,
+    739.988831f, 783.990845f, 830.609375f, 880.0f, 932.327576f, 987.766602f,
+    1046.5022f, 1108.73059f, 1174.65906f, 1244.50793f, 1318.51025f, 1396.91296f,
+    1479.97766f, 1567.98181f, 1661.21875f, 1760.0f, 1864.65491f, 1975.53345f,
+    2093.00439f, 2217.46094f, 2349.31836f, 2489.01587f, 2637.02026f, 2793.82593f,
+    2959.95532f, 3135.96313f, 3322.43774f, 3520.0f, 3729.30981f, 3951.06689f,
+    4186.00879f, 4434.92188f, 4698.63672f, 4978.03174f, 5274.04053f, 5587.65186f,
+    5919.91064f, 6271.92627f, 6644.87549f, 7040.0f, 7458.62158f, 7902.13184f,
+    8372.01758f, 8869.84473f, 9397.27148f, 9956.06348f, 10548.083f, 11175.3027f,
+    11839.8213f, 12543.8555f,
+};
+
+// The ratio of each step of pitch bend, 2^(bend / 256 / 12)
+static const float bendRatios[256] = {
+    1.0f, 1.00022566f, 1.00045133f, 1.00067711f, 1.00090289f, 1.00112879f,
+    1.00135469f, 1.00158072f, 1.00180674f, 1.00203276f, 1.0022589f, 1.00248504f,
+    1.0027113f, 1.00293756f, 1.00316381f, 1.00339019f, 1.00361669f, 1.00384319f,
+    1.00406969f, 1.0042963f, 1.00452292f, 1.00474954f, 1.00497627f, 1.00520301f,
+    1.00542986f, 1.00565684f, 1.00588369f, 1.00611067f, 1.00633776f, 1.00656486f,
+    1.00679195f, 1.00701916f, 1.00724638f, 1.00747371f, 1.00770104f, 1.00792849f,
+    1.00815594f, 1.00838339f, 1.00861096f, 1.00883853f, 1.00906622f, 1.00929391f,
+    1.00952172f, 1.00974953f, 1.00997734f, 1.01020527f, 1.0104332f, 1.01066124f,
+    1.01088929f, 1.01111746f, 1.01134562f, 1.01157379f, 1.01180208f, 1.01203036f,
+    1.01225877f, 1.01248717f, 1.0127157f, 1.01294422f, 1.01317275f, 1.01340139f,
+    1.01363003f, 1.0138588f, 1.01408756f, 1.01431644f, 1.01454532f, 1.01477432f,
+    1.01500332f, 1.01523232f, 1.01546144f, 1.01569057f, 1.0159198f, 1.01614904f,
+    1.01637828f, 1.01660764f, 1.01683712f, 1.01706648f, 1.01729608f, 1.01752555f,
+    1.01775527f, 1.01798487f, 1.01821458f, 1.01844442f, 1.01867425f, 1.01890409f,
+    1.01913404f, 1.019364f, 1.01959395f, 1.01982403f, 1.02005422f, 1.02028441f,
+    1.02051461f, 1.02074492f, 1.02097523f, 1.02120566f, 1.0214361f, 1.02166665f,
+    1.0218972f, 1.02212775f, 1.02235842f, 1.02258909f, 1.02281988f, 1.02305067f,
+    1.02328157f, 1.02351248f, 1.02374339f, 1.02397442f, 1.02420545f, 1.02443659f,
+    1.02466774f, 1.02489901f, 1.02513027f, 1.02536166f, 1.02559304f, 1.02582443f,
+    1.02605593f, 1.02628744f, 1.02651906f, 1.02675068f, 1.02698243f, 1.02721417f,
+    1.02744591f, 1.02767777f, 1.02790976f, 1.02814162f, 1.02837372f, 1.0286057f,
+    1.0288378f, 1.02907002f, 1.02930224f, 1.02953446f, 1.0297668f, 1.02999926f,
+    1.0302316f, 1.03046417f, 1.03069663f, 1.03092921f, 1.0311619f, 1.0313946f,
+    1.0316273f, 1.03186011f, 1.03209293f, 1.03232586f, 1.0325588f, 1.03279185f,
+    1.03302491f, 1.03325796f, 1.03349113f, 1.03372443f, 1.0339576f, 1.03419101f,
+    1.0344243f, 1.03465772f, 1.03489125f, 1.03512478f, 1.03535831f, 1.03559196f,
+    1.03582573f, 1.03605938f, 1.03629327f, 1.03652704f, 1.03676093f, 1.03699493f,
+    1.03722894f, 1.03746295f, 1.03769708f, 1.03793132f, 1.03816545f, 1.03839982f,
+    1.03863406f, 1.03886843f, 1.03910291f, 1.0393374f, 1.03957188f, 1.03980649f,
+    1.04004121f, 1.04027581f, 1.04051065f, 1.04074538f, 1.04098022f, 1.04121518f,
+    1.04145014f, 1.0416851f, 1.04192019f, 1.04215527f, 1.04239047f, 1.04262567f,
+    1.04286098f, 1.0430963f, 1.04333174f, 1.04356718f, 1.04380262f, 1.04403818f,
+    1.04427373f, 1.04450941f, 1.04474509f, 1.04498088f, 1.04521668f, 1.04545259f,
+    1.04568851f, 1.04592443f, 1.04616046f, 1.04639649f, 1.04663265f, 1.0468688f,
+    1.04710507f, 1.04734135f, 1.04757774f, 1.04781413f, 1.04805052f, 1.04828703f,
+    1.04852366f, 1.04876029f, 1.04899693f, 1.04923368f, 1.04947042f, 1.04970717f,
+    1.04994404f, 1.05018103f, 1.05041802f, 1.05065501f, 1.05089211f, 1.05112922f,
+    1.05136645f, 1.05160367f, 1.05184102f, 1.05207837f, 1.05231583f, 1.0525533f,
+    1.05279076f, 1.05302835f, 1.05326593f, 1.05350363f, 1.05374134f, 1.05397916f,
+    1.05421698f, 1.05445492f, 1.05469286f, 1.05493081f, 1.05516887f, 1.05540705f,
+    1.05564523f, 1.05588341f, 1.05612171f, 1.05636001f, 1.05659842f, 1.05683684f,
+    1.05707526f, 1.0573138f, 1.05755246f, 1.05779111f, 1.05802977f, 1.05826855f,
+    1.05850732f, 1.05874622f, 1.05898511f, 1.05922413f,
+};
+
 static float midiFreq (uint8_t note, uint8_t bend) {
-    return powf(2.0f, ((float)note - 69.0f + (float)bend / 256.0f) / 12.0f) * 440.0f;
+    if (note >= 128) {
+        // Out of MIDI's range, too high to hear
+        return powf(2.0f, ((float)note - 69.0f + (float)bend / 256.0f) / 12.0f) * 440.0f;
+    }
+    return noteFrequencies[note] * bendRatios[bend];
+}
+
+#endif
+
+w4_Apu* w4_apuCreate () {
+    w4_Apu* apu = xmalloc(sizeof(w4_Apu));
+    memset(apu, 0, sizeof(w4_Apu));
+    apu->channels[3].noise.seed = 0x0001;
+    return apu;
 }
 
-void w4_apuInit () {
-    channels[3].noise.seed = 0x0001;
+void w4_apuDestroy (w4_Apu* apu) {
+    free(apu);
 }
 
-void w4_apuTick () {
-    ticks++;
+void w4_apuTick (w4_Apu* apu) {
+    apu->ticks++;
 }
 
-void w4_apuTone (int frequency, int duration, int volume, int flags) {
+void w4_apuTone (w4_Apu* apu, int frequency, int duration, int volume, int flags) {
     int freq1 = frequency & 0xffff;
     int freq2 = (frequency >> 16) & 0xffff;
 
@@ -156,19 +365,22 @@ void w4_apuTone (int frequency, int duration, int volume, int flags) {
     int pan = (flags >> 4) & 0x3;
     int noteMode = flags & 0x40;
 
+    unsigned long long time = apu->time;
+    unsigned long long ticks = apu->ticks;
+
     // TODO(2022-01-08): Thread safety
-    Channel* channel = &channels[channelIdx];
+    Channel* channel = &apu->channels[channelIdx];
 
     // Restart the phase if this channel wasn't already playing
     if (time > channel->releaseTime && ticks != channel->endTick) {
-        channel->phase = (channelIdx == 2) ? 0.25 : 0;
+        channel->phase = (channelIdx == 2) ? PHASE_ONE/4 : 0;
     }
     if (noteMode) {
         channel->freq1 = midiFreq(freq1 & 0xff, freq1 >> 8);
         channel->freq2 = (freq2 == 0) ? 0 : midiFreq(freq2 & 0xff, freq2 >> 8);
     } else {
-        channel->freq1 = freq1;
-        channel->freq2 = freq2;
+        channel->freq1 = freq1 * FREQ_ONE;
+        channel->freq2 = freq2 * FREQ_ONE;
     }
     channel->startTime = time;
     channel->attackTime = channel->startTime + SAMPLE_RATE*attack/60;
@@ -184,13 +396,13 @@ void w4_apuTone (int frequency, int duration, int volume, int flags) {
     if (channelIdx == 0 || channelIdx == 1) {
         switch (mode) {
         case 0:
-            channel->pulse.dutyCycle = 0.125f;
+            channel->pulse.dutyCycle = PHASE_ONE/8;
             break;
         case 1: case 3: default:
-            channel->pulse.dutyCycle = 0.25f;
+            channel->pulse.dutyCycle = PHASE_ONE/4;
             break;
         case 2:
-            channel->pulse.dutyCycle = 0.5f;
+            channel->pulse.dutyCycle = PHASE_ONE/2;
             break;
         }
 
@@ -201,71 +413,552 @@ void w4_apuTone (int frequency, int duration, int volume, int flags) {
     }
 }
 
-void w4_apuWriteSamples (int16_t* output, unsigned long frames) {
-    for (int ii = 0; ii < frames; ++ii, ++time) {
-        int16_t mix_left = 0, mix_right = 0;
+// The xorshift that generates noise is linear over the bits of its seed, so each step is a 16x16
+// bit matrix, stored as the bits each bit of the seed flips. These are that matrix raised to each
+// power of two, so any number of steps can be taken at once with at most 16 multiplications.
+static const uint16_t noiseJumps[16][16] = {
+    { 0x0201, 0x0402, 0x0804, 0x1008, 0x2011, 0x4022, 0x8044, 0x0281,
+      0x0502, 0x0a04, 0x1408, 0x2811, 0x5022, 0xa045, 0x4082, 0x8104 },
+    { 0x0805, 0x100a, 0x2015, 0x402a, 0x8255, 0x04a2, 0x0944, 0x0a84,
+      0x1508, 0x2a11, 0x5422, 0xaa44, 0x5480, 0xab00, 0x4601, 0x8c02 },
+    { 0x8254, 0x04a0, 0x0145, 0x1283, 0x0512, 0x4a0e, 0x961d, 0xaac4,
+      0x5580, 0xa105, 0x520b, 0x8e06, 0x4c27, 0xb25f, 0x3037, 0x626e },
+    { 0x5121, 0xb2c1, 0x408c, 0xc112, 0x0639, 0x0852, 0x49c7, 0xc2ae,
+      0xd15f, 0x06a0, 0x4962, 0x1a83, 0x2185, 0x3b2e, 0x36d5, 0xe818 },
+    { 0x9f7c, 0x2e5b, 0x75e5, 0xbb6a, 0xd19a, 0xe7bc, 0xd50c, 0x21ce,
+      0x0397, 0x853e, 0x0e5d, 0x1ce8, 0x3972, 0xecda, 0xc994, 0x384b },
+    { 0xb880, 0x758a, 0xe811, 0xd023, 0xae5f, 0x4c96, 0x0be8, 0xfb5b,
+      0xb23f, 0xe373, 0xc2ee, 0x83d3, 0x07a6, 0xbfd9, 0x6b11, 0x1601 },
+    { 0xd6f6, 0xfd4d, 0x57c5, 0xfb2a, 0x5b19, 0xe2b3, 0xbe99, 0xaf6e,
+      0x5afc, 0xb7ae, 0x6ffe, 0xd4ab, 0xb9f4, 0x8840, 0x1088, 0x9ebb },
+    { 0xed42, 0x9aae, 0xbb14, 0x62aa, 0xe640, 0x8ca2, 0x7a5f, 0x4d74,
+      0xcecb, 0x31dc, 0x3730, 0xc575, 0xdec0, 0xf489, 0xedb0, 0xede1 },
+    { 0x28a7, 0x454e, 0xa09e, 0x1137, 0x886b, 0x44dc, 0x011d, 0x7a97,
+      0xe1a5, 0xec57, 0x888c, 0xbf41, 0x2a23, 0xdfb4, 0xefc0, 0x9e9d },
+    { 0x93c9, 0x7313, 0x4732, 0xca46, 0x18c3, 0x2504, 0xf0c0, 0x76ca,
+      0xf93e, 0xdd25, 0xeae2, 0x788f, 0xa597, 0x77ff, 0xef5c, 0x04d6 },
+    { 0x5adf, 0xe136, 0x6f71, 0x8ac1, 0xbbc8, 0x2311, 0xbfe8, 0x35ac,
+      0x7bf3, 0xd4b1, 0xe9c2, 0x5edf, 0xa914, 0x25ae, 0x4f74, 0x400a },
+    { 0x03db, 0x47bd, 0x0f6b, 0x1aff, 0x3da8, 0x6bfb, 0xf77b, 0xed86,
+      0x9b27, 0xb802, 0x648e, 0xea19, 0x9431, 0xa5a4, 0x1f6b, 0x2483 },
+    { 0x5ae9, 0xf55a, 0x6fab, 0xdb76, 0xb8a7, 0x61c4, 0xb267, 0x2eac,
+      0x5978, 0xb8b2, 0x61ee, 0xe8db, 0x81b4, 0xf798, 0xfb9a, 0x68ca },
+    { 0x56d7, 0xf906, 0x5f50, 0xea00, 0x794d, 0xa61a, 0xb5ef, 0x3daa,
+      0x7bff, 0xf4a8, 0xe9f2, 0xdcba, 0xa9d6, 0x2825, 0x544a, 0x563e },
+    { 0xe14f, 0x8294, 0x8b21, 0x0243, 0x2494, 0x090a, 0x711e, 0x47f2,
+      0xcbc7, 0x1bc5, 0x2300, 0x6f11, 0x8e00, 0x5b02, 0xb287, 0x73c7 },
+    { 0xca22, 0x8045, 0x2491, 0x0900, 0x9045, 0x2401, 0x8320, 0xd863,
+      0xa045, 0x6d91, 0x8b00, 0xb04d, 0x2413, 0x0100, 0x1208, 0x6991 },
+};
+
+// The xorshift cycles through every nonzero seed
+#define NOISE_PERIOD 65535
+
+// Fewer steps than this are quicker to take one at a time
+#define NOISE_JUMP_MIN 32
+
+static uint16_t noiseStep (uint16_t seed) {
+    seed ^= seed >> 7;
+    seed ^= seed << 9;
+    seed ^= seed >> 13;
+    return seed;
+}
+
+/** Advances the noise seed by a number of steps, in bounded time however many. */
+static uint16_t noiseJump (uint16_t seed, uint32_t steps) {
+    steps %= NOISE_PERIOD;
+    for (int bit = 0; steps > 0; ++bit, steps >>= 1) {
+        if (steps & 1) {
+            const uint16_t* matrix = noiseJumps[bit];
+            uint16_t jumped = 0;
+            for (int ii = 0; ii < 16; ++ii) {
+                jumped ^= matrix[ii] & -((seed >> ii) & 1);
+            }
+            seed = jumped;
+        }
+    }
+    return seed;
+}
+
+// Each channel is rendered into its own buffer, in blocks over which its frequency and volume
+// change linearly, between the breakpoints of its envelope.
+
+#if defined(W4_APU_FIXED)
+
+/** Converts a frequency ramp to a ramp of phase increments per sample. */
+static Ramp phaseIncrements (Ramp freq) {
+    Ramp inc = {
+        freq.value * (PHASE_ONE / FREQ_ONE) / SAMPLE_RATE,
+        freq.step * (PHASE_ONE / FREQ_ONE) / SAMPLE_RATE,
+    };
+    return inc;
+}
+
+/** How far the noise channel's phase moves per sample at a frequency, freq^2 / 1000000 cycles. */
+static Phase noiseSteps (Frequency freq) {
+    return (int64_t)freq * freq * (PHASE_ONE / FREQ_ONE / FREQ_ONE) / 1000000;
+}
+
+static void renderPulse (Channel* channel, int32_t* output, int frames, Ramp freq, Ramp volume) {
+    Ramp inc = phaseIncrements(freq);
+    Phase phase = channel->phase;
+    Phase dutyCycle = channel->pulse.dutyCycle;
+    for (int ii = 0; ii < frames; ++ii) {
+        Phase phaseInc = (inc.value + ii*inc.step) >> RAMP_SHIFT;
+        int32_t currentVolume = (volume.value + ii*volume.step) >> RAMP_SHIFT;
+        phase += phaseInc;
+        while (phase >= PHASE_ONE) {
+            phase -= PHASE_ONE;
+        }
+
+        // The same polyBLEP as with floats, only dividing by the increment near an edge
+        bool high = phase < dutyCycle;
+        Phase sinceEdge = high ? phase : phase - dutyCycle;
+        Phase untilEdge = high ? dutyCycle - phase : PHASE_ONE - phase;
+        int64_t level = LEVEL_ONE;
+        if (sinceEdge < phaseInc) {
+            int64_t t = LEVEL_ONE - sinceEdge * LEVEL_ONE / phaseInc;
+            level = LEVEL_ONE - t*t / LEVEL_ONE;
+        } else if (untilEdge < phaseInc) {
+            int64_t t = untilEdge * LEVEL_ONE / phaseInc;
+            level = t*t / LEVEL_ONE;
+        }
+        // Divided rather than shifted, so negative samples round towards zero like positive ones
+        output[ii] = (high ? currentVolume : -currentVolume) * level / LEVEL_ONE;
+    }
+    channel->phase = phase;
+}
+
+static void renderTriangle (Channel* channel, int32_t* output, int frames, Ramp freq, Ramp volume) {
+    Ramp inc = phaseIncrements(freq);
+    Phase phase = channel->phase;
+    for (int ii = 0; ii < frames; ++ii) {
+        int32_t currentVolume = (volume.value + ii*volume.step) >> RAMP_SHIFT;
+        phase += (inc.value + ii*inc.step) >> RAMP_SHIFT;
+        while (phase >= PHASE_ONE) {
+            phase -= PHASE_ONE;
+        }
+        Phase distance = 2*phase - PHASE_ONE;
+        if (distance < 0) {
+            distance = -distance;
+        }
+        output[ii] = currentVolume * (2*distance - PHASE_ONE) / PHASE_ONE;
+    }
+    channel->phase = phase;
+}
+
+static void renderNoise (Channel* channel, int32_t* output, int frames, Ramp freq, Ramp volume) {
+    Phase phase = channel->phase;
+    uint16_t seed = channel->noise.seed;
+    int16_t lastRandom = channel->noise.lastRandom;
+    Phase steps = noiseSteps(freq.value >> RAMP_SHIFT);
+    for (int ii = 0; ii < frames; ++ii) {
+        if (freq.step != 0) {
+            steps = noiseSteps((freq.value + ii*freq.step) >> RAMP_SHIFT);
+        }
+        int32_t currentVolume = (volume.value + ii*volume.step) >> RAMP_SHIFT;
+        phase += steps;
+        if (phase > NOISE_JUMP_MIN * PHASE_ONE) {
+            Phase jump = phase / PHASE_ONE;
+            phase -= jump * PHASE_ONE;
+            seed = noiseJump(seed, jump);
+            lastRandom = 2 * (seed & 0x1) - 1;
+        }
+        while (phase > 0) {
+            phase -= PHASE_ONE;
+            seed = noiseStep(seed);
+            lastRandom = 2 * (seed & 0x1) - 1;
+        }
+        output[ii] = currentVolume * lastRandom;
+    }
+    channel->phase = phase;
+    channel->noise.seed = seed;
+    channel->noise.lastRandom = lastRandom;
+}
+
+#else
+
+static void renderPulse (Channel* channel, int32_t* output, int frames, Ramp freq, Ramp volume) {
+    float phase = channel->phase;
+    float dutyCycle = channel->pulse.dutyCycle;
+    float phaseInc = freq.value / SAMPLE_RATE;
+    float samplesPerCycle = SAMPLE_RATE / freq.value;
+    for (int ii = 0; ii < frames; ++ii) {
+        if (freq.step != 0) {
+            float currentFreq = freq.value + ii*freq.step;
+            phaseInc = currentFreq / SAMPLE_RATE;
+            samplesPerCycle = SAMPLE_RATE / currentFreq;
+        }
+        int16_t currentVolume = (int)(volume.value + ii*volume.step);
+        phase += phaseInc;
+        if (phase >= 1) {
+            phase--;
+        }
+
+        // Smooth the edges at either end of the high and low parts with a polyBLEP. This is the
+        // same as mapping each part to 0->1 first, but the duty cycle cancels out.
+        bool high = phase < dutyCycle;
+        float sinceEdge = high ? phase : phase - dutyCycle;
+        float untilEdge = high ? dutyCycle - phase : 1 - phase;
+        float level = 1;
+        if (sinceEdge < phaseInc) {
+            float t = 1 - sinceEdge * samplesPerCycle;
+            level = 1 - t*t;
+        } else if (untilEdge < phaseInc) {
+            float t = untilEdge * samplesPerCycle;
+            level = t*t;
+        }
+        int16_t sample = (high ? currentVolume : -currentVolume) * level;
+
+        output[ii] = sample;
+    }
+    channel->phase = phase;
+}
+
+static void renderTriangle (Channel* channel, int32_t* output, int frames, Ramp freq, Ramp volume) {
+    float phase = channel->phase;
+    float phaseInc = freq.value / SAMPLE_RATE;
+    for (int ii = 0; ii < frames; ++ii) {
+        if (freq.step != 0) {
+            phaseInc = (freq.value + ii*freq.step) / SAMPLE_RATE;
+        }
+        int16_t currentVolume = (int)(volume.value + ii*volume.step);
+        phase += phaseInc;
+        if (phase >= 1) {
+            phase--;
+        }
+        int16_t sample = currentVolume * (2*fabsf(2*phase - 1) - 1);
+
+        output[ii] = sample;
+    }
+    channel->phase = phase;
+}
+
+static void renderNoise (Channel* channel, int32_t* output, int frames, Ramp freq, Ramp volume) {
+    float phase = channel->phase;
+    uint16_t seed = channel->noise.seed;
+    int16_t lastRandom = channel->noise.lastRandom;
+    float steps = freq.value * freq.value / (1000000.f/44100 * SAMPLE_RATE);
+    for (int ii = 0; ii < frames; ++ii) {
+        if (freq.step != 0) {
+            float currentFreq = freq.value + ii*freq.step;
+            steps = currentFreq * currentFreq / (1000000.f/44100 * SAMPLE_RATE);
+        }
+        int16_t currentVolume = (int)(volume.value + ii*volume.step);
+        phase += steps;
+        if (phase > NOISE_JUMP_MIN) {
+            // Subtracting the whole steps together is exact, like one at a time
+            uint32_t jump = phase;
+            phase -= jump;
+            seed = noiseJump(seed, jump);
+            lastRandom = 2 * (seed & 0x1) - 1;
+        }
+        while (phase > 0) {
+            phase--;
+            seed = noiseStep(seed);
+            lastRandom = 2 * (seed & 0x1) - 1;
+        }
+        int16_t sample = currentVolume * lastRandom;
+
+        output[ii] = sample;
+    }
+    channel->phase = phase;
+    channel->noise.seed = seed;
+    channel->noise.lastRandom = lastRandom;
+}
+
+#endif
+
+#if defined(MIX_VECTOR)
+
+/** Saturates 4 frames of each side to 16 bits and stores them interleaved. */
+static inline void storeStereo (int16_t* output, Lanes left, Lanes right) {
+#if defined(__ARM_NEON)
+    int16x4x2_t stereo = {{ vqmovn_s32((int32x4_t)left), vqmovn_s32((int32x4_t)right) }};
+    vst2_s16(output, stereo);
+#else
+    __m128i lo = _mm_unpacklo_epi32((__m128i)left, (__m128i)right);
+    __m128i hi = _mm_unpackhi_epi32((__m128i)left, (__m128i)right);
+    _mm_storeu_si128((__m128i*)output, _mm_packs_epi32(lo, hi));
+#endif
+}
+
+#endif
+
+static int16_t saturate (int32_t sample) {
+    return sample > INT16_MAX ? INT16_MAX : (sample < INT16_MIN ? INT16_MIN : sample);
+}
 
+/**
+ * Sums the four channel buffers into interleaved stereo. Each channel is masked out of the sides
+ * it isn't panned to, so every channel is mixed whether it's playing or not.
+ */
+static void mix (int16_t* output, int32_t samples[4][MIX_FRAMES], const int32_t leftMask[4],
+        const int32_t rightMask[4], int frames) {
+    int ii = 0;
+#if defined(MIX_VECTOR)
+    for (; ii + 4 <= frames; ii += 4) {
+        Lanes left = {0}, right = {0};
         for (int channelIdx = 0; channelIdx < 4; ++channelIdx) {
-            Channel* channel = &channels[channelIdx];
-
-            if (time < channel->releaseTime || ticks == channel->endTick) {
-                float freq = getCurrentFrequency(channel);
-                int16_t volume = getCurrentVolume(channel);
-                int16_t sample;
-
-                if (channelIdx == 3) {
-                    // Noise channel
-                    channel->phase += freq * freq / (1000000.f/44100 * SAMPLE_RATE);
-                    while (channel->phase > 0) {
-                        channel->phase--;
-                        channel->noise.seed ^= channel->noise.seed >> 7;
-                        channel->noise.seed ^= channel->noise.seed << 9;
-                        channel->noise.seed ^= channel->noise.seed >> 13;
-                        channel->noise.lastRandom = 2 * (channel->noise.seed & 0x1) - 1;
-                    }
-                    sample = volume * channel->noise.lastRandom;
-
-                } else {
-                    float phaseInc = freq / SAMPLE_RATE;
-                    channel->phase += phaseInc;
-
-                    if (channel->phase >= 1) {
-                        channel->phase--;
-                    }
-
-                    if (channelIdx == 2) {
-                        // Triangle channel
-                        sample = volume * (2*fabs(2*channel->phase - 1) - 1);
-
-                    } else {
-                        // Pulse channel
-                        float dutyPhase, dutyPhaseInc;
-                        int16_t multiplier;
-
-                        // Map duty to 0->1
-                        if (channel->phase < channel->pulse.dutyCycle) {
-                            dutyPhase = channel->phase / channel->pulse.dutyCycle;
-                            dutyPhaseInc = phaseInc / channel->pulse.dutyCycle;
-                            multiplier = volume;
-                        } else {
-                            dutyPhase = (channel->phase - channel->pulse.dutyCycle) / (1.f - channel->pulse.dutyCycle);
-                            dutyPhaseInc = phaseInc / (1.f - channel->pulse.dutyCycle);
-                            multiplier = -volume;
-                        }
-                        sample = multiplier * polyblep(dutyPhase, dutyPhaseInc);
-                    }
-                }
-
-                if (channel->pan != 1) {
-                    mix_right += sample;
-                }
-                if (channel->pan != 2) {
-                    mix_left += sample;
-                }
+            Lanes channel;
+            memcpy(&channel, &samples[channelIdx][ii], sizeof(channel));
+            left += channel & leftMask[channelIdx];
+            right += channel & rightMask[channelIdx];
+        }
+        storeStereo(&output[2*ii], left, right);
+    }
+#endif
+    for (; ii < frames; ++ii) {
+        int32_t left = 0, right = 0;
+        for (int channelIdx = 0; channelIdx < 4; ++channelIdx) {
+            left += samples[channelIdx][ii] & leftMask[channelIdx];
+            right += samples[channelIdx][ii] & rightMask[channelIdx];
+        }
+        output[2*ii] = saturate(left);
+        output[2*ii+1] = saturate(right);
+    }
+}
+
+static void writeBlock (w4_Apu* apu, int16_t* output, int frames) {
+    unsigned long long startTime = apu->time;
+    unsigned long long endTime = startTime + frames;
+    unsigned long long ticks = apu->ticks;
+
+    int32_t samples[4][MIX_FRAMES];
+    int32_t leftMask[4], rightMask[4];
+    memset(samples, 0, sizeof(samples));
+
+    for (int channelIdx = 0; channelIdx < 4; ++channelIdx) {
+        Channel* channel = &apu->channels[channelIdx];
+        leftMask[channelIdx] = (channel->pan != 2) ? -1 : 0;
+        rightMask[channelIdx] = (channel->pan != 1) ? -1 : 0;
+
+        // A tone plays until its release, or through this tick if it ends on it
+        unsigned long long playEnd = (ticks == channel->endTick) ? endTime
+            : (channel->releaseTime < endTime ? channel->releaseTime : endTime);
+
+        for (unsigned long long time = startTime; time < playEnd; ) {
+            Ramp freq, volume;
+            unsigned long long blockEnd = playEnd;
+            unsigned long long freqEnd = getFrequencyRamp(channel, time, &freq);
+            unsigned long long volumeEnd = getVolumeRamp(channel, time, &volume);
+            if (freqEnd < blockEnd) {
+                blockEnd = freqEnd;
+            }
+            if (volumeEnd < blockEnd) {
+                blockEnd = volumeEnd;
             }
+
+            int32_t* blockOutput = &samples[channelIdx][time - startTime];
+            int blockFrames = blockEnd - time;
+            switch (channelIdx) {
+            case 0: case 1:
+                renderPulse(channel, blockOutput, blockFrames, freq, volume);
+                break;
+            case 2:
+                renderTriangle(channel, blockOutput, blockFrames, freq, volume);
+                break;
+            case 3:
+                renderNoise(channel, blockOutput, blockFrames, freq, volume);
+                break;
+            }
+            time = blockEnd;
         }
+    }
+
+    mix(output, samples, leftMask, rightMask, frames);
+    apu->time = endTime;
+}
+
+void w4_apuWriteSamples (w4_Apu* apu, int16_t* output, unsigned long frames) {
+    while (frames > 0) {
+        int blockFrames = frames < MIX_FRAMES ? frames : MIX_FRAMES;
+        writeBlock(apu, output, blockFrames);
+        output += 2*blockFrames;
+        frames -= blockFrames;
+    }
+}
+
+static uint8_t* write64 (uint8_t* out, unsigned long long value) {
+    w4_write32LE(out, value);
+    w4_write32LE(out + 4, value >> 32);
+    return out + 8;
+}
+
+static uint8_t* write32 (uint8_t* out, uint32_t value) {
+    w4_write32LE(out, value);
+    return out + 4;
+}
 
-        *output++ = mix_left;
-        *output++ = mix_right;
+static uint8_t* write16 (uint8_t* out, uint16_t value) {
+    w4_write16LE(out, value);
+    return out + 2;
+}
+
+static uint8_t* writef32 (uint8_t* out, float value) {
+    uint32_t bits;
+    memcpy(&bits, &value, 4);
+    return write32(out, bits);
+}
+
+static const uint8_t* read64 (const uint8_t* in, unsigned long long* value) {
+    *value = w4_read32LE(in) | (unsigned long long)w4_read32LE(in + 4) << 32;
+    return in + 8;
+}
+
+static const uint8_t* read32 (const uint8_t* in, uint32_t* value) {
+    *value = w4_read32LE(in);
+    return in + 4;
+}
+
+static const uint8_t* read16 (const uint8_t* in, uint16_t* value) {
+    *value = w4_read16LE(in);
+    return in + 2;
+}
+
+static const uint8_t* readf32 (const uint8_t* in, float* value) {
+    uint32_t bits = w4_read32LE(in);
+    memcpy(value, &bits, 4);
+    return in + 4;
+}
+
+static const uint8_t* readFrequency (const uint8_t* in, Frequency* freq) {
+    float value;
+    in = readf32(in, &value);
+#if defined(W4_APU_FIXED)
+    if (!(value > 0)) {
+        *freq = 0;
+    } else if (value >= (float)MAX_FREQUENCY / FREQ_ONE) {
+        *freq = MAX_FREQUENCY;
+    } else {
+        *freq = value * FREQ_ONE;
+    }
+#else
+    *freq = value;
+#endif
+    return in;
+}
+
+/** Reads a phase, which counts up to 0 for noise and wraps at 1 for the other channels. */
+static const uint8_t* readPhase (const uint8_t* in, Phase* phase, bool noise) {
+    float value;
+    in = readf32(in, &value);
+#if defined(W4_APU_FIXED)
+    // Out of range phases would stall the channel, or divide by zero in renderPulse
+    bool valid = noise ? (value > -1 && value <= 0) : (value >= 0 && value < 1);
+    *phase = valid ? value * PHASE_ONE : 0;
+#else
+    (void)noise;
+    *phase = value;
+#endif
+    return in;
+}
+
+void w4_apuSerialize (const w4_Apu* apu, uint8_t* dest) {
+    uint8_t* out = dest;
+    *out++ = SERIALIZED_VERSION;
+    *out++ = 0;
+    out = write64(out, apu->time);
+    out = write64(out, apu->ticks);
+
+    for (int channelIdx = 0; channelIdx < 4; ++channelIdx) {
+        const Channel* channel = &apu->channels[channelIdx];
+        out = writef32(out, (float)channel->freq1 / FREQ_ONE);
+        out = writef32(out, (float)channel->freq2 / FREQ_ONE);
+
+        // The envelope is at most a few seconds long, so store its phases relative to the start
+        out = write64(out, channel->startTime);
+        out = write32(out, channel->attackTime - channel->startTime);
+        out = write32(out, channel->decayTime - channel->startTime);
+        out = write32(out, channel->sustainTime - channel->startTime);
+        out = write32(out, channel->releaseTime - channel->startTime);
+        out = write64(out, channel->endTick);
+
+        out = write16(out, channel->sustainVolume);
+        out = write16(out, channel->peakVolume);
+        out = writef32(out, (float)channel->phase / PHASE_ONE);
+        *out++ = channel->pan;
+
+        if (channelIdx == 3) {
+            out = write16(out, channel->noise.seed);
+            out = write16(out, channel->noise.lastRandom);
+        } else {
+            out = writef32(out, (float)channel->pulse.dutyCycle / PHASE_ONE);
+        }
+    }
+}
+
+bool w4_apuUnserialize (w4_Apu* apu, const uint8_t* src) {
+    const uint8_t* in = src;
+    if (*in != SERIALIZED_VERSION) {
+        unsigned long long time = apu->time;
+        memset(apu, 0, sizeof(w4_Apu));
+        apu->channels[3].noise.seed = 0x0001;
+        apu->time = time;
+        return false;
+    }
+    in += 2;
+
+    // The audio device has already played up to the current time, so keep the clock running and
+    // move the tones to be relative to it instead. A clock that's behind, like in a fresh APU,
+    // can simply jump ahead.
+    unsigned long long savedTime;
+    in = read64(in, &savedTime);
+    unsigned long long timeOffset = 0;
+    if (apu->time >= savedTime) {
+        timeOffset = apu->time - savedTime;
+    } else {
+        apu->time = savedTime;
+    }
+    in = read64(in, &apu->ticks);
+
+    for (int channelIdx = 0; channelIdx < 4; ++channelIdx) {
+        Channel* channel = &apu->channels[channelIdx];
+        in = readFrequency(in, &channel->freq1);
+        in = readFrequency(in, &channel->freq2);
+
+        uint32_t attack, decay, sustain, release;
+        in = read64(in, &channel->startTime);
+        channel->startTime += timeOffset;
+        in = read32(in, &attack);
+        in = read32(in, &decay);
+        in = read32(in, &sustain);
+        in = read32(in, &release);
+        channel->attackTime = channel->startTime + attack;
+        channel->decayTime = channel->startTime + decay;
+        channel->sustainTime = channel->startTime + sustain;
+        channel->releaseTime = channel->startTime + release;
+        in = read64(in, &channel->endTick);
+
+        uint16_t sustainVolume, peakVolume;
+        in = read16(in, &sustainVolume);
+        in = read16(in, &peakVolume);
+        channel->sustainVolume = sustainVolume;
+        channel->peakVolume = peakVolume;
+        in = readPhase(in, &channel->phase, channelIdx == 3);
+        channel->pan = *in++;
+
+        if (channelIdx == 3) {
+            uint16_t lastRandom;
+            in = read16(in, &channel->noise.seed);
+            in = read16(in, &lastRandom);
+            channel->noise.lastRandom = lastRandom;
+        } else {
+            in = readPhase(in, &channel->pulse.dutyCycle, false);
+        }
+    }
+    return true;
+}
+
+void w4_apuClearPlayback (uint8_t* serialized) {
+    memset(&serialized[2], 0, 8); // time
+
+    for (int channelIdx = 0; channelIdx < 4; ++channelIdx) {
+        uint8_t* channel = &serialized[18 + 53*channelIdx];
+        memset(&channel[8], 0, 8); // startTime
+        memset(&channel[44], 0, 4); // phase
+        if (channelIdx == 3) {
+            memset(&channel[49], 0, 4); // noise seed and lastRandom
+        }
     }
 }
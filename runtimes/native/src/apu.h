@@ -1,12 +1,35 @@
 #pragma once
 
+#include <stdbool.h>
 #include <stdint.h>
 #include <stddef.h>
 
-void w4_apuInit ();
+/** The size of a serialized APU, in a fixed little-endian layout. */
+#define W4_APU_SERIALIZED_SIZE 230
 
-void w4_apuTick ();
+/** The sound state of one instance. */
+typedef struct w4_Apu w4_Apu;
 
-void w4_apuTone (int frequency, int duration, int volume, int flags);
+w4_Apu* w4_apuCreate ();
+void w4_apuDestroy (w4_Apu* apu);
 
-void w4_apuWriteSamples (int16_t* output, unsigned long frames);
+void w4_apuTick (w4_Apu* apu);
+
+void w4_apuTone (w4_Apu* apu, int frequency, int duration, int volume, int flags);
+
+void w4_apuWriteSamples (w4_Apu* apu, int16_t* output, unsigned long frames);
+
+/** Writes W4_APU_SERIALIZED_SIZE bytes describing the playing tones and timing. */
+void w4_apuSerialize (const w4_Apu* apu, uint8_t* dest);
+
+/**
+ * Restores a serialized APU. The sample clock isn't rewound, tones continue from where they were
+ * relative to it. Returns false and silences the APU if the layout is unknown.
+ */
+bool w4_apuUnserialize (w4_Apu* apu, const uint8_t* src);
+
+/**
+ * Zeroes the parts of a serialized APU that depend on how much audio the device has played, rather
+ * than on what the cart did: the sample clock and the oscillators. What's left is deterministic.
+ */
+void w4_apuClearPlayback (uint8_t* serialized);
@@ -0,0 +1,211 @@
+
+#include "batch.h"
+
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../instance.h"
+#include "../util.h"
+#include "../wasm.h"
+#include "thread.h"
+
+typedef struct {
+    /** The next instance to claim from this worker's slice, and the end of the slice. */
+    volatile long next;
+    long end;
+
+    w4_Batch* batch;
+    int idx;
+    w4_Thread thread;
+
+    // Keep each worker's counter on its own cache line
+    char _padding[64];
+} Worker;
+
+struct w4_Batch {
+    int count;
+    w4_Instance** instances;
+    w4_Disk* disks;
+
+    /** Worker 0 is the thread calling w4_batchStep, the others are owned by the batch. */
+    int threadCount;
+    Worker* workers;
+
+    w4_Mutex mutex;
+    w4_Cond wake;
+    w4_Cond done;
+    unsigned long generation;
+    int running;
+    bool quit;
+
+    // Arguments of the step in progress
+    const uint8_t* actions;
+    uint8_t* framebuffers;
+    int16_t* samples;
+};
+
+static void stepInstance (w4_Batch* batch, int idx) {
+    w4_Instance* instance = batch->instances[idx];
+
+    if (batch->actions) {
+        const uint8_t* action = &batch->actions[4*idx];
+        for (int player = 0; player < 4; ++player) {
+            w4_runtimeSetGamepad(instance, player, action[player]);
+        }
+    }
+
+    w4_runtimeUpdate(instance);
+
+    if (batch->framebuffers) {
+        memcpy(&batch->framebuffers[idx*W4_BATCH_FRAMEBUFFER_SIZE], instance->memory->framebuffer,
+            W4_BATCH_FRAMEBUFFER_SIZE);
+    }
+    if (batch->samples) {
+        w4_runtimeWriteSamples(instance, &batch->samples[idx*2*W4_BATCH_SAMPLE_FRAMES],
+            W4_BATCH_SAMPLE_FRAMES);
+    }
+}
+
+static void runWorker (w4_Batch* batch, int self) {
+    // Drain our own slice first, then steal from the other slices in turn
+    for (int n = 0; n < batch->threadCount; ++n) {
+        Worker* victim = &batch->workers[(self + n) % batch->threadCount];
+        long idx;
+        while ((idx = w4_atomicFetchAdd(&victim->next, 1)) < victim->end) {
+            stepInstance(batch, idx);
+        }
+    }
+}
+
+static void workerMain (void* arg) {
+    Worker* worker = arg;
+    w4_Batch* batch = worker->batch;
+    unsigned long generation = 0;
+
+    w4_mutexLock(&batch->mutex);
+    for (;;) {
+        while (batch->generation == generation && !batch->quit) {
+            w4_condWait(&batch->wake, &batch->mutex);
+        }
+        if (batch->quit) {
+            break;
+        }
+        generation = batch->generation;
+        w4_mutexUnlock(&batch->mutex);
+
+        runWorker(batch, worker->idx);
+
+        w4_mutexLock(&batch->mutex);
+        if (--batch->running == 0) {
+            w4_condBroadcast(&batch->done);
+        }
+    }
+    w4_mutexUnlock(&batch->mutex);
+}
+
+w4_Batch* w4_batchCreate (const uint8_t* wasmBuffer, int byteLength, int count, int threadCount) {
+    w4_Batch* batch = xmalloc(sizeof(w4_Batch));
+    memset(batch, 0, sizeof(w4_Batch));
+
+    batch->count = count;
+    batch->instances = xmalloc(count * sizeof(w4_Instance*));
+    batch->disks = xmalloc(count * sizeof(w4_Disk));
+    memset(batch->disks, 0, count * sizeof(w4_Disk));
+
+    for (int n = 0; n < count; ++n) {
+        w4_Instance* instance = w4_instanceCreate();
+        uint8_t* memory = w4_wasmInit(instance);
+        w4_runtimeInit(instance, memory, &batch->disks[n]);
+        w4_wasmLoadModule(instance, wasmBuffer, byteLength);
+        batch->instances[n] = instance;
+    }
+
+    if (threadCount <= 0) {
+        threadCount = w4_cpuCount();
+    }
+    if (threadCount > count) {
+        threadCount = count > 0 ? count : 1;
+    }
+    batch->threadCount = threadCount;
+    batch->workers = xmalloc(threadCount * sizeof(Worker));
+    memset(batch->workers, 0, threadCount * sizeof(Worker));
+
+    w4_mutexInit(&batch->mutex);
+    w4_condInit(&batch->wake);
+    w4_condInit(&batch->done);
+
+    for (int n = 0; n < threadCount; ++n) {
+        Worker* worker = &batch->workers[n];
+        worker->batch = batch;
+        worker->idx = n;
+        if (n > 0) {
+            w4_threadCreate(&worker->thread, workerMain, worker);
+        }
+    }
+
+    return batch;
+}
+
+void w4_batchDestroy (w4_Batch* batch) {
+    w4_mutexLock(&batch->mutex);
+    batch->quit = true;
+    w4_condBroadcast(&batch->wake);
+    w4_mutexUnlock(&batch->mutex);
+
+    for (int n = 1; n < batch->threadCount; ++n) {
+        w4_threadJoin(batch->workers[n].thread);
+    }
+
+    w4_condDestroy(&batch->done);
+    w4_condDestroy(&batch->wake);
+    w4_mutexDestroy(&batch->mutex);
+
+    for (int n = 0; n < batch->count; ++n) {
+        w4_instanceDestroy(batch->instances[n]);
+    }
+    free(batch->workers);
+    free(batch->disks);
+    free(batch->instances);
+    free(batch);
+}
+
+int w4_batchCount (const w4_Batch* batch) {
+    return batch->count;
+}
+
+uint8_t* w4_batchMemory (w4_Batch* batch, int idx) {
+    return (uint8_t*)batch->instances[idx]->memory;
+}
+
+w4_Instance* w4_batchInstance (w4_Batch* batch, int idx) {
+    return batch->instances[idx];
+}
+
+void w4_batchStep (w4_Batch* batch, const uint8_t* actions, uint8_t* framebuffers, int16_t* samples) {
+    w4_mutexLock(&batch->mutex);
+    batch->actions = actions;
+    batch->framebuffers = framebuffers;
+    batch->samples = samples;
+
+    // Split the instances into even slices, one per worker
+    for (int n = 0; n < batch->threadCount; ++n) {
+        Worker* worker = &batch->workers[n];
+        worker->next = (long)batch->count * n / batch->threadCount;
+        worker->end = (long)batch->count * (n+1) / batch->threadCount;
+    }
+
+    batch->running = batch->threadCount;
+    ++batch->generation;
+    w4_condBroadcast(&batch->wake);
+    w4_mutexUnlock(&batch->mutex);
+
+    runWorker(batch, 0);
+
+    w4_mutexLock(&batch->mutex);
+    --batch->running;
+    while (batch->running > 0) {
+        w4_condWait(&batch->done, &batch->mutex);
+    }
+    w4_mutexUnlock(&batch->mutex);
+}
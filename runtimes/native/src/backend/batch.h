@@ -0,0 +1,43 @@
+#pragma once
+
+#include <stdint.h>
+
+#include "../runtime.h"
+
+// Steps many instances of one cart in lockstep, in parallel on a thread pool. Meant for bots and
+// reinforcement learning, where throughput over many environments matters more than latency.
+//
+// Each worker thread owns a slice of the instances, and once it runs out of work it steals
+// instances from the slices of slower workers, so an expensive frame in one cart doesn't stall
+// the whole step.
+
+/** Size in bytes of one packed 2bpp framebuffer written by w4_batchStep. */
+#define W4_BATCH_FRAMEBUFFER_SIZE (160*160/4)
+
+/** Number of stereo sample frames generated per instance each step, one 60 Hz frame at 44.1 kHz. */
+#define W4_BATCH_SAMPLE_FRAMES 735
+
+typedef struct w4_Batch w4_Batch;
+
+/**
+ * Loads count instances of a cart. The stepping is done on threadCount threads including the
+ * caller, or one per CPU if threadCount is 0 or less.
+ */
+w4_Batch* w4_batchCreate (const uint8_t* wasmBuffer, int byteLength, int count, int threadCount);
+void w4_batchDestroy (w4_Batch* batch);
+
+int w4_batchCount (const w4_Batch* batch);
+
+/** The 64 KB memory of one instance, for reading rewards or poking state between steps. */
+uint8_t* w4_batchMemory (w4_Batch* batch, int idx);
+
+w4_Instance* w4_batchInstance (w4_Batch* batch, int idx);
+
+/**
+ * Runs one frame of every instance and waits for them all to finish.
+ *
+ * actions holds 4 gamepad bytes per instance (one per player). framebuffers, if not NULL,
+ * receives count framebuffers of W4_BATCH_FRAMEBUFFER_SIZE bytes back to back. samples, if not
+ * NULL, receives count blocks of W4_BATCH_SAMPLE_FRAMES interleaved stereo samples.
+ */
+void w4_batchStep (w4_Batch* batch, const uint8_t* actions, uint8_t* framebuffers, int16_t* samples);
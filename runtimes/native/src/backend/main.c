@@ -1,14 +1,18 @@
+#include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
 #include <cubeb/cubeb.h>
 
-#include "../apu.h"
+#include "../movie.h"
+#include "../rollback.h"
 #include "../runtime.h"
+#include "../trace.h"
 #include "../wasm.h"
 #include "../window.h"
 #include "../util.h"
+#include "netplay.h"
 
 #if defined(_WIN32)
 #include <windows.h>
@@ -30,14 +34,14 @@ typedef struct {
 static long audioDataCallback (cubeb_stream* stream, void* userData,
     const void* inputBuffer, void* outputBuffer, long frames)
 {
-    w4_apuWriteSamples((int16_t*)outputBuffer, frames);
+    w4_runtimeWriteSamples(userData, (int16_t*)outputBuffer, frames);
     return frames;
 }
 
 static void audioStateCallback (cubeb_stream* stream, void* userData, cubeb_state state) {
 }
 
-static void audioInit () {
+static void audioInit (w4_Instance* instance) {
     cubeb* ctx;
 
 #if defined(_WIN32)
@@ -65,7 +69,7 @@ static void audioInit () {
 
     cubeb_stream* stream;
     if (cubeb_stream_init(ctx, &stream, "WASM-4", NULL, NULL, NULL, &params,
-            latency, audioDataCallback, audioStateCallback, NULL)) {
+            latency, audioDataCallback, audioStateCallback, instance)) {
         fprintf(stderr, "Could not open the stream\n");
         return;
     }
@@ -118,15 +122,68 @@ static void trimFileExtension (char *path) {
     }
 }
 
+static void printUsage () {
+    fprintf(stderr, "Usage: wasm4 [--host <port> | --join <address>:<port>] [--speculate <threads>]\n"
+        "             [--replay <movie> [--seek <frame>]] [--record <movie>] [--trace <file>]\n"
+        "             [--profile] <cart>\n");
+}
+
 int main (int argc, const char* argv[]) {
     uint8_t* cartBytes;
     size_t cartLength;
     w4_Disk disk = {0};
     const char* title = "WASM-4";
     char* diskPath = NULL;
+    const char* exePath = argv[0];
+
+    // Options come before the cart
+    int hostPort = 0;
+    char* joinAddress = NULL;
+    int joinPort = 0;
+    int speculateThreads = 0;
+    const char* replayPath = NULL;
+    const char* recordPath = NULL;
+    long seekFrame = 0;
+    const char* tracePath = NULL;
+    bool profile = false;
+    while (argc >= 2 && !strncmp(argv[1], "--", 2)) {
+        if (!strcmp(argv[1], "--host") && argc >= 3) {
+            hostPort = atoi(argv[2]);
+        } else if (!strcmp(argv[1], "--join") && argc >= 3 && strrchr(argv[2], ':')) {
+            joinAddress = xmalloc(strlen(argv[2]) + 1);
+            strcpy(joinAddress, argv[2]);
+            char* colon = strrchr(joinAddress, ':');
+            *colon = '\0';
+            joinPort = atoi(colon + 1);
+        } else if (!strcmp(argv[1], "--speculate") && argc >= 3) {
+            speculateThreads = atoi(argv[2]);
+        } else if (!strcmp(argv[1], "--replay") && argc >= 3) {
+            replayPath = argv[2];
+        } else if (!strcmp(argv[1], "--record") && argc >= 3) {
+            recordPath = argv[2];
+        } else if (!strcmp(argv[1], "--seek") && argc >= 3) {
+            seekFrame = strtol(argv[2], NULL, 0);
+        } else if (!strcmp(argv[1], "--trace") && argc >= 3) {
+            tracePath = argv[2];
+        } else if (!strcmp(argv[1], "--profile")) {
+            profile = true;
+            --argc;
+            ++argv;
+            continue;
+        } else {
+            printUsage();
+            return 1;
+        }
+        argc -= 2;
+        argv += 2;
+    }
+    if ((replayPath || recordPath) && (hostPort || joinAddress)) {
+        fprintf(stderr, "Movies can't be used with netplay\n");
+        return 1;
+    }
 
     if (argc < 2) {
-        FILE* file = fopen(argv[0], "rb");
+        FILE* file = fopen(exePath, "rb");
         if (file == NULL) {
             goto usage;
         }
@@ -136,7 +193,7 @@ int main (int argc, const char* argv[]) {
         if (fread(&footer, 1, sizeof(FileFooter), file) < sizeof(FileFooter) || footer.magic != 1414676803) {
 usage:
             // No bundled cart found
-            fprintf(stderr, "Usage: wasm4 <cart>\n");
+            printUsage();
             return 1;
         }
 
@@ -150,8 +207,8 @@ usage:
         fclose(file);
 
         // Look for disk file
-        diskPath = xmalloc(strlen(argv[0]) + sizeof(DISK_FILE_EXT));
-        strcpy(diskPath, argv[0]);
+        diskPath = xmalloc(strlen(exePath) + sizeof(DISK_FILE_EXT));
+        strcpy(diskPath, exePath);
 #ifdef _WIN32
         trimFileExtension(diskPath); // Trim .exe on Windows
 #endif
@@ -205,16 +262,81 @@ usage:
         loadDiskFile(&disk, diskPath);
     }
 
-    audioInit();
+    if (tracePath) {
+#if defined(W4_TRACE)
+        if (!w4_traceOpen(tracePath)) {
+            fprintf(stderr, "Error opening %s\n", tracePath);
+            return 1;
+        }
+#else
+        fprintf(stderr, "Tracing is not supported by this build, configure with -DTRACE=ON\n");
+        return 1;
+#endif
+    }
+
+    w4_Instance* instance = w4_instanceCreate();
+    uint8_t* memory = w4_wasmInit(instance);
+    w4_runtimeInit(instance, memory, &disk);
+    w4_runtimeSetProfiling(instance, profile);
+
+    audioInit(instance);
+
+    w4_wasmLoadModule(instance, cartBytes, cartLength);
+
+    w4_Netplay* netplay = NULL;
+    if (hostPort) {
+        netplay = w4_netplayHost(instance, hostPort, W4_ROLLBACK_DEFAULT_HISTORY);
+    } else if (joinAddress) {
+        netplay = w4_netplayJoin(instance, joinAddress, joinPort, W4_ROLLBACK_DEFAULT_HISTORY);
+    }
+    if ((hostPort || joinAddress) && !netplay) {
+        return 1;
+    }
+    if (netplay) {
+        w4_netplaySpeculate(netplay, cartBytes, cartLength, speculateThreads);
+    }
 
-    uint8_t* memory = w4_wasmInit();
-    w4_runtimeInit(memory, &disk);
+    // A replayed movie starts from the state it was recorded from, and recording carries on from
+    // where it ends
+    w4_Movie* movie = NULL;
+    if (replayPath) {
+        movie = w4_movieLoad(replayPath);
+        if (!movie) {
+            return 1;
+        }
+        if (seekFrame < 0 || !w4_movieSeek(movie, instance, seekFrame)) {
+            fprintf(stderr, "Can't seek to frame %ld, the movie has %u frames\n", seekFrame,
+                w4_movieFrameCount(movie));
+            return 1;
+        }
+    } else if (recordPath) {
+        movie = w4_movieCreate(W4_MOVIE_DEFAULT_KEYFRAME_INTERVAL);
+    }
 
-    w4_wasmLoadModule(cartBytes, cartLength);
+    w4_windowBoot(instance, title, netplay, movie);
 
-    w4_windowBoot(title);
+    if (netplay) {
+        w4_netplayDestroy(netplay);
+    }
+    if (movie) {
+        if (recordPath) {
+            w4_movieSave(movie, recordPath);
+        }
+        w4_movieDestroy(movie);
+    }
 
     audioUninit();
 
-    saveDiskFile(&disk, diskPath);
+    if (profile) {
+        w4_profilePrint(stderr, w4_runtimeProfile(instance));
+    }
+
+#if defined(W4_TRACE)
+    w4_traceClose();
+#endif
+
+    // Replaying restores the disk the movie was recorded with, which isn't the player's to keep
+    if (!replayPath) {
+        saveDiskFile(&disk, diskPath);
+    }
 }
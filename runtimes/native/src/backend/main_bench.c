@@ -0,0 +1,306 @@
+#if !defined(_WIN32)
+#define _POSIX_C_SOURCE 199309L
+#endif
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../movie.h"
+#include "../runtime.h"
+#include "../util.h"
+#include "../wasm.h"
+
+#if defined(_WIN32)
+#include <io.h>
+#include <windows.h>
+#else
+#include <unistd.h>
+#endif
+
+// Runs carts headlessly and reports how long their frames take as JSON, for comparing wasm
+// backends and compilers. Each build only has one wasm backend, so the report says which.
+
+#ifndef W4_WASM_BACKEND
+#define W4_WASM_BACKEND "unknown"
+#endif
+
+#if defined(__VERSION__)
+#define COMPILER __VERSION__
+#elif defined(_MSC_VER)
+#define COMPILER "MSVC"
+#else
+#define COMPILER "unknown"
+#endif
+
+#define DEFAULT_FRAMES 3600
+
+// One 60 Hz frame of audio at 44.1 kHz
+#define SAMPLE_FRAMES 735
+
+// Without a movie, new random input is picked this often, in frames
+#define RANDOM_INPUT_INTERVAL 8
+
+typedef struct {
+    const char* cartPath;
+
+    /** Input to replay, or NULL for random input. */
+    const char* moviePath;
+} Cart;
+
+static void usage () {
+    fprintf(stderr,
+        "Usage: wasm4_bench [options] [--movie <movie>] <cart> [[--movie <movie>] <cart>...]\n"
+        "\n"
+        "Runs each cart without a display and writes a JSON report of its frame times, host calls\n"
+        "and audio rendering times. The input is replayed from the movie given before the cart, or\n"
+        "else pseudo-random, but the same on every run.\n"
+        "\n"
+        "Options:\n"
+        "  -n, --frames <count>      Number of frames to run (default: 3600, or the length of the movie)\n"
+        "  -m, --movie <file>        Replay a movie recorded with --record for the next cart\n"
+        "  -o, --output <file>       Write the report to a file instead of stdout\n");
+}
+
+static uint8_t* readFile (const char* path, size_t* length) {
+    FILE* file = fopen(path, "rb");
+    if (file == NULL) {
+        fprintf(stderr, "Error opening %s\n", path);
+        exit(1);
+    }
+
+    fseek(file, 0, SEEK_END);
+    *length = ftell(file);
+    fseek(file, 0, SEEK_SET);
+
+    uint8_t* bytes = xmalloc(*length);
+    *length = fread(bytes, 1, *length, file);
+    fclose(file);
+    return bytes;
+}
+
+/** Moves stdout out of the way of carts that trace, and returns a stream to the real stdout. */
+static FILE* takeStdout () {
+    fflush(stdout);
+#if defined(_WIN32)
+    FILE* out = _fdopen(_dup(_fileno(stdout)), "w");
+    _dup2(_fileno(stderr), _fileno(stdout));
+#else
+    FILE* out = fdopen(dup(fileno(stdout)), "w");
+    dup2(fileno(stderr), fileno(stdout));
+#endif
+    return out;
+}
+
+static int compareTimes (const void* a, const void* b) {
+    uint64_t x = *(const uint64_t*)a, y = *(const uint64_t*)b;
+    return (x > y) - (x < y);
+}
+
+static void writeString (FILE* out, const char* str) {
+    fputc('"', out);
+    for (; *str; ++str) {
+        if (*str == '"' || *str == '\\') {
+            fputc('\\', out);
+        }
+        if ((unsigned char)*str < 0x20) {
+            fprintf(out, "\\u%04x", *str);
+        } else {
+            fputc(*str, out);
+        }
+    }
+    fputc('"', out);
+}
+
+/** Writes the mean and percentiles of a list of times in nanoseconds. Sorts the times. */
+static void writeTimes (FILE* out, uint64_t* times, long count) {
+    if (count == 0) {
+        fprintf(out, "null");
+        return;
+    }
+    qsort(times, count, sizeof(uint64_t), compareTimes);
+    uint64_t total = 0;
+    for (long n = 0; n < count; ++n) {
+        total += times[n];
+    }
+    fprintf(out, "{\"mean\": %.0f, \"p50\": %llu, \"p90\": %llu, \"p99\": %llu, \"max\": %llu}",
+        (double)total / count,
+        (unsigned long long)times[count/2],
+        (unsigned long long)times[count*90/100],
+        (unsigned long long)times[count*99/100],
+        (unsigned long long)times[count-1]);
+}
+
+static void benchCart (FILE* out, const Cart* cart, long frames) {
+    size_t cartLength;
+    uint8_t* cartBytes = readFile(cart->cartPath, &cartLength);
+
+    w4_Movie* movie = NULL;
+    if (cart->moviePath) {
+        movie = w4_movieLoad(cart->moviePath);
+        if (!movie) {
+            exit(1);
+        }
+        if (frames < 0 || frames > (long)w4_movieFrameCount(movie)) {
+            frames = w4_movieFrameCount(movie);
+        }
+    }
+    if (frames < 0) {
+        frames = DEFAULT_FRAMES;
+    }
+
+    // Disk writes are kept in memory only, so runs are repeatable
+    w4_Disk disk = {0};
+    uint64_t loadStart = w4_nanos();
+    w4_Instance* instance = w4_instanceCreate();
+    uint8_t* memory = w4_wasmInit(instance);
+    w4_runtimeInit(instance, memory, &disk);
+    w4_wasmLoadModule(instance, cartBytes, cartLength);
+    uint64_t loadTime = w4_nanos() - loadStart;
+
+    if (movie) {
+        w4_movieSeek(movie, instance, 0);
+    }
+
+    uint64_t* frameTimes = xmalloc((frames + 1) * sizeof(uint64_t));
+    uint64_t* audioTimes = xmalloc((frames + 1) * sizeof(uint64_t));
+    uint64_t* hostCalls = xmalloc((frames + 1) * sizeof(uint64_t));
+    int16_t samples[2*SAMPLE_FRAMES];
+
+    uint32_t random = 1;
+    uint64_t startTime = w4_nanos();
+    for (long frame = 0; frame < frames; ++frame) {
+        if (movie) {
+            w4_moviePlay(movie, instance);
+        } else if (frame % RANDOM_INPUT_INTERVAL == 0) {
+            random = random * 1664525 + 1013904223;
+            w4_runtimeSetGamepad(instance, 0, random >> 24);
+        }
+
+        uint64_t calls = w4_runtimeHostCalls(instance);
+        uint64_t t0 = w4_nanos();
+        w4_runtimeUpdate(instance);
+        uint64_t t1 = w4_nanos();
+        w4_runtimeWriteSamples(instance, samples, SAMPLE_FRAMES);
+        uint64_t t2 = w4_nanos();
+
+        frameTimes[frame] = t1 - t0;
+        audioTimes[frame] = t2 - t1;
+        hostCalls[frame] = w4_runtimeHostCalls(instance) - calls;
+    }
+    uint64_t elapsed = w4_nanos() - startTime;
+
+    uint64_t totalCalls = 0;
+    uint64_t maxCalls = 0;
+    for (long frame = 0; frame < frames; ++frame) {
+        totalCalls += hostCalls[frame];
+        if (hostCalls[frame] > maxCalls) {
+            maxCalls = hostCalls[frame];
+        }
+    }
+
+    fprintf(out, "    {\n      \"cart\": ");
+    writeString(out, cart->cartPath);
+    fprintf(out, ",\n      \"input\": ");
+    if (movie) {
+        writeString(out, cart->moviePath);
+    } else {
+        fprintf(out, "\"random\"");
+    }
+    fprintf(out, ",\n      \"frames\": %ld,\n", frames);
+    fprintf(out, "      \"load_ns\": %llu,\n", (unsigned long long)loadTime);
+    // The first frame also runs the cart's start function, so it's reported on its own
+    fprintf(out, "      \"first_frame_ns\": %llu,\n",
+        (unsigned long long)(frames > 0 ? frameTimes[0] : 0));
+    fprintf(out, "      \"fps\": %.1f,\n", elapsed > 0 ? frames / (elapsed / 1e9) : 0);
+    fprintf(out, "      \"frame_ns\": ");
+    writeTimes(out, frames > 1 ? &frameTimes[1] : frameTimes, frames > 1 ? frames - 1 : 0);
+    fprintf(out, ",\n      \"audio_ns\": ");
+    writeTimes(out, audioTimes, frames);
+    fprintf(out, ",\n      \"host_calls\": {\"total\": %llu, \"per_frame\": %.1f, \"max\": %llu},\n",
+        (unsigned long long)totalCalls, frames > 0 ? (double)totalCalls / frames : 0,
+        (unsigned long long)maxCalls);
+
+    // Host functions aren't timed here, which would add to the frame times
+    const w4_Profile* profile = w4_runtimeProfile(instance);
+    fprintf(out, "      \"host_functions\": {");
+    bool first = true;
+    for (int n = 0; n < W4_HOST_FUNCTIONS; ++n) {
+        const w4_HostStats* stats = &profile->host[n];
+        if (stats->calls > 0) {
+            fprintf(out, "%s\n        \"%s\": {\"calls\": %llu, \"pixels\": %llu, \"bytes\": %llu}",
+                first ? "" : ",", w4_hostFunctionName(n), (unsigned long long)stats->calls,
+                (unsigned long long)stats->pixels, (unsigned long long)stats->bytes);
+            first = false;
+        }
+    }
+    fprintf(out, first ? "}\n    }" : "\n      }\n    }");
+
+    free(hostCalls);
+    free(audioTimes);
+    free(frameTimes);
+    w4_instanceDestroy(instance);
+    if (movie) {
+        w4_movieDestroy(movie);
+    }
+    free(cartBytes);
+}
+
+int main (int argc, const char* argv[]) {
+    const char* outputPath = NULL;
+    long frames = -1;
+
+    Cart* carts = xmalloc(argc * sizeof(Cart));
+    int cartCount = 0;
+    const char* moviePath = NULL;
+
+    for (int n = 1; n < argc; ++n) {
+        const char* arg = argv[n];
+        bool hasValue = n+1 < argc;
+        if ((!strcmp(arg, "-n") || !strcmp(arg, "--frames")) && hasValue) {
+            frames = strtol(argv[++n], NULL, 0);
+        } else if ((!strcmp(arg, "-m") || !strcmp(arg, "--movie")) && hasValue) {
+            moviePath = argv[++n];
+        } else if ((!strcmp(arg, "-o") || !strcmp(arg, "--output")) && hasValue) {
+            outputPath = argv[++n];
+        } else if (arg[0] != '-') {
+            carts[cartCount].cartPath = arg;
+            carts[cartCount].moviePath = moviePath;
+            ++cartCount;
+            moviePath = NULL;
+        } else {
+            usage();
+            return 1;
+        }
+    }
+    if (cartCount == 0) {
+        usage();
+        return 1;
+    }
+
+    FILE* out;
+    if (outputPath) {
+        out = fopen(outputPath, "w");
+        if (out == NULL) {
+            fprintf(stderr, "Error opening %s\n", outputPath);
+            return 1;
+        }
+    } else {
+        out = takeStdout();
+    }
+
+    fprintf(out, "{\n  \"backend\": \"%s\",\n  \"compiler\": ", W4_WASM_BACKEND);
+    writeString(out, COMPILER);
+    fprintf(out, ",\n  \"carts\": [\n");
+    for (int n = 0; n < cartCount; ++n) {
+        fprintf(stderr, "Running %s\n", carts[n].cartPath);
+        benchCart(out, &carts[n], frames);
+        fprintf(out, n+1 < cartCount ? ",\n" : "\n");
+    }
+    fprintf(out, "  ]\n}\n");
+
+    fclose(out);
+    free(carts);
+    return 0;
+}
@@ -0,0 +1,333 @@
+#if !defined(_WIN32)
+#define _POSIX_C_SOURCE 199309L
+#endif
+
+#include <inttypes.h>
+#include <limits.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "../movie.h"
+#include "../runtime.h"
+#include "../trace.h"
+#include "../util.h"
+#include "batch.h"
+#include "shm.h"
+
+#if defined(_WIN32)
+#include <windows.h>
+#endif
+
+// Runs a cart without a display or audio device, as fast as possible. Used for CI and for
+// training bots.
+
+#define SAMPLE_RATE 44100
+#define FRAME_RATE 60
+
+static void usage () {
+    fprintf(stderr,
+        "Usage: wasm4_headless [options] <cart>\n"
+        "\n"
+        "Options:\n"
+        "  -n, --frames <count>      Number of frames to run (default: 600, or until the end of the input file,\n"
+        "                            or forever with --shm)\n"
+        "  -i, --input <file>        Read gamepad input from a file, 4 bytes per frame (one per player)\n"
+        "      --replay <movie>      Play back a movie recorded with --record, in a single instance\n"
+        "      --seek <frame>        Start playing the movie from this frame\n"
+        "      --record <movie>      Record the first instance's input to a movie\n"
+        "  -u, --until <addr>=<val>  Stop once the byte at memory address addr equals val (in the first instance)\n"
+        "  -N, --instances <count>   Run this many instances of the cart in parallel (default: 1)\n"
+        "  -j, --threads <count>     Number of threads to run instances on (default: one per CPU)\n"
+        "      --shm <file>          Share memory and take input through a memory-mapped file, see shm.h\n"
+        "      --hash-log <file>     Write the first instance's input and state hash after every frame\n"
+        "      --profile             Print the host functions called and the time spent in them\n"
+        "      --trace <file>        Write the time spent in each part of every frame, in Chrome's trace format\n"
+        "      --no-audio            Skip generating audio samples\n"
+        "      --deferred-draw       Enable deferred drawing\n");
+}
+
+static uint64_t nowNanos () {
+#if defined(_WIN32)
+    LARGE_INTEGER frequency, counter;
+    QueryPerformanceFrequency(&frequency);
+    QueryPerformanceCounter(&counter);
+    return (uint64_t)((double)counter.QuadPart * 1e9 / (double)frequency.QuadPart);
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+#endif
+}
+
+static uint8_t* readFile (const char* path, size_t* length) {
+    FILE* file = fopen(path, "rb");
+    if (file == NULL) {
+        fprintf(stderr, "Error opening %s\n", path);
+        exit(1);
+    }
+
+    fseek(file, 0, SEEK_END);
+    *length = ftell(file);
+    fseek(file, 0, SEEK_SET);
+
+    uint8_t* bytes = xmalloc(*length);
+    *length = fread(bytes, 1, *length, file);
+    fclose(file);
+    return bytes;
+}
+
+int main (int argc, const char* argv[]) {
+    const char* cartPath = NULL;
+    const char* inputPath = NULL;
+    const char* shmPath = NULL;
+    const char* hashLogPath = NULL;
+    const char* tracePath = NULL;
+    const char* replayPath = NULL;
+    const char* recordPath = NULL;
+    long seekFrame = 0;
+    long frames = -1;
+    bool untilSet = false;
+    unsigned long untilAddress = 0;
+    unsigned long untilValue = 0;
+    bool audio = true;
+    bool deferredDraw = false;
+    bool profile = false;
+    int instances = 1;
+    int threads = 0;
+
+    for (int n = 1; n < argc; ++n) {
+        const char* arg = argv[n];
+        bool hasValue = n+1 < argc;
+        if ((!strcmp(arg, "-n") || !strcmp(arg, "--frames")) && hasValue) {
+            frames = strtol(argv[++n], NULL, 0);
+        } else if ((!strcmp(arg, "-i") || !strcmp(arg, "--input")) && hasValue) {
+            inputPath = argv[++n];
+        } else if ((!strcmp(arg, "-u") || !strcmp(arg, "--until")) && hasValue) {
+            char* end;
+            untilAddress = strtoul(argv[++n], &end, 0);
+            if (*end != '=' || untilAddress >= 1 << 16) {
+                usage();
+                return 1;
+            }
+            untilValue = strtoul(end+1, NULL, 0);
+            untilSet = true;
+        } else if ((!strcmp(arg, "-N") || !strcmp(arg, "--instances")) && hasValue) {
+            instances = strtol(argv[++n], NULL, 0);
+            if (instances < 1) {
+                usage();
+                return 1;
+            }
+        } else if ((!strcmp(arg, "-j") || !strcmp(arg, "--threads")) && hasValue) {
+            threads = strtol(argv[++n], NULL, 0);
+        } else if (!strcmp(arg, "--shm") && hasValue) {
+            shmPath = argv[++n];
+        } else if (!strcmp(arg, "--hash-log") && hasValue) {
+            hashLogPath = argv[++n];
+        } else if (!strcmp(arg, "--trace") && hasValue) {
+            tracePath = argv[++n];
+        } else if (!strcmp(arg, "--replay") && hasValue) {
+            replayPath = argv[++n];
+        } else if (!strcmp(arg, "--record") && hasValue) {
+            recordPath = argv[++n];
+        } else if (!strcmp(arg, "--seek") && hasValue) {
+            seekFrame = strtol(argv[++n], NULL, 0);
+        } else if (!strcmp(arg, "--no-audio")) {
+            audio = false;
+        } else if (!strcmp(arg, "--deferred-draw")) {
+            deferredDraw = true;
+        } else if (!strcmp(arg, "--profile")) {
+            profile = true;
+        } else if (arg[0] != '-' && cartPath == NULL) {
+            cartPath = arg;
+        } else {
+            usage();
+            return 1;
+        }
+    }
+    if (cartPath == NULL || (replayPath && (instances > 1 || inputPath || shmPath))) {
+        usage();
+        return 1;
+    }
+
+    size_t cartLength;
+    uint8_t* cartBytes = readFile(cartPath, &cartLength);
+
+    size_t inputLength = 0;
+    uint8_t* inputBytes = NULL;
+    if (inputPath) {
+        inputBytes = readFile(inputPath, &inputLength);
+        long inputFrames = inputLength / 4;
+        if (frames < 0 || frames > inputFrames) {
+            frames = inputFrames;
+        }
+    }
+
+    w4_Movie* movie = NULL;
+    if (replayPath) {
+        movie = w4_movieLoad(replayPath);
+        if (!movie) {
+            return 1;
+        }
+        long movieFrames = (long)w4_movieFrameCount(movie) - seekFrame;
+        if (frames < 0 || frames > movieFrames) {
+            frames = movieFrames;
+        }
+    }
+    if (frames < 0) {
+        frames = shmPath ? LONG_MAX : 600;
+    }
+
+    if (tracePath) {
+#if defined(W4_TRACE)
+        if (!w4_traceOpen(tracePath)) {
+            fprintf(stderr, "Error opening %s\n", tracePath);
+            return 1;
+        }
+#else
+        fprintf(stderr, "Tracing is not supported by this build, configure with -DTRACE=ON\n");
+        return 1;
+#endif
+    }
+
+    // Each instance gets its own disk. Disk writes are kept in memory only, so runs are repeatable
+    w4_Batch* batch = w4_batchCreate(cartBytes, cartLength, instances, threads);
+    for (int n = 0; n < instances; ++n) {
+        w4_runtimeSetDeferredDraw(w4_batchInstance(batch, n), deferredDraw);
+        w4_runtimeSetProfiling(w4_batchInstance(batch, n), profile);
+    }
+    const uint8_t* memory = w4_batchMemory(batch, 0);
+    w4_Instance* first = w4_batchInstance(batch, 0);
+
+    if (movie) {
+        uint64_t seekStart = nowNanos();
+        if (seekFrame < 0 || !w4_movieSeek(movie, first, seekFrame)) {
+            fprintf(stderr, "Can't seek to frame %ld, the movie has %u frames\n", seekFrame,
+                w4_movieFrameCount(movie));
+            return 1;
+        }
+        if (seekFrame > 0) {
+            fprintf(stderr, "seek: %.3f ms\n", (nowNanos() - seekStart) / 1e6);
+        }
+    }
+
+    // Recording can be combined with playback, to convert or trim a movie
+    w4_Movie* recording = NULL;
+    if (recordPath) {
+        recording = w4_movieCreate(W4_MOVIE_DEFAULT_KEYFRAME_INTERVAL);
+    }
+
+    // Every instance gets the same input
+    uint8_t* actions = xmalloc(4 * instances);
+    memset(actions, 0, 4 * instances);
+
+    w4_Shm* shm = NULL;
+    if (shmPath) {
+        shm = w4_shmOpen(shmPath, instances);
+        if (shm == NULL) {
+            return 1;
+        }
+    }
+
+    // One line per frame: the frame number, the gamepad bytes it ran with, and the state hash after
+    // it. Two logs of the same cart and input can be diffed to find the first frame that diverged.
+    FILE* hashLog = NULL;
+    if (hashLogPath) {
+        hashLog = fopen(hashLogPath, "w");
+        if (hashLog == NULL) {
+            fprintf(stderr, "Error opening %s\n", hashLogPath);
+            return 1;
+        }
+    }
+
+    // The null audio sink: samples are generated to keep the APU's cost realistic, then dropped
+    int16_t* samples = audio ? xmalloc(instances * 2 * W4_BATCH_SAMPLE_FRAMES * sizeof(int16_t)) : NULL;
+
+    uint64_t startTime = nowNanos();
+    long frame = 0;
+    while (frame < frames) {
+        if (shm) {
+            w4_shmPublish(shm, batch);
+            if (!w4_shmWait(shm)) {
+                break;
+            }
+        } else if (inputBytes) {
+            for (int n = 0; n < instances; ++n) {
+                memcpy(&actions[4*n], &inputBytes[4*frame], 4);
+            }
+        }
+
+        // Actions are read straight out of the shared file, and a movie sets the input directly
+        const uint8_t* frameActions = shm ? w4_shmActions(shm) : actions;
+        if (movie) {
+            w4_moviePlay(movie, first);
+            for (int player = 0; player < 4; ++player) {
+                actions[player] = w4_runtimeGetGamepad(first, player);
+            }
+        }
+        if (recording) {
+            for (int player = 0; player < 4; ++player) {
+                w4_runtimeSetGamepad(first, player, frameActions[player]);
+            }
+            w4_movieRecord(recording, first);
+        }
+        w4_batchStep(batch, frameActions, NULL, samples);
+        ++frame;
+
+        if (hashLog) {
+            fprintf(hashLog, "%ld %02x%02x%02x%02x %016" PRIx64 "\n", frame, frameActions[0],
+                frameActions[1], frameActions[2], frameActions[3],
+                w4_runtimeHash(first));
+        }
+
+        if (untilSet && memory[untilAddress] == untilValue) {
+            break;
+        }
+    }
+    uint64_t elapsed = nowNanos() - startTime;
+
+    double seconds = elapsed / 1e9;
+    fprintf(stderr, "frames: %ld\n", frame);
+    fprintf(stderr, "time: %.3f s\n", seconds);
+    fprintf(stderr, "fps: %.1f\n", seconds > 0 ? frame / seconds : 0);
+    fprintf(stderr, "ns/frame: %.0f\n", frame > 0 ? (double)elapsed / frame : 0);
+    if (instances > 1) {
+        fprintf(stderr, "instances: %d\n", instances);
+        fprintf(stderr, "total fps: %.1f\n", seconds > 0 ? frame * instances / seconds : 0);
+    }
+
+    if (profile) {
+        // Totalled over all instances
+        w4_Profile total = {0};
+        for (int n = 0; n < instances; ++n) {
+            w4_profileAdd(&total, w4_runtimeProfile(w4_batchInstance(batch, n)));
+        }
+        w4_profilePrint(stderr, &total);
+    }
+
+    if (hashLog) {
+        fclose(hashLog);
+    }
+    if (recording) {
+        w4_movieSave(recording, recordPath);
+        w4_movieDestroy(recording);
+    }
+    if (movie) {
+        w4_movieDestroy(movie);
+    }
+    if (shm) {
+        w4_shmClose(shm);
+    }
+    w4_batchDestroy(batch);
+#if defined(W4_TRACE)
+    // After the instances have flushed their last events
+    w4_traceClose();
+#endif
+    free(samples);
+    free(actions);
+    free(inputBytes);
+    free(cartBytes);
+    return 0;
+}
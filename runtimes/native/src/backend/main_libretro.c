@@ -5,7 +5,6 @@
 #include <stdarg.h>
 #include <libretro.h>
 
-#include "../apu.h"
 #include "../runtime.h"
 #include "../wasm.h"
 #include "../util.h"
@@ -23,6 +22,7 @@ static uint8_t* wasmData;
 static size_t wasmLength;
 static bool wasmCopy = false;
 
+static w4_Instance* instance;
 static uint8_t* memory;
 static enum retro_pixel_format pixel_format = RETRO_PIXEL_FORMAT_UNKNOWN;
 static int use_audio_callback = 0;
@@ -52,7 +52,7 @@ static retro_log_printf_t log_cb = fallback_log;
 
 #if !defined(PSP) && !defined(PS2)
 static void audio_callback () {
-    w4_apuWriteSamples(audio_output, AUDIO_BUFFER_FRAMES_CALLBACK);
+    w4_runtimeWriteSamples(instance, audio_output, AUDIO_BUFFER_FRAMES_CALLBACK);
     audio_batch_cb(audio_output, AUDIO_BUFFER_FRAMES_CALLBACK);
 }
 #endif
@@ -82,6 +82,10 @@ static struct retro_variable variables[] =
 	"wasm4_touchscreen_hold_frames",
 	"Frames to hold touch value; 10|20|30|5"
     },
+    {
+	"wasm4_deferred_draw",
+	"Deferred drawing (may break carts that access the framebuffer directly); disabled|enabled"
+    },
     { NULL, NULL },
 };
 
@@ -138,7 +142,7 @@ bool retro_serialize (void* dest, size_t size) {
     if (size < w4_runtimeSerializeSize()) {
         return false;
     }
-    w4_runtimeSerialize(dest);
+    w4_runtimeSerialize(instance, dest);
     return true;
 }
 
@@ -146,8 +150,7 @@ bool retro_unserialize (const void* src, size_t size) {
     if (size < w4_runtimeSerializeSize()) {
         return false;
     }
-    w4_runtimeUnserialize(src);
-    return true;
+    return w4_runtimeUnserialize(instance, src);
 }
 
 void retro_cheat_reset () {
@@ -233,6 +236,11 @@ static void load_variables(bool startup) {
 
     if (hold_in_start_value < 0 || hold_in_start_value > 120)
 	hold_in_start_value = 10;
+
+    var.key = "wasm4_deferred_draw";
+    var.value = NULL;
+
+    w4_runtimeSetDeferredDraw(instance, environ_cb(RETRO_ENVIRONMENT_GET_VARIABLE, &var) && var.value && strcmp(var.value, "enabled") == 0);
 }
 
 bool retro_load_game (const struct retro_game_info* game) {
@@ -316,9 +324,10 @@ bool retro_load_game (const struct retro_game_info* game) {
     };
     environ_cb(RETRO_ENVIRONMENT_SET_INPUT_DESCRIPTORS, descs);
 
-    memory = w4_wasmInit();
-    w4_runtimeInit(memory, &disk);
-    w4_wasmLoadModule(wasmData, wasmLength);
+    instance = w4_instanceCreate();
+    memory = w4_wasmInit(instance);
+    w4_runtimeInit(instance, memory, &disk);
+    w4_wasmLoadModule(instance, wasmData, wasmLength);
 
     load_variables(true);
 
@@ -342,7 +351,8 @@ bool retro_load_game_special (unsigned type, const struct retro_game_info *info,
 }
 
 void retro_unload_game () {
-    w4_wasmDestroy();
+    w4_instanceDestroy(instance);
+    instance = NULL;
     if (wasmCopy) {
         free(wasmData);
     }
@@ -351,12 +361,16 @@ void retro_unload_game () {
 void retro_reset () {
     // Complete clear all memory and build a new instance as reusing
     // the existing model could result in a memory leak.
-    w4_wasmDestroy();
+    w4_instanceDestroy(instance);
 
     // Build a new wasm instance.
-    memory = w4_wasmInit();
-    w4_runtimeInit(memory, &disk);
-    w4_wasmLoadModule(wasmData, wasmLength);
+    instance = w4_instanceCreate();
+    memory = w4_wasmInit(instance);
+    w4_runtimeInit(instance, memory, &disk);
+    w4_wasmLoadModule(instance, wasmData, wasmLength);
+
+    // Reapply options that live on the instance
+    load_variables(false);
 }
 
 void retro_get_system_av_info (struct retro_system_av_info* info) {
@@ -404,7 +418,7 @@ void retro_run () {
         if (input_state_cb(idx, RETRO_DEVICE_JOYPAD, 0, RETRO_DEVICE_ID_JOYPAD_DOWN)) {
             gamepad |= W4_BUTTON_DOWN;
         }
-        w4_runtimeSetGamepad(idx, gamepad);
+        w4_runtimeSetGamepad(instance, idx, gamepad);
     }
 
     // Mouse handling
@@ -482,12 +496,12 @@ void retro_run () {
 	mouseButtons |= W4_MOUSE_MIDDLE;
     }
 
-    w4_runtimeSetMouse(80+80*mouseX/0x7fff, 80+80*mouseY/0x7fff, mouseButtons);
+    w4_runtimeSetMouse(instance, 80+80*mouseX/0x7fff, 80+80*mouseY/0x7fff, mouseButtons);
 
-    w4_runtimeUpdate();
+    w4_runtimeUpdate(instance);
 
     if (!use_audio_callback) {
-	w4_apuWriteSamples(audio_output, AUDIO_BUFFER_FRAMES_PER_VIDEO_FRAME);
+	w4_runtimeWriteSamples(instance, audio_output, AUDIO_BUFFER_FRAMES_PER_VIDEO_FRAME);
 	audio_batch_cb(audio_output, AUDIO_BUFFER_FRAMES_PER_VIDEO_FRAME);
     }
 }
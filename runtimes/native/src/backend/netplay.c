@@ -0,0 +1,664 @@
+#if !defined(_WIN32)
+#define _POSIX_C_SOURCE 200809L
+#endif
+
+#include "netplay.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../rollback.h"
+#include "../runtime.h"
+#include "../util.h"
+#include "speculation.h"
+
+#if defined(_WIN32)
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#else
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+#endif
+
+#if defined(_WIN32)
+typedef SOCKET Socket;
+#define INVALID_SOCKET_VALUE INVALID_SOCKET
+#else
+typedef int Socket;
+#define INVALID_SOCKET_VALUE -1
+#endif
+
+// Packet types. The first three match the web runtime's unreliable channel messages.
+#define PACKET_TICK 1
+#define PACKET_PING_REQUEST 2
+#define PACKET_PING_REPLY 3
+#define PACKET_HELLO 4
+#define PACKET_WELCOME 5
+#define PACKET_HASH 6
+
+#define PROTOCOL_VERSION 1
+
+#define INPUT_DELAY 2
+
+// More than the web runtime's 20, to ride out longer round trips before stalling
+#define MAX_OUTBOUND_INPUTS 64
+
+// Frame offsets in tick packets are signed bytes, which limits how far back we can roll
+#define MAX_HISTORY 120
+
+// Our worst case tick size
+#define MAX_TICK_SIZE (8 + (MAX_OUTBOUND_INPUTS * (1 + 8*4) + 7)/8)
+
+// How often to resend the join request until the host answers, in frames
+#define HELLO_INTERVAL 15
+
+// How many frames of state hashes are kept to compare against the other player's
+#define HASH_HISTORY 256
+
+// Hash packets repeat the most recent hashes, so that a lost packet doesn't leave a gap
+#define HASHES_PER_PACKET 8
+
+typedef struct {
+    uint32_t frame;
+    uint64_t hash;
+} FrameHash;
+
+/** Estimates an average value from a sequence, used for things like ping and frame drift. */
+typedef struct {
+    float average;
+    bool updated;
+} MovingAverage;
+
+struct w4_Netplay {
+    w4_Instance* instance;
+    int historyLength;
+
+    Socket socket;
+    bool host;
+
+    /** The address of the other player. For the host, only valid once someone joined. */
+    struct sockaddr_in peer;
+    bool connected;
+
+    /** Created once the game starts. */
+    w4_Rollback* rollback;
+
+    /** Optional, see w4_netplaySpeculate. */
+    w4_Speculation* speculation;
+    int localPlayerIdx;
+    unsigned int updateCount;
+
+    // The other player's state, as in the web runtime's RemotePlayer
+    int remotePlayerIdx;
+    uint32_t remoteFrame;
+    uint32_t nextNeededFrame;
+    uint32_t outboundFrame;
+    uint8_t outboundInputs[MAX_OUTBOUND_INPUTS];
+    int outboundCount;
+
+    /** Estimated round-trip time to the other player, in milliseconds. */
+    MovingAverage ping;
+
+    /** Estimated number of frames we are ahead of the other player. */
+    MovingAverage drift;
+
+    /**
+     * Hashes of the state at the start of each frame whose inputs before it are all confirmed,
+     * by frame modulo HASH_HISTORY. Those states must be identical for both players.
+     */
+    FrameHash localHashes[HASH_HISTORY];
+    FrameHash remoteHashes[HASH_HISTORY];
+    uint32_t hashedFrame;
+
+    /** The first frame found where the hashes differ, or 0. */
+    uint32_t desyncFrame;
+};
+
+static void movingAverageUpdate (MovingAverage* avg, float value) {
+    if (!avg->updated) {
+        avg->updated = true;
+        avg->average = value;
+    } else {
+        const float discount = 0.125f;
+        avg->average = (1-discount)*avg->average + discount*value;
+    }
+}
+
+static uint32_t timeMillis () {
+#if defined(_WIN32)
+    return GetTickCount();
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint32_t)ts.tv_sec*1000 + ts.tv_nsec/1000000;
+#endif
+}
+
+// Multi-byte packet fields are big-endian, like the web runtime's DataView defaults
+static void writeBE32 (uint8_t* out, uint32_t value) {
+    out[0] = value >> 24;
+    out[1] = value >> 16;
+    out[2] = value >> 8;
+    out[3] = value;
+}
+
+static uint32_t readBE32 (const uint8_t* in) {
+    return (uint32_t)in[0] << 24 | (uint32_t)in[1] << 16 | (uint32_t)in[2] << 8 | in[3];
+}
+
+static void writeBE64 (uint8_t* out, uint64_t value) {
+    writeBE32(out, value >> 32);
+    writeBE32(&out[4], value);
+}
+
+static uint64_t readBE64 (const uint8_t* in) {
+    return (uint64_t)readBE32(in) << 32 | readBE32(&in[4]);
+}
+
+static bool sameAddress (const struct sockaddr_in* a, const struct sockaddr_in* b) {
+    return a->sin_addr.s_addr == b->sin_addr.s_addr && a->sin_port == b->sin_port;
+}
+
+static void closeSocket (Socket sock) {
+#if defined(_WIN32)
+    closesocket(sock);
+    WSACleanup();
+#else
+    close(sock);
+#endif
+}
+
+static Socket openSocket (int port) {
+#if defined(_WIN32)
+    WSADATA wsaData;
+    if (WSAStartup(MAKEWORD(2, 2), &wsaData)) {
+        return INVALID_SOCKET_VALUE;
+    }
+#endif
+
+    Socket sock = socket(AF_INET, SOCK_DGRAM, 0);
+    if (sock == INVALID_SOCKET_VALUE) {
+#if defined(_WIN32)
+        WSACleanup();
+#endif
+        return INVALID_SOCKET_VALUE;
+    }
+
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    addr.sin_port = htons(port);
+    if (bind(sock, (struct sockaddr*)&addr, sizeof(addr)) != 0) {
+        closeSocket(sock);
+        return INVALID_SOCKET_VALUE;
+    }
+
+    // Never block the frame loop waiting for packets
+#if defined(_WIN32)
+    u_long nonBlocking = 1;
+    ioctlsocket(sock, FIONBIO, &nonBlocking);
+#else
+    fcntl(sock, F_SETFL, fcntl(sock, F_GETFL, 0) | O_NONBLOCK);
+#endif
+
+    return sock;
+}
+
+static void sendPacket (w4_Netplay* netplay, const uint8_t* data, size_t length) {
+    sendto(netplay->socket, (const char*)data, length, 0, (const struct sockaddr*)&netplay->peer,
+        sizeof(netplay->peer));
+}
+
+static void sendHello (w4_Netplay* netplay) {
+    uint8_t packet[6] = { PACKET_HELLO, 'W', '4', 'N', 'P', PROTOCOL_VERSION };
+    sendPacket(netplay, packet, sizeof(packet));
+}
+
+static void sendWelcome (w4_Netplay* netplay) {
+    uint8_t packet[6];
+    packet[0] = PACKET_WELCOME;
+    packet[1] = netplay->remotePlayerIdx;
+    // The game always starts at frame 1, because frame 0 is treated as a "null" frame
+    writeBE32(&packet[2], 1);
+    sendPacket(netplay, packet, sizeof(packet));
+}
+
+static void sendPing (w4_Netplay* netplay, int type, uint32_t timestamp) {
+    uint8_t packet[5];
+    packet[0] = type;
+    writeBE32(&packet[1], timestamp);
+    sendPacket(netplay, packet, sizeof(packet));
+}
+
+static void writeBit (uint8_t* buffer, int* position, bool bit) {
+    if (bit) {
+        buffer[*position / 8] |= 1 << (*position & 7);
+    } else {
+        buffer[*position / 8] &= ~(1 << (*position & 7));
+    }
+    ++*position;
+}
+
+static void sendTick (w4_Netplay* netplay, uint32_t currentFrame) {
+    uint8_t packet[MAX_TICK_SIZE];
+    packet[0] = PACKET_TICK;
+
+    // We delta encode frame numbers relative to the current frame to save space
+    writeBE32(&packet[1], currentFrame);
+    packet[5] = (uint8_t)(int8_t)((netplay->nextNeededFrame == 0) ? -127
+        : (long long)netplay->nextNeededFrame - currentFrame);
+    packet[6] = (uint8_t)(int8_t)((long long)netplay->outboundFrame - currentFrame);
+    packet[7] = netplay->outboundCount;
+
+    // Pack inputs into a stream of bits:
+    // 1NNN: Toggle button N
+    // 0: Advance to next frame's inputs
+    uint8_t* bits = &packet[8];
+    int position = 0;
+    uint8_t prevInput = 0;
+    for (int ii = 0; ii < netplay->outboundCount; ++ii) {
+        uint8_t input = netplay->outboundInputs[ii];
+        uint8_t changed = prevInput ^ input;
+        prevInput = input;
+        for (int button = 0; button < 8; ++button) {
+            if (changed & (1 << button)) {
+                writeBit(bits, &position, true);
+                for (int n = 0; n < 3; ++n) {
+                    writeBit(bits, &position, button & (1 << n));
+                }
+            }
+        }
+        writeBit(bits, &position, false);
+    }
+
+    sendPacket(netplay, packet, 8 + (position + 7)/8);
+}
+
+static void addOutboundInput (w4_Netplay* netplay, uint32_t frame, uint8_t input) {
+    if (netplay->outboundFrame == 0) {
+        netplay->outboundFrame = frame;
+    }
+
+    if (frame < netplay->outboundFrame) {
+        // Prepend inputs so that our outbound inputs are based on the new frame
+        int count = netplay->outboundFrame - frame;
+        if (count + netplay->outboundCount > MAX_OUTBOUND_INPUTS) {
+            return;
+        }
+        memmove(&netplay->outboundInputs[count], netplay->outboundInputs, netplay->outboundCount);
+        memset(netplay->outboundInputs, input, count);
+        netplay->outboundCount += count;
+        netplay->outboundFrame = frame;
+
+    } else {
+        uint32_t frameIdx = frame - netplay->outboundFrame;
+
+        // Ensure we never overwrite a frame we already queued input for
+        if (frameIdx >= (uint32_t)netplay->outboundCount && frameIdx < MAX_OUTBOUND_INPUTS) {
+            // Pad out any intermediate frames we don't have by repeating the last input
+            for (int ii = netplay->outboundCount; ii < (int)frameIdx; ++ii) {
+                netplay->outboundInputs[ii] = (ii > 0) ? netplay->outboundInputs[ii-1] : 0;
+            }
+            netplay->outboundInputs[frameIdx] = input;
+            netplay->outboundCount = frameIdx + 1;
+        }
+    }
+}
+
+static void compareHashes (w4_Netplay* netplay, uint32_t frame) {
+    const FrameHash* local = &netplay->localHashes[frame % HASH_HISTORY];
+    const FrameHash* remote = &netplay->remoteHashes[frame % HASH_HISTORY];
+    if (local->frame == frame && remote->frame == frame && local->hash != remote->hash
+            && !netplay->desyncFrame) {
+        netplay->desyncFrame = frame;
+        fprintf(stderr, "Desync detected at frame %u\n", frame);
+    }
+}
+
+/** Hashes the states that became confirmed since the last update. */
+static void hashConfirmedFrames (w4_Netplay* netplay) {
+    uint32_t confirmed = w4_rollbackFirstPredictedFrame(netplay->rollback,
+        netplay->remotePlayerIdx);
+    for (uint32_t frame = netplay->hashedFrame+1; frame <= confirmed; ++frame) {
+        const void* state = w4_rollbackGetState(netplay->rollback, frame);
+        if (state) {
+            FrameHash* local = &netplay->localHashes[frame % HASH_HISTORY];
+            local->frame = frame;
+            local->hash = w4_runtimeHashState(state);
+            compareHashes(netplay, frame);
+        } else if (frame == confirmed) {
+            break; // Not saved yet
+        }
+        netplay->hashedFrame = frame;
+    }
+}
+
+static void sendHashes (w4_Netplay* netplay) {
+    uint8_t packet[6 + 8*HASHES_PER_PACKET];
+    int count = 0;
+    uint32_t firstFrame = netplay->hashedFrame >= HASHES_PER_PACKET
+        ? netplay->hashedFrame - HASHES_PER_PACKET + 1 : 1;
+    for (uint32_t frame = firstFrame; frame <= netplay->hashedFrame; ++frame) {
+        const FrameHash* local = &netplay->localHashes[frame % HASH_HISTORY];
+        if (local->frame != frame) {
+            // Only send consecutive frames
+            count = 0;
+            firstFrame = frame+1;
+            continue;
+        }
+        writeBE64(&packet[6 + 8*count], local->hash);
+        ++count;
+    }
+    if (count > 0) {
+        packet[0] = PACKET_HASH;
+        writeBE32(&packet[1], firstFrame);
+        packet[5] = count;
+        sendPacket(netplay, packet, 6 + 8*count);
+    }
+}
+
+static void receiveHashes (w4_Netplay* netplay, const uint8_t* packet, int length) {
+    if (length < 6) {
+        return;
+    }
+    uint32_t firstFrame = readBE32(&packet[1]);
+    int count = packet[5];
+    if (count > HASHES_PER_PACKET || length < 6 + 8*count) {
+        return;
+    }
+    for (int ii = 0; ii < count; ++ii) {
+        uint32_t frame = firstFrame + ii;
+        FrameHash* remote = &netplay->remoteHashes[frame % HASH_HISTORY];
+        remote->frame = frame;
+        remote->hash = readBE64(&packet[6 + 8*ii]);
+        compareHashes(netplay, frame);
+    }
+}
+
+static void start (w4_Netplay* netplay, uint32_t frame) {
+    netplay->rollback = w4_rollbackCreate(netplay->instance, frame, netplay->historyLength);
+    w4_runtimeSetNetplay(netplay->instance, netplay->localPlayerIdx);
+}
+
+static void receiveTick (w4_Netplay* netplay, const uint8_t* packet, int length) {
+    // Ignore if we haven't started our local simulation
+    if (!netplay->rollback || length < 8) {
+        return;
+    }
+
+    uint32_t frame = readBE32(&packet[1]);
+    if (frame <= netplay->remoteFrame) {
+        return; // Out of order
+    }
+
+    long long requestedFrame = (long long)frame + (int8_t)packet[5];
+    long long inputFrame = (long long)frame + (int8_t)packet[6];
+    int inputCount = packet[7];
+
+    // Unpack inputs
+    const uint8_t* bits = &packet[8];
+    int bitCount = 8*(length - 8);
+    int position = 0;
+    uint8_t inputs[256];
+    uint8_t prevInput = 0;
+    for (int ii = 0; ii < inputCount; ++ii) {
+        for (;;) {
+            if (position >= bitCount) {
+                return; // Truncated
+            }
+            bool toggle = bits[position / 8] & (1 << (position & 7));
+            ++position;
+            if (!toggle) {
+                break;
+            }
+            if (position + 3 > bitCount) {
+                return;
+            }
+            int button = 0;
+            for (int n = 0; n < 3; ++n, ++position) {
+                if (bits[position / 8] & (1 << (position & 7))) {
+                    button |= 1 << n;
+                }
+            }
+            prevInput ^= (1 << button);
+        }
+        inputs[ii] = prevInput;
+    }
+    if (inputFrame < 1) {
+        return;
+    }
+
+    netplay->remoteFrame = frame;
+    netplay->nextNeededFrame = inputFrame + inputCount;
+
+    // Update outboundFrame
+    if (requestedFrame > 0) {
+        if (netplay->outboundFrame == 0) {
+            netplay->outboundFrame = requestedFrame;
+        } else if (requestedFrame > netplay->outboundFrame) {
+            // Trim no longer needed inputs
+            long long delta = requestedFrame - netplay->outboundFrame;
+            int trimmed = (delta < netplay->outboundCount) ? delta : netplay->outboundCount;
+            memmove(netplay->outboundInputs, &netplay->outboundInputs[trimmed],
+                netplay->outboundCount - trimmed);
+            netplay->outboundCount -= trimmed;
+            netplay->outboundFrame = requestedFrame;
+        }
+    }
+
+    // We can estimate the remote frame by offsetting half the ping (RTT)
+    float estimatedRemoteFrame = frame + 0.5f*netplay->ping.average*60/1000;
+    // Calculate the difference and update our drift
+    float drift = (float)w4_rollbackCurrentFrame(netplay->rollback) - estimatedRemoteFrame;
+    movingAverageUpdate(&netplay->drift, drift);
+
+    // Apply the remote inputs to the local simulation
+    w4_rollbackAddInputs(netplay->rollback, netplay->remotePlayerIdx, inputFrame, inputs,
+        inputCount);
+}
+
+static void receivePackets (w4_Netplay* netplay) {
+    uint8_t packet[512];
+    struct sockaddr_in from;
+    for (;;) {
+        socklen_t fromLength = sizeof(from);
+        int length = recvfrom(netplay->socket, (char*)packet, sizeof(packet), 0,
+            (struct sockaddr*)&from, &fromLength);
+        if (length <= 0) {
+            break;
+        }
+
+        if (netplay->host && !netplay->connected) {
+            // Let the first player that says hello join
+            if (length >= 6 && packet[0] == PACKET_HELLO && !memcmp(&packet[1], "W4NP", 4)
+                    && packet[5] == PROTOCOL_VERSION) {
+                netplay->peer = from;
+                netplay->connected = true;
+                sendWelcome(netplay);
+                start(netplay, 1);
+                printf("Player %d joined\n", netplay->remotePlayerIdx+1);
+            }
+            continue;
+        }
+        if (!sameAddress(&from, &netplay->peer)) {
+            continue; // Game is already full
+        }
+
+        switch (packet[0]) {
+        case PACKET_TICK:
+            receiveTick(netplay, packet, length);
+            break;
+
+        case PACKET_HASH:
+            receiveHashes(netplay, packet, length);
+            break;
+
+        case PACKET_PING_REQUEST:
+            if (length >= 5) {
+                sendPing(netplay, PACKET_PING_REPLY, readBE32(&packet[1]));
+            }
+            break;
+
+        case PACKET_PING_REPLY:
+            if (length >= 5) {
+                movingAverageUpdate(&netplay->ping, timeMillis() - readBE32(&packet[1]));
+            }
+            break;
+
+        case PACKET_HELLO:
+            // Our welcome was lost, send it again
+            if (netplay->host) {
+                sendWelcome(netplay);
+            }
+            break;
+
+        case PACKET_WELCOME:
+            if (!netplay->host && !netplay->rollback && length >= 6) {
+                netplay->localPlayerIdx = packet[1] & 3;
+                start(netplay, readBE32(&packet[2]));
+                printf("Joined as player %d\n", netplay->localPlayerIdx+1);
+            }
+            break;
+        }
+    }
+}
+
+static w4_Netplay* create (w4_Instance* instance, int port, int historyLength) {
+    Socket sock = openSocket(port);
+    if (sock == INVALID_SOCKET_VALUE) {
+        fprintf(stderr, "Error opening UDP socket on port %d\n", port);
+        return NULL;
+    }
+
+    w4_Netplay* netplay = xmalloc(sizeof(w4_Netplay));
+    memset(netplay, 0, sizeof(w4_Netplay));
+    netplay->instance = instance;
+    netplay->socket = sock;
+    if (historyLength < 1) {
+        historyLength = 1;
+    } else if (historyLength > MAX_HISTORY) {
+        historyLength = MAX_HISTORY;
+    }
+    netplay->historyLength = historyLength;
+    return netplay;
+}
+
+w4_Netplay* w4_netplayHost (w4_Instance* instance, int port, int historyLength) {
+    w4_Netplay* netplay = create(instance, port, historyLength);
+    if (netplay) {
+        netplay->host = true;
+        netplay->localPlayerIdx = 0;
+        netplay->remotePlayerIdx = 1;
+        printf("Waiting for a player to join on port %d\n", port);
+    }
+    return netplay;
+}
+
+w4_Netplay* w4_netplayJoin (w4_Instance* instance, const char* address, int port, int historyLength) {
+    struct addrinfo hints;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_DGRAM;
+
+    w4_Netplay* netplay = create(instance, 0, historyLength);
+    if (!netplay) {
+        return NULL;
+    }
+
+    struct addrinfo* result;
+    if (getaddrinfo(address, NULL, &hints, &result) != 0) {
+        fprintf(stderr, "Could not resolve %s\n", address);
+        w4_netplayDestroy(netplay);
+        return NULL;
+    }
+    memcpy(&netplay->peer, result->ai_addr, sizeof(netplay->peer));
+    netplay->peer.sin_port = htons(port);
+    freeaddrinfo(result);
+
+    netplay->connected = true;
+    netplay->remotePlayerIdx = 0;
+    printf("Connecting to %s:%d\n", address, port);
+    return netplay;
+}
+
+void w4_netplaySpeculate (w4_Netplay* netplay, const uint8_t* wasmBuffer, int byteLength,
+        int threadCount) {
+    if (!netplay->speculation && threadCount > 0) {
+        netplay->speculation = w4_speculationCreate(wasmBuffer, byteLength, threadCount,
+            netplay->historyLength);
+    }
+}
+
+void w4_netplayDestroy (w4_Netplay* netplay) {
+    if (netplay->speculation) {
+        w4_speculationDestroy(netplay->speculation);
+    }
+    if (netplay->rollback) {
+        w4_rollbackDestroy(netplay->rollback);
+    }
+    closeSocket(netplay->socket);
+    free(netplay);
+}
+
+bool w4_netplayUpdate (w4_Netplay* netplay, uint8_t localInput) {
+    receivePackets(netplay);
+
+    if (!netplay->rollback) {
+        // Keep knocking until the host lets us in
+        if (!netplay->host && netplay->updateCount % HELLO_INTERVAL == 0) {
+            sendHello(netplay);
+        }
+        ++netplay->updateCount;
+        return false;
+    }
+
+    // Perform certain actions only once every few ticks
+    bool every8Ticks = (netplay->updateCount & 7) == 0;
+    bool every32Ticks = (netplay->updateCount & 31) == 0;
+    ++netplay->updateCount;
+
+    uint32_t currentFrame = w4_rollbackCurrentFrame(netplay->rollback);
+    uint32_t inputFrame = currentFrame + INPUT_DELAY;
+
+    // Add our input to the local simulation
+    w4_rollbackAddInputs(netplay->rollback, netplay->localPlayerIdx, inputFrame, &localInput, 1);
+
+    // Enqueue our input to send to the other player
+    addOutboundInput(netplay, inputFrame, localInput);
+    sendTick(netplay, currentFrame);
+
+    // Stall if running this frame would drop history that the other player still needs to send
+    // input for, or if the outbound buffer is full
+    bool stall = (long long)netplay->nextNeededFrame <= (long long)currentFrame - netplay->historyLength
+        || netplay->outboundCount >= MAX_OUTBOUND_INPUTS;
+
+    if (every32Ticks) {
+        sendPing(netplay, PACKET_PING_REQUEST, timeMillis());
+    }
+
+    // If we're more than one frame ahead of the other player, stall this frame and eventually
+    // they'll catch up to us
+    if (every8Ticks && netplay->drift.average >= 1) {
+        stall = true;
+    }
+
+    if (!stall) {
+        if (netplay->speculation) {
+            w4_speculationResolve(netplay->speculation, netplay->rollback);
+        }
+        w4_rollbackUpdate(netplay->rollback);
+        hashConfirmedFrames(netplay);
+        sendHashes(netplay);
+        if (netplay->speculation) {
+            w4_speculationStart(netplay->speculation, netplay->rollback, netplay->remotePlayerIdx);
+        }
+    }
+    return !stall;
+}
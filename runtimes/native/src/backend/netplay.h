@@ -0,0 +1,36 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "../runtime.h"
+
+// Two player rollback netplay over UDP, using the same tick and ping packets as the web runtime.
+//
+// The host waits for a player to join on its port, and then both sides start the cart from its
+// first frame. No state is transferred, so both players need the same cart and disk file.
+
+typedef struct w4_Netplay w4_Netplay;
+
+/** Waits for a player to join on the given UDP port. Returns NULL on failure. */
+w4_Netplay* w4_netplayHost (w4_Instance* instance, int port, int historyLength);
+
+/** Joins a host at the given address and port. Returns NULL on failure. */
+w4_Netplay* w4_netplayJoin (w4_Instance* instance, const char* address, int port, int historyLength);
+
+/**
+ * Simulates likely alternatives to the other player's predicted inputs ahead of time on
+ * threadCount worker threads, so that most rollbacks become a state swap instead of simulating
+ * frames again. See speculation.h.
+ */
+void w4_netplaySpeculate (w4_Netplay* netplay, const uint8_t* wasmBuffer, int byteLength,
+    int threadCount);
+
+void w4_netplayDestroy (w4_Netplay* netplay);
+
+/**
+ * Called once per frame with the local player's gamepad. Exchanges packets with the other player
+ * and runs the next frame, unless waiting for the other player to join or catch up. Returns
+ * whether a frame was run.
+ */
+bool w4_netplayUpdate (w4_Netplay* netplay, uint8_t localInput);
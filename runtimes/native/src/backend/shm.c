@@ -0,0 +1,163 @@
+#if !defined(_WIN32)
+#define _POSIX_C_SOURCE 200809L
+#endif
+
+#include "shm.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../util.h"
+
+#if defined(_WIN32)
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+#define MEMORY_SIZE (1 << 16)
+
+// Spins this many times before yielding the CPU while waiting for the agent
+#define SPIN_COUNT 4096
+
+struct w4_Shm {
+    uint8_t* data;
+    size_t size;
+    w4_ShmHeader* header;
+
+#if defined(_WIN32)
+    HANDLE file;
+    HANDLE mapping;
+#endif
+};
+
+static uint32_t loadAcquire (volatile uint32_t* ptr) {
+#if defined(_WIN32)
+    uint32_t value = *ptr;
+    MemoryBarrier();
+    return value;
+#else
+    return __atomic_load_n(ptr, __ATOMIC_ACQUIRE);
+#endif
+}
+
+static void storeRelease (volatile uint32_t* ptr, uint32_t value) {
+#if defined(_WIN32)
+    MemoryBarrier();
+    *ptr = value;
+#else
+    __atomic_store_n(ptr, value, __ATOMIC_RELEASE);
+#endif
+}
+
+static void yield () {
+#if defined(_WIN32)
+    SwitchToThread();
+#else
+    sched_yield();
+#endif
+}
+
+w4_Shm* w4_shmOpen (const char* path, int count) {
+    // Page align the memories so agents can map them directly
+    size_t memoryOffset = (W4_SHM_ACTIONS_OFFSET + 4*count + 4095) & ~(size_t)4095;
+    size_t size = memoryOffset + (size_t)count * MEMORY_SIZE;
+
+    w4_Shm* shm = xmalloc(sizeof(w4_Shm));
+    memset(shm, 0, sizeof(w4_Shm));
+    shm->size = size;
+
+#if defined(_WIN32)
+    shm->file = CreateFileA(path, GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ | FILE_SHARE_WRITE,
+        NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (shm->file == INVALID_HANDLE_VALUE) {
+        fprintf(stderr, "Error opening %s\n", path);
+        free(shm);
+        return NULL;
+    }
+    shm->mapping = CreateFileMappingA(shm->file, NULL, PAGE_READWRITE,
+        (DWORD)((uint64_t)size >> 32), (DWORD)size, NULL);
+    shm->data = shm->mapping ? MapViewOfFile(shm->mapping, FILE_MAP_ALL_ACCESS, 0, 0, size) : NULL;
+    if (shm->data == NULL) {
+        fprintf(stderr, "Error mapping %s\n", path);
+        if (shm->mapping) {
+            CloseHandle(shm->mapping);
+        }
+        CloseHandle(shm->file);
+        free(shm);
+        return NULL;
+    }
+#else
+    int fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        fprintf(stderr, "Error opening %s\n", path);
+        free(shm);
+        return NULL;
+    }
+    void* data = MAP_FAILED;
+    if (ftruncate(fd, size) == 0) {
+        data = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    }
+    close(fd);
+    if (data == MAP_FAILED) {
+        fprintf(stderr, "Error mapping %s\n", path);
+        free(shm);
+        return NULL;
+    }
+    shm->data = data;
+#endif
+
+    memset(shm->data, 0, memoryOffset);
+    w4_ShmHeader* header = (w4_ShmHeader*)shm->data;
+    header->version = W4_SHM_VERSION;
+    header->count = count;
+    header->memoryOffset = memoryOffset;
+
+    // Written last, so agents polling for the magic see a complete header
+    storeRelease(&header->magic, W4_SHM_MAGIC);
+
+    shm->header = header;
+    return shm;
+}
+
+void w4_shmClose (w4_Shm* shm) {
+#if defined(_WIN32)
+    UnmapViewOfFile(shm->data);
+    CloseHandle(shm->mapping);
+    CloseHandle(shm->file);
+#else
+    munmap(shm->data, shm->size);
+#endif
+    free(shm);
+}
+
+const uint8_t* w4_shmActions (w4_Shm* shm) {
+    return &shm->data[W4_SHM_ACTIONS_OFFSET];
+}
+
+void w4_shmPublish (w4_Shm* shm, w4_Batch* batch) {
+    w4_ShmHeader* header = shm->header;
+    uint8_t* memories = &shm->data[header->memoryOffset];
+    for (uint32_t n = 0; n < header->count; ++n) {
+        memcpy(&memories[n*MEMORY_SIZE], w4_batchMemory(batch, n), MEMORY_SIZE);
+    }
+    storeRelease(&header->frame, header->frame + 1);
+}
+
+bool w4_shmWait (w4_Shm* shm) {
+    w4_ShmHeader* header = shm->header;
+    uint32_t frame = header->frame;
+    for (int spins = 0; loadAcquire(&header->ack) != frame; ++spins) {
+        if (loadAcquire(&header->quit)) {
+            return false;
+        }
+        if (spins >= SPIN_COUNT) {
+            yield();
+        }
+    }
+    return !loadAcquire(&header->quit);
+}
@@ -0,0 +1,52 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "batch.h"
+
+// Shares the memory of a batch of instances with an external process (like a Python agent)
+// through a memory-mapped file, put it under /dev/shm to keep it off the disk.
+//
+// The file starts with a w4_ShmHeader, followed by 4 gamepad bytes per instance at
+// W4_SHM_ACTIONS_OFFSET, and then the 64 KB memory of each instance back to back at
+// memoryOffset. The runtime and the agent take turns without locks:
+//
+// 1. The runtime copies out every instance's memory, then stores frame+1 into frame.
+// 2. The agent waits for frame to change, reads the memories, writes the actions for the next
+//    frame, then stores frame into ack.
+// 3. The runtime waits for ack to catch up with frame, steps every instance with the actions,
+//    and goes back to 1.
+//
+// frame and ack must be read with acquire and written with release ordering. Setting quit to a
+// nonzero value stops the runtime.
+
+#define W4_SHM_MAGIC 0x4d533457 // "W4SM"
+#define W4_SHM_VERSION 1
+#define W4_SHM_ACTIONS_OFFSET 64
+
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t count;
+    uint32_t memoryOffset;
+
+    volatile uint32_t frame;
+    volatile uint32_t ack;
+    volatile uint32_t quit;
+} w4_ShmHeader;
+
+typedef struct w4_Shm w4_Shm;
+
+/** Creates or truncates the file at path and maps it, or returns NULL on failure. */
+w4_Shm* w4_shmOpen (const char* path, int count);
+void w4_shmClose (w4_Shm* shm);
+
+/** The actions written by the agent, in the layout expected by w4_batchStep. */
+const uint8_t* w4_shmActions (w4_Shm* shm);
+
+/** Copies out the memory of every instance and hands the frame to the agent. */
+void w4_shmPublish (w4_Shm* shm, w4_Batch* batch);
+
+/** Waits for the agent to acknowledge the last published frame. Returns false if it quit. */
+bool w4_shmWait (w4_Shm* shm);
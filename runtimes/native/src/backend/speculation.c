@@ -0,0 +1,360 @@
+#include "speculation.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "../util.h"
+#include "../wasm.h"
+#include "thread.h"
+
+// Number of alternative inputs simulated for each predicted frame
+#define CANDIDATES_PER_FRAME 2
+
+// Maximum number of states kept by all the branches together, about 32 MB
+#define STATE_BUDGET 512
+
+typedef struct {
+    /** The frame where the player's input changes, and what it changes to. */
+    uint32_t changeFrame;
+    uint8_t input;
+
+    /** The branch has been simulated from changeFrame up to but not including endFrame. */
+    uint32_t endFrame;
+
+    /** The frame the workers should simulate up to, there is a state reserved for each frame. */
+    uint32_t targetFrame;
+
+    /** The state at the start of changeFrame, from the rollback history. */
+    const void* startState;
+
+    /** W4_ROLLBACK_PLAYER_COUNT inputs for each frame from changeFrame. */
+    uint8_t* inputs;
+
+    /** The state after each frame from changeFrame. */
+    void** states;
+    int stateCount;
+} Branch;
+
+typedef struct {
+    w4_Speculation* speculation;
+    w4_Thread thread;
+
+    w4_Instance* instance;
+    w4_Disk disk;
+} Worker;
+
+struct w4_Speculation {
+    int historyLength;
+
+    /** The active branches, ordered by changeFrame. */
+    Branch* branches;
+    int branchCount;
+    int maxBranches;
+
+    /** Unused state buffers, and how many were allocated in total. */
+    void** freeStates;
+    int freeStateCount;
+    int allocatedStates;
+
+    int threadCount;
+    Worker* workers;
+
+    w4_Mutex mutex;
+    w4_Cond wake;
+    w4_Cond done;
+    unsigned long generation;
+    int running;
+    bool quit;
+
+    /** The next branch for a worker to claim. */
+    volatile long nextBranch;
+
+    /** Set to stop the workers early, checked between frames. */
+    volatile long cancel;
+};
+
+static void* acquireState (w4_Speculation* speculation) {
+    if (speculation->freeStateCount > 0) {
+        return speculation->freeStates[--speculation->freeStateCount];
+    }
+    if (speculation->allocatedStates < STATE_BUDGET) {
+        ++speculation->allocatedStates;
+        return xmalloc(w4_runtimeSerializeSize());
+    }
+    return NULL;
+}
+
+static void releaseStates (w4_Speculation* speculation, Branch* branch) {
+    for (int n = 0; n < branch->stateCount; ++n) {
+        speculation->freeStates[speculation->freeStateCount++] = branch->states[n];
+    }
+    branch->stateCount = 0;
+}
+
+static void swapBranches (Branch* a, Branch* b) {
+    Branch tmp = *a;
+    *a = *b;
+    *b = tmp;
+}
+
+static void advanceBranch (w4_Speculation* speculation, Worker* worker, Branch* branch) {
+    if (branch->endFrame >= branch->targetFrame) {
+        return;
+    }
+
+    w4_Instance* instance = worker->instance;
+    int n = branch->endFrame - branch->changeFrame;
+    w4_runtimeUnserialize(instance, (n == 0) ? branch->startState : branch->states[n-1]);
+
+    for (; branch->endFrame < branch->targetFrame; ++branch->endFrame, ++n) {
+        if (w4_atomicLoad(&speculation->cancel)) {
+            return;
+        }
+        const uint8_t* inputs = &branch->inputs[n*W4_ROLLBACK_PLAYER_COUNT];
+        for (int playerIdx = 0; playerIdx < W4_ROLLBACK_PLAYER_COUNT; ++playerIdx) {
+            w4_runtimeSetGamepad(instance, playerIdx, inputs[playerIdx]);
+        }
+        w4_runtimeStep(instance);
+        w4_runtimeSerialize(instance, branch->states[n]);
+    }
+}
+
+static void workerMain (void* arg) {
+    Worker* worker = arg;
+    w4_Speculation* speculation = worker->speculation;
+    unsigned long generation = 0;
+
+    w4_mutexLock(&speculation->mutex);
+    for (;;) {
+        while (speculation->generation == generation && !speculation->quit) {
+            w4_condWait(&speculation->wake, &speculation->mutex);
+        }
+        if (speculation->quit) {
+            break;
+        }
+        generation = speculation->generation;
+        w4_mutexUnlock(&speculation->mutex);
+
+        long idx;
+        while ((idx = w4_atomicFetchAdd(&speculation->nextBranch, 1)) < speculation->branchCount) {
+            advanceBranch(speculation, worker, &speculation->branches[idx]);
+        }
+
+        w4_mutexLock(&speculation->mutex);
+        if (--speculation->running == 0) {
+            w4_condBroadcast(&speculation->done);
+        }
+    }
+    w4_mutexUnlock(&speculation->mutex);
+}
+
+/** Stops the workers early and waits for them to go idle. */
+static void cancel (w4_Speculation* speculation) {
+    w4_mutexLock(&speculation->mutex);
+    w4_atomicStore(&speculation->cancel, 1);
+    while (speculation->running > 0) {
+        w4_condWait(&speculation->done, &speculation->mutex);
+    }
+    w4_mutexUnlock(&speculation->mutex);
+}
+
+static void addCandidate (uint8_t* candidates, int* count, uint8_t predicted, uint8_t input) {
+    if (input == predicted || *count >= CANDIDATES_PER_FRAME) {
+        return;
+    }
+    for (int n = 0; n < *count; ++n) {
+        if (candidates[n] == input) {
+            return;
+        }
+    }
+    candidates[(*count)++] = input;
+}
+
+w4_Speculation* w4_speculationCreate (const uint8_t* wasmBuffer, int byteLength, int threadCount,
+        int historyLength) {
+    w4_Speculation* speculation = xmalloc(sizeof(w4_Speculation));
+    memset(speculation, 0, sizeof(w4_Speculation));
+
+    speculation->historyLength = historyLength;
+    speculation->maxBranches = historyLength * CANDIDATES_PER_FRAME;
+    speculation->branches = xmalloc(speculation->maxBranches * sizeof(Branch));
+    memset(speculation->branches, 0, speculation->maxBranches * sizeof(Branch));
+    for (int n = 0; n < speculation->maxBranches; ++n) {
+        Branch* branch = &speculation->branches[n];
+        branch->inputs = xmalloc(historyLength * W4_ROLLBACK_PLAYER_COUNT);
+        branch->states = xmalloc(historyLength * sizeof(void*));
+    }
+    speculation->freeStates = xmalloc(STATE_BUDGET * sizeof(void*));
+
+    w4_mutexInit(&speculation->mutex);
+    w4_condInit(&speculation->wake);
+    w4_condInit(&speculation->done);
+
+    if (threadCount < 1) {
+        threadCount = 1;
+    }
+    speculation->threadCount = threadCount;
+    speculation->workers = xmalloc(threadCount * sizeof(Worker));
+    memset(speculation->workers, 0, threadCount * sizeof(Worker));
+    for (int n = 0; n < threadCount; ++n) {
+        Worker* worker = &speculation->workers[n];
+        worker->speculation = speculation;
+
+        worker->instance = w4_instanceCreate();
+        uint8_t* memory = w4_wasmInit(worker->instance);
+        w4_runtimeInit(worker->instance, memory, &worker->disk);
+        w4_wasmLoadModule(worker->instance, wasmBuffer, byteLength);
+
+        w4_threadCreate(&worker->thread, workerMain, worker);
+    }
+
+    return speculation;
+}
+
+void w4_speculationDestroy (w4_Speculation* speculation) {
+    cancel(speculation);
+
+    w4_mutexLock(&speculation->mutex);
+    speculation->quit = true;
+    w4_condBroadcast(&speculation->wake);
+    w4_mutexUnlock(&speculation->mutex);
+
+    for (int n = 0; n < speculation->threadCount; ++n) {
+        Worker* worker = &speculation->workers[n];
+        w4_threadJoin(worker->thread);
+        w4_instanceDestroy(worker->instance);
+    }
+
+    w4_condDestroy(&speculation->done);
+    w4_condDestroy(&speculation->wake);
+    w4_mutexDestroy(&speculation->mutex);
+
+    for (int n = 0; n < speculation->maxBranches; ++n) {
+        Branch* branch = &speculation->branches[n];
+        releaseStates(speculation, branch);
+        free(branch->states);
+        free(branch->inputs);
+    }
+    for (int n = 0; n < speculation->freeStateCount; ++n) {
+        free(speculation->freeStates[n]);
+    }
+    free(speculation->freeStates);
+    free(speculation->branches);
+    free(speculation->workers);
+    free(speculation);
+}
+
+void w4_speculationStart (w4_Speculation* speculation, w4_Rollback* rollback, int playerIdx) {
+    uint32_t currentFrame = w4_rollbackCurrentFrame(rollback);
+    uint32_t firstFrame = w4_rollbackFirstPredictedFrame(rollback, playerIdx);
+
+    // Drop the branches for frames whose real input arrived and matched the prediction
+    int keptCount = 0;
+    for (int n = 0; n < speculation->branchCount; ++n) {
+        Branch* branch = &speculation->branches[n];
+        branch->startState = w4_rollbackGetState(rollback, branch->changeFrame);
+        if (branch->changeFrame >= firstFrame && branch->startState) {
+            swapBranches(&speculation->branches[keptCount++], branch);
+        } else {
+            releaseStates(speculation, branch);
+        }
+    }
+    speculation->branchCount = keptCount;
+
+    // Add branches for the newly predicted frames
+    uint8_t inputs[W4_ROLLBACK_PLAYER_COUNT];
+    if (firstFrame < currentFrame && w4_rollbackGetInputs(rollback, firstFrame, inputs)) {
+        // Guess what the player did instead of repeating their last input: releasing everything,
+        // or going back to the input they had before
+        uint8_t predicted = inputs[playerIdx];
+        uint8_t candidates[CANDIDATES_PER_FRAME];
+        int candidateCount = 0;
+        addCandidate(candidates, &candidateCount, predicted, 0);
+        for (uint32_t frame = firstFrame-1; w4_rollbackGetInputs(rollback, frame, inputs); --frame) {
+            if (inputs[playerIdx] != predicted) {
+                addCandidate(candidates, &candidateCount, predicted, inputs[playerIdx]);
+                break;
+            }
+        }
+        static const uint8_t buttons[] = {
+            W4_BUTTON_X, W4_BUTTON_Z, W4_BUTTON_LEFT, W4_BUTTON_RIGHT, W4_BUTTON_UP, W4_BUTTON_DOWN,
+        };
+        for (int n = 0; n < (int)sizeof(buttons); ++n) {
+            addCandidate(candidates, &candidateCount, predicted, predicted ^ buttons[n]);
+        }
+
+        uint32_t frame = firstFrame;
+        if (speculation->branchCount > 0) {
+            frame = speculation->branches[speculation->branchCount-1].changeFrame + 1;
+        }
+        for (; frame < currentFrame; ++frame) {
+            for (int n = 0; n < candidateCount && speculation->branchCount < speculation->maxBranches; ++n) {
+                Branch* branch = &speculation->branches[speculation->branchCount++];
+                branch->changeFrame = frame;
+                branch->input = candidates[n];
+                branch->endFrame = frame;
+                branch->startState = w4_rollbackGetState(rollback, frame);
+            }
+        }
+    }
+
+    // Catch up every branch to the current frame, oldest first. If we run out of states, the
+    // newest branches are dropped to make room.
+    for (int n = 0; n < speculation->branchCount; ++n) {
+        Branch* branch = &speculation->branches[n];
+        int frameCount = currentFrame - branch->changeFrame;
+        for (int ii = 0; ii < frameCount; ++ii) {
+            uint8_t* frameInputs = &branch->inputs[ii*W4_ROLLBACK_PLAYER_COUNT];
+            w4_rollbackGetInputs(rollback, branch->changeFrame+ii, frameInputs);
+            frameInputs[playerIdx] = branch->input;
+        }
+
+        while (branch->stateCount < frameCount) {
+            void* state = acquireState(speculation);
+            if (state) {
+                branch->states[branch->stateCount++] = state;
+            } else if (speculation->branchCount > n+1) {
+                releaseStates(speculation, &speculation->branches[--speculation->branchCount]);
+            } else {
+                break;
+            }
+        }
+        branch->targetFrame = branch->changeFrame + branch->stateCount;
+    }
+
+    w4_mutexLock(&speculation->mutex);
+    speculation->nextBranch = 0;
+    w4_atomicStore(&speculation->cancel, 0);
+    speculation->running = speculation->threadCount;
+    ++speculation->generation;
+    w4_condBroadcast(&speculation->wake);
+    w4_mutexUnlock(&speculation->mutex);
+}
+
+bool w4_speculationResolve (w4_Speculation* speculation, w4_Rollback* rollback) {
+    cancel(speculation);
+
+    uint32_t scheduledFrame = w4_rollbackScheduledFrame(rollback);
+    if (!scheduledFrame) {
+        return false;
+    }
+
+    // Only a branch that changed input on exactly the frame being rolled back to can match
+    bool resolved = false;
+    uint32_t currentFrame = w4_rollbackCurrentFrame(rollback);
+    for (int n = 0; n < speculation->branchCount && !resolved; ++n) {
+        Branch* branch = &speculation->branches[n];
+        if (branch->changeFrame == scheduledFrame && branch->endFrame == currentFrame) {
+            resolved = w4_rollbackResolve(rollback, branch->changeFrame, branch->inputs,
+                branch->states);
+        }
+    }
+
+    // Every branch was based on inputs that turned out to be wrong
+    for (int n = 0; n < speculation->branchCount; ++n) {
+        releaseStates(speculation, &speculation->branches[n]);
+    }
+    speculation->branchCount = 0;
+
+    return resolved;
+}
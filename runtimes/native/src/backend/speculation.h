@@ -0,0 +1,37 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "../rollback.h"
+
+// Speculative rollback for netplay. While a remote player's inputs are still predicted, worker
+// threads simulate branches where the player instead changed their input on one of those frames,
+// to the most likely alternatives: releasing everything, or going back to their previous input.
+// Each branch is advanced by one frame per update, alongside the main simulation. When the real
+// input arrives and matches a branch, the rollback is resolved by swapping in that branch's states
+// instead of simulating all the frames since again on the main thread.
+//
+// The workers each run their own instance of the cart. The branches' states are kept within a
+// fixed budget, and the branches that change input on the oldest frames are kept first, as those
+// are the frames whose real input arrives next.
+
+typedef struct w4_Speculation w4_Speculation;
+
+/** Loads an instance of the cart for each of threadCount worker threads. */
+w4_Speculation* w4_speculationCreate (const uint8_t* wasmBuffer, int byteLength, int threadCount,
+    int historyLength);
+void w4_speculationDestroy (w4_Speculation* speculation);
+
+/**
+ * Updates the branches for a player's predicted inputs up to the rollback's current frame, and
+ * starts advancing them on the workers. Returns immediately.
+ */
+void w4_speculationStart (w4_Speculation* speculation, w4_Rollback* rollback, int playerIdx);
+
+/**
+ * Stops the workers, then applies the rollback's scheduled rollback from a branch that guessed
+ * right, if there is one. Must be called before the next w4_rollbackUpdate. Returns whether a
+ * branch was used.
+ */
+bool w4_speculationResolve (w4_Speculation* speculation, w4_Rollback* rollback);
@@ -0,0 +1,146 @@
+#if !defined(_WIN32)
+#define _POSIX_C_SOURCE 200809L
+#endif
+
+#include "thread.h"
+
+#include <stdlib.h>
+
+#include "../util.h"
+
+#if !defined(_WIN32)
+#include <unistd.h>
+#endif
+
+typedef struct {
+    void (*fn)(void* arg);
+    void* arg;
+} ThreadStart;
+
+#if defined(_WIN32)
+static DWORD WINAPI threadMain (LPVOID param) {
+#else
+static void* threadMain (void* param) {
+#endif
+    ThreadStart start = *(ThreadStart*)param;
+    free(param);
+    start.fn(start.arg);
+    return 0;
+}
+
+void w4_threadCreate (w4_Thread* thread, void (*fn)(void* arg), void* arg) {
+    ThreadStart* start = xmalloc(sizeof(ThreadStart));
+    start->fn = fn;
+    start->arg = arg;
+#if defined(_WIN32)
+    *thread = CreateThread(NULL, 0, threadMain, start, 0, NULL);
+#else
+    pthread_create(thread, NULL, threadMain, start);
+#endif
+}
+
+void w4_threadJoin (w4_Thread thread) {
+#if defined(_WIN32)
+    WaitForSingleObject(thread, INFINITE);
+    CloseHandle(thread);
+#else
+    pthread_join(thread, NULL);
+#endif
+}
+
+long w4_atomicFetchAdd (volatile long* value, long amount) {
+#if defined(_WIN32)
+    return InterlockedExchangeAdd(value, amount);
+#else
+    return __atomic_fetch_add(value, amount, __ATOMIC_RELAXED);
+#endif
+}
+
+long w4_atomicLoad (volatile long* value) {
+#if defined(_WIN32)
+    return InterlockedCompareExchange(value, 0, 0);
+#else
+    return __atomic_load_n(value, __ATOMIC_ACQUIRE);
+#endif
+}
+
+void w4_atomicStore (volatile long* value, long newValue) {
+#if defined(_WIN32)
+    InterlockedExchange(value, newValue);
+#else
+    __atomic_store_n(value, newValue, __ATOMIC_RELEASE);
+#endif
+}
+
+int w4_cpuCount () {
+#if defined(_WIN32)
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+    return info.dwNumberOfProcessors;
+#else
+    long count = sysconf(_SC_NPROCESSORS_ONLN);
+    return count > 0 ? count : 1;
+#endif
+}
+
+void w4_mutexInit (w4_Mutex* mutex) {
+#if defined(_WIN32)
+    InitializeCriticalSection(mutex);
+#else
+    pthread_mutex_init(mutex, NULL);
+#endif
+}
+
+void w4_mutexDestroy (w4_Mutex* mutex) {
+#if defined(_WIN32)
+    DeleteCriticalSection(mutex);
+#else
+    pthread_mutex_destroy(mutex);
+#endif
+}
+
+void w4_mutexLock (w4_Mutex* mutex) {
+#if defined(_WIN32)
+    EnterCriticalSection(mutex);
+#else
+    pthread_mutex_lock(mutex);
+#endif
+}
+
+void w4_mutexUnlock (w4_Mutex* mutex) {
+#if defined(_WIN32)
+    LeaveCriticalSection(mutex);
+#else
+    pthread_mutex_unlock(mutex);
+#endif
+}
+
+void w4_condInit (w4_Cond* cond) {
+#if defined(_WIN32)
+    InitializeConditionVariable(cond);
+#else
+    pthread_cond_init(cond, NULL);
+#endif
+}
+
+void w4_condDestroy (w4_Cond* cond) {
+#if !defined(_WIN32)
+    pthread_cond_destroy(cond);
+#endif
+}
+
+void w4_condWait (w4_Cond* cond, w4_Mutex* mutex) {
+#if defined(_WIN32)
+    SleepConditionVariableCS(cond, mutex, INFINITE);
+#else
+    pthread_cond_wait(cond, mutex);
+#endif
+}
+
+void w4_condBroadcast (w4_Cond* cond) {
+#if defined(_WIN32)
+    WakeAllConditionVariable(cond);
+#else
+    pthread_cond_broadcast(cond);
+#endif
+}
@@ -0,0 +1,46 @@
+#pragma once
+
+// Minimal threading wrappers over pthreads, or Win32 on Windows. These live in src/backend/ so the
+// libretro console builds don't need them.
+
+#if defined(_WIN32)
+#include <windows.h>
+#else
+#include <pthread.h>
+#endif
+
+#if defined(_WIN32)
+typedef HANDLE w4_Thread;
+typedef CRITICAL_SECTION w4_Mutex;
+typedef CONDITION_VARIABLE w4_Cond;
+#else
+typedef pthread_t w4_Thread;
+typedef pthread_mutex_t w4_Mutex;
+typedef pthread_cond_t w4_Cond;
+#endif
+
+/** Starts a thread running fn(arg). */
+void w4_threadCreate (w4_Thread* thread, void (*fn)(void* arg), void* arg);
+
+/** Waits for a thread to return and releases it. */
+void w4_threadJoin (w4_Thread thread);
+
+/** Atomically adds to a value and returns the previous value. Relaxed ordering. */
+long w4_atomicFetchAdd (volatile long* value, long amount);
+
+/** Atomically reads or writes a flag shared between threads. */
+long w4_atomicLoad (volatile long* value);
+void w4_atomicStore (volatile long* value, long newValue);
+
+/** The number of online CPUs, at least 1. */
+int w4_cpuCount ();
+
+void w4_mutexInit (w4_Mutex* mutex);
+void w4_mutexDestroy (w4_Mutex* mutex);
+void w4_mutexLock (w4_Mutex* mutex);
+void w4_mutexUnlock (w4_Mutex* mutex);
+
+void w4_condInit (w4_Cond* cond);
+void w4_condDestroy (w4_Cond* cond);
+void w4_condWait (w4_Cond* cond, w4_Mutex* mutex);
+void w4_condBroadcast (w4_Cond* cond);
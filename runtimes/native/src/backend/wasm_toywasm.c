@@ -2,6 +2,7 @@
 #include <inttypes.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include <toywasm/exec_context.h>
 #include <toywasm/exec_debug.h>
@@ -12,7 +13,8 @@
 #include <toywasm/module.h>
 #include <toywasm/type.h>
 
-#include "../runtime.h"
+#include "../instance.h"
+#include "../util.h"
 #include "../wasm.h"
 
 static const struct memtype memtype = {
@@ -27,22 +29,29 @@ static const struct memtype memtype = {
 #endif
 };
 
-static struct mem_context mctx;
-static struct meminst *meminst;
-static struct import_object *host_import_obj;
-static struct import_object *mem_import_obj;
-static struct module *module;
-static struct instance *instance;
-static uint32_t start;
-static uint32_t update;
+struct w4_Wasm {
+    /* first, so host functions can cast their host_instance back */
+    struct host_instance hi;
+    w4_Instance *instance;
+
+    struct mem_context mctx;
+    struct meminst *meminst;
+    struct import_object *host_import_obj;
+    struct import_object *mem_import_obj;
+    struct module *module;
+    struct instance *inst;
+    uint32_t start;
+    uint32_t update;
+};
 
-static void *convert_to_ptr(struct exec_context *ctx, uint32_t wp) {
+static void *convert_to_ptr(struct w4_Wasm *wasm, struct exec_context *ctx,
+                            uint32_t wp) {
     /*
      * XXX we can't perform proper bounds check because we don't
      * know the size of the access. especially for things like tracef.
      */
     void *p;
-    int ret = host_func_getptr(ctx, meminst, wp, 1, &p);
+    int ret = host_func_getptr(ctx, wasm->meminst, wp, 1, &p);
     if (ret != 0) {
         fprintf(stderr,
                 "host_func_getptr failed with %d: wasm ptr 0x%" PRIx32 "\n",
@@ -59,9 +68,10 @@ static void *convert_to_ptr(struct exec_context *ctx, uint32_t wp) {
 #define W4_HOST_FUNC_DECL(n) HOST_FUNC_DECL(w4_##n)
 
 #define HOST_FUNC_PARAM_PTR(ft, params, i)                                     \
-    convert_to_ptr(ctx, HOST_FUNC_PARAM(ft, params, i, i32))
+    convert_to_ptr(wasm, ctx, HOST_FUNC_PARAM(ft, params, i, i32))
 
 static W4_HOST_FUNC_DECL(blit) {
+    struct w4_Wasm *wasm = (struct w4_Wasm *)hi;
     HOST_FUNC_CONVERT_PARAMS(ft, params);
     const uint8_t *sprite = HOST_FUNC_PARAM_PTR(ft, params, 0);
     uint32_t x = HOST_FUNC_PARAM(ft, params, 1, i32);
@@ -69,12 +79,13 @@ static W4_HOST_FUNC_DECL(blit) {
     uint32_t width = HOST_FUNC_PARAM(ft, params, 3, i32);
     uint32_t height = HOST_FUNC_PARAM(ft, params, 4, i32);
     uint32_t flags = HOST_FUNC_PARAM(ft, params, 5, i32);
-    w4_runtimeBlit(sprite, x, y, width, height, flags);
+    w4_runtimeBlit(wasm->instance, sprite, x, y, width, height, flags);
     HOST_FUNC_FREE_CONVERTED_PARAMS();
     return 0;
 }
 
 static W4_HOST_FUNC_DECL(blitSub) {
+    struct w4_Wasm *wasm = (struct w4_Wasm *)hi;
     HOST_FUNC_CONVERT_PARAMS(ft, params);
     const uint8_t *sprite = HOST_FUNC_PARAM_PTR(ft, params, 0);
     uint32_t x = HOST_FUNC_PARAM(ft, params, 1, i32);
@@ -85,158 +96,174 @@ static W4_HOST_FUNC_DECL(blitSub) {
     uint32_t srcY = HOST_FUNC_PARAM(ft, params, 6, i32);
     uint32_t stride = HOST_FUNC_PARAM(ft, params, 7, i32);
     uint32_t flags = HOST_FUNC_PARAM(ft, params, 8, i32);
-    w4_runtimeBlitSub(sprite, x, y, width, height, srcX, srcY, stride, flags);
+    w4_runtimeBlitSub(wasm->instance, sprite, x, y, width, height, srcX, srcY,
+                      stride, flags);
     HOST_FUNC_FREE_CONVERTED_PARAMS();
     return 0;
 }
 
 static W4_HOST_FUNC_DECL(line) {
+    struct w4_Wasm *wasm = (struct w4_Wasm *)hi;
     HOST_FUNC_CONVERT_PARAMS(ft, params);
     uint32_t x1 = HOST_FUNC_PARAM(ft, params, 0, i32);
     uint32_t y1 = HOST_FUNC_PARAM(ft, params, 1, i32);
     uint32_t x2 = HOST_FUNC_PARAM(ft, params, 2, i32);
     uint32_t y2 = HOST_FUNC_PARAM(ft, params, 3, i32);
-    w4_runtimeLine(x1, y1, x2, y2);
+    w4_runtimeLine(wasm->instance, x1, y1, x2, y2);
     HOST_FUNC_FREE_CONVERTED_PARAMS();
     return 0;
 }
 
 static W4_HOST_FUNC_DECL(hline) {
+    struct w4_Wasm *wasm = (struct w4_Wasm *)hi;
     HOST_FUNC_CONVERT_PARAMS(ft, params);
     uint32_t x = HOST_FUNC_PARAM(ft, params, 0, i32);
     uint32_t y = HOST_FUNC_PARAM(ft, params, 1, i32);
     uint32_t len = HOST_FUNC_PARAM(ft, params, 2, i32);
-    w4_runtimeHLine(x, y, len);
+    w4_runtimeHLine(wasm->instance, x, y, len);
     HOST_FUNC_FREE_CONVERTED_PARAMS();
     return 0;
 }
 
 static W4_HOST_FUNC_DECL(vline) {
+    struct w4_Wasm *wasm = (struct w4_Wasm *)hi;
     HOST_FUNC_CONVERT_PARAMS(ft, params);
     uint32_t x = HOST_FUNC_PARAM(ft, params, 0, i32);
     uint32_t y = HOST_FUNC_PARAM(ft, params, 1, i32);
     uint32_t len = HOST_FUNC_PARAM(ft, params, 2, i32);
-    w4_runtimeVLine(x, y, len);
+    w4_runtimeVLine(wasm->instance, x, y, len);
     HOST_FUNC_FREE_CONVERTED_PARAMS();
     return 0;
 }
 
 static W4_HOST_FUNC_DECL(oval) {
+    struct w4_Wasm *wasm = (struct w4_Wasm *)hi;
     HOST_FUNC_CONVERT_PARAMS(ft, params);
     uint32_t x = HOST_FUNC_PARAM(ft, params, 0, i32);
     uint32_t y = HOST_FUNC_PARAM(ft, params, 1, i32);
     uint32_t width = HOST_FUNC_PARAM(ft, params, 2, i32);
     uint32_t height = HOST_FUNC_PARAM(ft, params, 3, i32);
-    w4_runtimeOval(x, y, width, height);
+    w4_runtimeOval(wasm->instance, x, y, width, height);
     HOST_FUNC_FREE_CONVERTED_PARAMS();
     return 0;
 }
 
 static W4_HOST_FUNC_DECL(rect) {
+    struct w4_Wasm *wasm = (struct w4_Wasm *)hi;
     HOST_FUNC_CONVERT_PARAMS(ft, params);
     uint32_t x = HOST_FUNC_PARAM(ft, params, 0, i32);
     uint32_t y = HOST_FUNC_PARAM(ft, params, 1, i32);
     uint32_t width = HOST_FUNC_PARAM(ft, params, 2, i32);
     uint32_t height = HOST_FUNC_PARAM(ft, params, 3, i32);
-    w4_runtimeRect(x, y, width, height);
+    w4_runtimeRect(wasm->instance, x, y, width, height);
     HOST_FUNC_FREE_CONVERTED_PARAMS();
     return 0;
 }
 
 static W4_HOST_FUNC_DECL(text) {
+    struct w4_Wasm *wasm = (struct w4_Wasm *)hi;
     HOST_FUNC_CONVERT_PARAMS(ft, params);
     const uint8_t *str = HOST_FUNC_PARAM_PTR(ft, params, 0);
     uint32_t x = HOST_FUNC_PARAM(ft, params, 1, i32);
     uint32_t y = HOST_FUNC_PARAM(ft, params, 2, i32);
-    w4_runtimeText(str, x, y);
+    w4_runtimeText(wasm->instance, str, x, y);
     HOST_FUNC_FREE_CONVERTED_PARAMS();
     return 0;
 }
 
 static W4_HOST_FUNC_DECL(textUtf8) {
+    struct w4_Wasm *wasm = (struct w4_Wasm *)hi;
     HOST_FUNC_CONVERT_PARAMS(ft, params);
     const uint8_t *str = HOST_FUNC_PARAM_PTR(ft, params, 0);
     uint32_t byteLength = HOST_FUNC_PARAM(ft, params, 1, i32);
     uint32_t x = HOST_FUNC_PARAM(ft, params, 2, i32);
     uint32_t y = HOST_FUNC_PARAM(ft, params, 3, i32);
-    w4_runtimeTextUtf8(str, byteLength, x, y);
+    w4_runtimeTextUtf8(wasm->instance, str, byteLength, x, y);
     HOST_FUNC_FREE_CONVERTED_PARAMS();
     return 0;
 }
 
 static W4_HOST_FUNC_DECL(textUtf16) {
+    struct w4_Wasm *wasm = (struct w4_Wasm *)hi;
     HOST_FUNC_CONVERT_PARAMS(ft, params);
     const uint16_t *str = HOST_FUNC_PARAM_PTR(ft, params, 0);
     uint32_t byteLength = HOST_FUNC_PARAM(ft, params, 1, i32);
     uint32_t x = HOST_FUNC_PARAM(ft, params, 2, i32);
     uint32_t y = HOST_FUNC_PARAM(ft, params, 3, i32);
-    w4_runtimeTextUtf16(str, byteLength, x, y);
+    w4_runtimeTextUtf16(wasm->instance, str, byteLength, x, y);
     HOST_FUNC_FREE_CONVERTED_PARAMS();
     return 0;
 }
 
 static W4_HOST_FUNC_DECL(tone) {
+    struct w4_Wasm *wasm = (struct w4_Wasm *)hi;
     HOST_FUNC_CONVERT_PARAMS(ft, params);
     uint32_t frequency = HOST_FUNC_PARAM(ft, params, 0, i32);
     uint32_t duration = HOST_FUNC_PARAM(ft, params, 1, i32);
     uint32_t volume = HOST_FUNC_PARAM(ft, params, 2, i32);
     uint32_t flags = HOST_FUNC_PARAM(ft, params, 3, i32);
-    w4_runtimeTone(frequency, duration, volume, flags);
+    w4_runtimeTone(wasm->instance, frequency, duration, volume, flags);
     HOST_FUNC_FREE_CONVERTED_PARAMS();
     return 0;
 }
 
 static W4_HOST_FUNC_DECL(diskr) {
+    struct w4_Wasm *wasm = (struct w4_Wasm *)hi;
     HOST_FUNC_CONVERT_PARAMS(ft, params);
     uint8_t *dest = HOST_FUNC_PARAM_PTR(ft, params, 0);
     uint32_t size = HOST_FUNC_PARAM(ft, params, 1, i32);
-    int wasmret = w4_runtimeDiskr(dest, size);
+    int wasmret = w4_runtimeDiskr(wasm->instance, dest, size);
     HOST_FUNC_RESULT_SET(ft, results, 0, i32, wasmret);
     HOST_FUNC_FREE_CONVERTED_PARAMS();
     return 0;
 }
 
 static W4_HOST_FUNC_DECL(diskw) {
+    struct w4_Wasm *wasm = (struct w4_Wasm *)hi;
     HOST_FUNC_CONVERT_PARAMS(ft, params);
     const uint8_t *src = HOST_FUNC_PARAM_PTR(ft, params, 0);
     uint32_t size = HOST_FUNC_PARAM(ft, params, 1, i32);
-    int wasmret = w4_runtimeDiskw(src, size);
+    int wasmret = w4_runtimeDiskw(wasm->instance, src, size);
     HOST_FUNC_RESULT_SET(ft, results, 0, i32, wasmret);
     HOST_FUNC_FREE_CONVERTED_PARAMS();
     return 0;
 }
 
 static W4_HOST_FUNC_DECL(trace) {
+    struct w4_Wasm *wasm = (struct w4_Wasm *)hi;
     HOST_FUNC_CONVERT_PARAMS(ft, params);
     const uint8_t *str = HOST_FUNC_PARAM_PTR(ft, params, 0);
-    w4_runtimeTrace(str);
+    w4_runtimeTrace(wasm->instance, str);
     HOST_FUNC_FREE_CONVERTED_PARAMS();
     return 0;
 }
 
 static W4_HOST_FUNC_DECL(traceUtf8) {
+    struct w4_Wasm *wasm = (struct w4_Wasm *)hi;
     HOST_FUNC_CONVERT_PARAMS(ft, params);
     const uint8_t *str = HOST_FUNC_PARAM_PTR(ft, params, 0);
     uint32_t byteLength = HOST_FUNC_PARAM(ft, params, 1, i32);
-    w4_runtimeTraceUtf8(str, byteLength);
+    w4_runtimeTraceUtf8(wasm->instance, str, byteLength);
     HOST_FUNC_FREE_CONVERTED_PARAMS();
     return 0;
 }
 
 static W4_HOST_FUNC_DECL(traceUtf16) {
+    struct w4_Wasm *wasm = (struct w4_Wasm *)hi;
     HOST_FUNC_CONVERT_PARAMS(ft, params);
     const uint16_t *str = HOST_FUNC_PARAM_PTR(ft, params, 0);
     uint32_t byteLength = HOST_FUNC_PARAM(ft, params, 1, i32);
-    w4_runtimeTraceUtf16(str, byteLength);
+    w4_runtimeTraceUtf16(wasm->instance, str, byteLength);
     HOST_FUNC_FREE_CONVERTED_PARAMS();
     return 0;
 }
 
 static W4_HOST_FUNC_DECL(tracef) {
+    struct w4_Wasm *wasm = (struct w4_Wasm *)hi;
     HOST_FUNC_CONVERT_PARAMS(ft, params);
     const uint8_t *str = HOST_FUNC_PARAM_PTR(ft, params, 0);
     const void *stack = HOST_FUNC_PARAM_PTR(ft, params, 1);
-    w4_runtimeTracef(str, stack);
+    w4_runtimeTracef(wasm->instance, str, stack);
     HOST_FUNC_FREE_CONVERTED_PARAMS();
     return 0;
 }
@@ -262,27 +289,33 @@ static const struct host_module host_modules[] = {{
     .nfuncs = ARRAYCOUNT(host_inst_funcs),
 }};
 
-uint8_t *w4_wasmInit() {
+uint8_t *w4_wasmInit(w4_Instance *instance) {
+    struct w4_Wasm *wasm = xmalloc(sizeof(struct w4_Wasm));
+    memset(wasm, 0, sizeof(struct w4_Wasm));
+    wasm->instance = instance;
+    instance->wasm = wasm;
+
+    struct mem_context *mctx = &wasm->mctx;
     int ret;
-    mem_context_init(&mctx);
+    mem_context_init(mctx);
     /*
      * set an arbitrary limit.
      * this includes the 64KB linear memory.
      * REVISIT: how much operand stack etc typical carts can consume?
      */
-    ret = mem_context_setlimit(&mctx, 128 * 1024);
+    ret = mem_context_setlimit(mctx, 128 * 1024);
     if (ret != 0) {
         fprintf(stderr, "failed to set memory limit with %d\n", ret);
         exit(1);
     }
-    ret = memory_instance_create(&mctx, &meminst, &memtype);
+    ret = memory_instance_create(mctx, &wasm->meminst, &memtype);
     if (ret != 0) {
         fprintf(stderr, "memory_instance_create failed with %d\n", ret);
         exit(1);
     }
     void *p;
     bool moved;
-    ret = memory_instance_getptr2(meminst, 0, 0, 64 * 1024, &p, &moved);
+    ret = memory_instance_getptr2(wasm->meminst, 0, 0, 64 * 1024, &p, &moved);
     if (ret != 0) {
         fprintf(stderr, "memory_instance_getptr2 failed with %d\n", ret);
         exit(1);
@@ -290,23 +323,26 @@ uint8_t *w4_wasmInit() {
     return p;
 }
 
-void w4_wasmDestroy() {
-    if (instance != NULL) {
-        instance_destroy(instance);
+void w4_wasmDestroy(w4_Instance *instance) {
+    struct w4_Wasm *wasm = instance->wasm;
+    if (wasm->inst != NULL) {
+        instance_destroy(wasm->inst);
     }
-    if (module != NULL) {
-        module_destroy(&mctx, module);
+    if (wasm->module != NULL) {
+        module_destroy(&wasm->mctx, wasm->module);
     }
-    if (host_import_obj != NULL) {
-        import_object_destroy(&mctx, host_import_obj);
+    if (wasm->host_import_obj != NULL) {
+        import_object_destroy(&wasm->mctx, wasm->host_import_obj);
     }
-    if (mem_import_obj != NULL) {
-        import_object_destroy(&mctx, mem_import_obj);
+    if (wasm->mem_import_obj != NULL) {
+        import_object_destroy(&wasm->mctx, wasm->mem_import_obj);
     }
-    if (meminst != NULL) {
-        memory_instance_destroy(&mctx, meminst);
+    if (wasm->meminst != NULL) {
+        memory_instance_destroy(&wasm->mctx, wasm->meminst);
     }
-    mem_context_clear(&mctx);
+    mem_context_clear(&wasm->mctx);
+    free(wasm);
+    instance->wasm = NULL;
 }
 
 static uint32_t find_func(const struct module *m, const char *name_cstr,
@@ -339,10 +375,10 @@ static uint32_t find_func(const struct module *m, const char *name_cstr,
     return idx;
 }
 
-int run_func(struct instance *inst, uint32_t funcidx) {
+static int run_func(struct w4_Wasm *wasm, uint32_t funcidx) {
     struct exec_context ctx;
     int ret;
-    exec_context_init(&ctx, inst, &mctx);
+    exec_context_init(&ctx, wasm->inst, &wasm->mctx);
     ret = instance_execute_func_nocheck(&ctx, funcidx);
     ret = instance_execute_handle_restart(&ctx, ret);
     if (ret == ETOYWASMTRAP) {
@@ -355,11 +391,15 @@ int run_func(struct instance *inst, uint32_t funcidx) {
     return ret;
 }
 
-void w4_wasmLoadModule(const uint8_t *wasmBuffer, int byteLength) {
+void w4_wasmLoadModule(w4_Instance *instance, const uint8_t *wasmBuffer,
+                       int byteLength) {
+    struct w4_Wasm *wasm = instance->wasm;
+    struct mem_context *mctx = &wasm->mctx;
+    struct import_object *mem_import_obj;
     struct import_object *import_obj;
     int ret;
 
-    ret = import_object_alloc(&mctx, 1, &mem_import_obj);
+    ret = import_object_alloc(mctx, 1, &mem_import_obj);
     if (ret != 0) {
         fprintf(stderr, "import_object_alloc failed with %d\n", ret);
         exit(1);
@@ -367,20 +407,23 @@ void w4_wasmLoadModule(const uint8_t *wasmBuffer, int byteLength) {
     mem_import_obj->entries[0].module_name = &name_env;
     mem_import_obj->entries[0].name = &name_memory;
     mem_import_obj->entries[0].type = EXTERNTYPE_MEMORY;
-    mem_import_obj->entries[0].u.mem = meminst;
+    mem_import_obj->entries[0].u.mem = wasm->meminst;
+    wasm->mem_import_obj = mem_import_obj;
     ret = import_object_create_for_host_funcs(
-        &mctx, host_modules, ARRAYCOUNT(host_modules), NULL, &host_import_obj);
+        mctx, host_modules, ARRAYCOUNT(host_modules), &wasm->hi,
+        &wasm->host_import_obj);
     if (ret != 0) {
         fprintf(stderr, "import_object_create_for_host_funcs failed with %d\n",
                 ret);
         exit(1);
     }
-    import_obj = host_import_obj;
-    host_import_obj->next = mem_import_obj;
+    import_obj = wasm->host_import_obj;
+    import_obj->next = mem_import_obj;
 
     struct load_context lctx;
-    load_context_init(&lctx, &mctx);
-    ret = module_create(&module, wasmBuffer, wasmBuffer + byteLength, &lctx);
+    load_context_init(&lctx, mctx);
+    ret = module_create(&wasm->module, wasmBuffer, wasmBuffer + byteLength,
+                        &lctx);
     if (ret != 0) {
         fprintf(stderr, "module_create failed with %d: %s\n", ret,
                 report_getmessage(&lctx.report));
@@ -390,7 +433,7 @@ void w4_wasmLoadModule(const uint8_t *wasmBuffer, int byteLength) {
 
     struct report report;
     report_init(&report);
-    ret = instance_create(&mctx, module, &instance, import_obj, &report);
+    ret = instance_create(mctx, wasm->module, &wasm->inst, import_obj, &report);
     if (ret != 0) {
         fprintf(stderr, "instance_create failed with %d: %s\n", ret,
                 report_getmessage(&report));
@@ -398,8 +441,8 @@ void w4_wasmLoadModule(const uint8_t *wasmBuffer, int byteLength) {
     }
     report_clear(&report);
 
-    start = find_func(module, "start", false);
-    update = find_func(module, "update", true);
+    wasm->start = find_func(wasm->module, "start", false);
+    wasm->update = find_func(wasm->module, "update", true);
 
     /*
      * usually, a wasm module exports either '_start' or '_initialize',
@@ -415,24 +458,26 @@ void w4_wasmLoadModule(const uint8_t *wasmBuffer, int byteLength) {
      * - https://github.com/WebAssembly/tool-conventions/blob/3822c2b4365ac2849c85ea078d7679ed896f2fd2/BasicModuleABI.md
      * - https://github.com/WebAssembly/WASI/blob/8a69f1ed6ce7bfd3cfe72270b787d4d4598b721d/legacy/application-abi.md#current-unstable-abi
      */
-    uint32_t _start = find_func(module, "_start", false);
+    uint32_t _start = find_func(wasm->module, "_start", false);
     if (_start != (uint32_t)-1) {
-        run_func(instance, _start);
+        run_func(wasm, _start);
     }
-    uint32_t _initialize = find_func(module, "_initialize", false);
+    uint32_t _initialize = find_func(wasm->module, "_initialize", false);
     if (_initialize != (uint32_t)-1) {
-        run_func(instance, _initialize);
+        run_func(wasm, _initialize);
     }
 }
 
-void w4_wasmCallStart() {
-    if (start != (uint32_t)-1) {
-        run_func(instance, start);
+void w4_wasmCallStart(w4_Instance *instance) {
+    struct w4_Wasm *wasm = instance->wasm;
+    if (wasm->start != (uint32_t)-1) {
+        run_func(wasm, wasm->start);
     }
 }
 
-void w4_wasmCallUpdate() {
-    if (update != (uint32_t)-1) {
-        run_func(instance, update);
+void w4_wasmCallUpdate(w4_Instance *instance) {
+    struct w4_Wasm *wasm = instance->wasm;
+    if (wasm->update != (uint32_t)-1) {
+        run_func(wasm, wasm->update);
     }
 }
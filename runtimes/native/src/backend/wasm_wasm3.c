@@ -1,28 +1,35 @@
 #include <wasm3.h>
 #include <m3_env.h>
+#include <stdlib.h>
+#include <string.h>
 
+#include "../instance.h"
+#include "../util.h"
 #include "../wasm.h"
-#include "../runtime.h"
 
-static M3Environment* env;
-static M3Runtime* runtime;
-static M3Module* module;
+struct w4_Wasm {
+    M3Environment* env;
+    M3Runtime* runtime;
+    M3Module* module;
 
-static M3Function* start;
-static M3Function* update;
+    M3Function* start;
+    M3Function* update;
+};
 
 static m3ApiRawFunction (blit) {
+    w4_Instance* instance = m3_GetUserData(runtime);
     m3ApiGetArgMem(const uint8_t*, sprite);
     m3ApiGetArg(int, x);
     m3ApiGetArg(int, y);
     m3ApiGetArg(int, width);
     m3ApiGetArg(int, height);
     m3ApiGetArg(int, flags);
-    w4_runtimeBlit(sprite, x, y, width, height, flags);
+    w4_runtimeBlit(instance, sprite, x, y, width, height, flags);
     m3ApiSuccess();
 }
 
 static m3ApiRawFunction (blitSub) {
+    w4_Instance* instance = m3_GetUserData(runtime);
     m3ApiGetArgMem(const uint8_t*, sprite);
     m3ApiGetArg(int, x);
     m3ApiGetArg(int, y);
@@ -32,130 +39,145 @@ static m3ApiRawFunction (blitSub) {
     m3ApiGetArg(int, srcY);
     m3ApiGetArg(int, stride);
     m3ApiGetArg(int, flags);
-    w4_runtimeBlitSub(sprite, x, y, width, height, srcX, srcY, stride, flags);
+    w4_runtimeBlitSub(instance, sprite, x, y, width, height, srcX, srcY, stride, flags);
     m3ApiSuccess();
 }
 
 static m3ApiRawFunction (line) {
+    w4_Instance* instance = m3_GetUserData(runtime);
     m3ApiGetArg(int, x1);
     m3ApiGetArg(int, y1);
     m3ApiGetArg(int, x2);
     m3ApiGetArg(int, y2);
-    w4_runtimeLine(x1, y1, x2, y2);
+    w4_runtimeLine(instance, x1, y1, x2, y2);
     m3ApiSuccess();
 }
 
 static m3ApiRawFunction (hline) {
+    w4_Instance* instance = m3_GetUserData(runtime);
     m3ApiGetArg(int, x);
     m3ApiGetArg(int, y);
     m3ApiGetArg(int, len);
-    w4_runtimeHLine(x, y, len);
+    w4_runtimeHLine(instance, x, y, len);
     m3ApiSuccess();
 }
 
 static m3ApiRawFunction (vline) {
+    w4_Instance* instance = m3_GetUserData(runtime);
     m3ApiGetArg(int, x);
     m3ApiGetArg(int, y);
     m3ApiGetArg(int, len);
-    w4_runtimeVLine(x, y, len);
+    w4_runtimeVLine(instance, x, y, len);
     m3ApiSuccess();
 }
 
 static m3ApiRawFunction (oval) {
+    w4_Instance* instance = m3_GetUserData(runtime);
     m3ApiGetArg(int, x);
     m3ApiGetArg(int, y);
     m3ApiGetArg(int, width);
     m3ApiGetArg(int, height);
-    w4_runtimeOval(x, y, width, height);
+    w4_runtimeOval(instance, x, y, width, height);
     m3ApiSuccess();
 }
 
 static m3ApiRawFunction (rect) {
+    w4_Instance* instance = m3_GetUserData(runtime);
     m3ApiGetArg(int, x);
     m3ApiGetArg(int, y);
     m3ApiGetArg(int, width);
     m3ApiGetArg(int, height);
-    w4_runtimeRect(x, y, width, height);
+    w4_runtimeRect(instance, x, y, width, height);
     m3ApiSuccess();
 }
 
 static m3ApiRawFunction (text) {
+    w4_Instance* instance = m3_GetUserData(runtime);
     m3ApiGetArgMem(const char*, str);
     m3ApiGetArg(int, x);
     m3ApiGetArg(int, y);
-    w4_runtimeText(str, x, y);
+    w4_runtimeText(instance, str, x, y);
     m3ApiSuccess();
 }
 
 static m3ApiRawFunction (textUtf8) {
+    w4_Instance* instance = m3_GetUserData(runtime);
     m3ApiGetArgMem(const uint8_t*, str);
     m3ApiGetArg(int, byteLength);
     m3ApiGetArg(int, x);
     m3ApiGetArg(int, y);
-    w4_runtimeTextUtf8(str, byteLength, x, y);
+    w4_runtimeTextUtf8(instance, str, byteLength, x, y);
     m3ApiSuccess();
 }
 
 static m3ApiRawFunction (textUtf16) {
+    w4_Instance* instance = m3_GetUserData(runtime);
     m3ApiGetArgMem(const uint16_t*, str);
     m3ApiGetArg(int, byteLength);
     m3ApiGetArg(int, x);
     m3ApiGetArg(int, y);
-    w4_runtimeTextUtf16(str, byteLength, x, y);
+    w4_runtimeTextUtf16(instance, str, byteLength, x, y);
     m3ApiSuccess();
 }
 
 static m3ApiRawFunction (tone) {
+    w4_Instance* instance = m3_GetUserData(runtime);
     m3ApiGetArg(int, frequency);
     m3ApiGetArg(int, duration);
     m3ApiGetArg(int, volume);
     m3ApiGetArg(int, flags);
-    w4_runtimeTone(frequency, duration, volume, flags);
+    w4_runtimeTone(instance, frequency, duration, volume, flags);
     m3ApiSuccess();
 }
 
 static m3ApiRawFunction (diskr) {
+    w4_Instance* instance = m3_GetUserData(runtime);
     m3ApiReturnType(int);
     m3ApiGetArgMem(uint8_t*, dest);
     m3ApiGetArg(int, size);
-    m3ApiReturn(w4_runtimeDiskr(dest, size));
+    m3ApiReturn(w4_runtimeDiskr(instance, dest, size));
 }
 
 static m3ApiRawFunction (diskw) {
+    w4_Instance* instance = m3_GetUserData(runtime);
     m3ApiReturnType(int);
     m3ApiGetArgMem(const uint8_t*, src);
     m3ApiGetArg(int, size);
-    m3ApiReturn(w4_runtimeDiskw(src, size));
+    m3ApiReturn(w4_runtimeDiskw(instance, src, size));
 }
 
 static m3ApiRawFunction (trace) {
+    w4_Instance* instance = m3_GetUserData(runtime);
     m3ApiGetArgMem(const char*, str);
-    w4_runtimeTrace(str);
+    w4_runtimeTrace(instance, str);
     m3ApiSuccess();
 }
 
 static m3ApiRawFunction (traceUtf8) {
+    w4_Instance* instance = m3_GetUserData(runtime);
     m3ApiGetArgMem(const uint8_t*, str);
     m3ApiGetArg(int, byteLength);
-    w4_runtimeTraceUtf8(str, byteLength);
+    w4_runtimeTraceUtf8(instance, str, byteLength);
     m3ApiSuccess();
 }
 
 static m3ApiRawFunction (traceUtf16) {
+    w4_Instance* instance = m3_GetUserData(runtime);
     m3ApiGetArgMem(const uint16_t*, str);
     m3ApiGetArg(int, byteLength);
-    w4_runtimeTraceUtf16(str, byteLength);
+    w4_runtimeTraceUtf16(instance, str, byteLength);
     m3ApiSuccess();
 }
 
 static m3ApiRawFunction (tracef) {
+    w4_Instance* instance = m3_GetUserData(runtime);
     m3ApiGetArgMem(const char*, str);
     m3ApiGetArgMem(const void*, stack);
-    w4_runtimeTracef(str, stack);
+    w4_runtimeTracef(instance, str, stack);
     m3ApiSuccess();
 }
 
-static void check (M3Result result) {
+static void check (M3Runtime* runtime, M3Result result) {
     if (result != m3Err_none) {
         M3ErrorInfo info;
         m3_GetErrorInfo(runtime, &info);
@@ -164,8 +186,12 @@ static void check (M3Result result) {
     }
 }
 
-uint8_t* w4_wasmInit () {
-    env = m3_NewEnvironment();
+uint8_t* w4_wasmInit (w4_Instance* instance) {
+    w4_Wasm* wasm = xmalloc(sizeof(w4_Wasm));
+    memset(wasm, 0, sizeof(w4_Wasm));
+    instance->wasm = wasm;
+
+    wasm->env = m3_NewEnvironment();
 
     // This is an arbitrary limit corresponding to the implementation details
     // of the wasm3 interpreter. It's unrelated to the resource constraints of
@@ -176,7 +202,9 @@ uint8_t* w4_wasmInit () {
     // desktop platforms (from wasm3/platforms/app/main.c).
     uint32_t wasm3StackSize = 64 * 1024;
 
-    runtime = m3_NewRuntime(env, wasm3StackSize, NULL);
+    // Host functions find their instance through the runtime's user data
+    M3Runtime* runtime = m3_NewRuntime(wasm->env, wasm3StackSize, instance);
+    wasm->runtime = runtime;
 
     runtime->memory.maxPages = 1;
     runtime->memory.pageSize = wasm3StackSize;
@@ -185,19 +213,26 @@ uint8_t* w4_wasmInit () {
     return m3_GetMemory(runtime, NULL, 0);
 }
 
-void w4_wasmDestroy () {
-    m3_FreeRuntime(runtime);
-    m3_FreeEnvironment(env);
+void w4_wasmDestroy (w4_Instance* instance) {
+    w4_Wasm* wasm = instance->wasm;
+    m3_FreeRuntime(wasm->runtime);
+    m3_FreeEnvironment(wasm->env);
+    free(wasm);
+    instance->wasm = NULL;
 }
 
-void w4_wasmLoadModule (const uint8_t* wasmBuffer, int byteLength) {
-    check(m3_ParseModule(env, &module, wasmBuffer, byteLength));
+void w4_wasmLoadModule (w4_Instance* instance, const uint8_t* wasmBuffer, int byteLength) {
+    w4_Wasm* wasm = instance->wasm;
+    M3Runtime* runtime = wasm->runtime;
+    check(runtime, m3_ParseModule(wasm->env, &wasm->module, wasmBuffer, byteLength));
+
+    M3Module* module = wasm->module;
 
     // wasm3 will reallocate a new memory if the module doesn't import a memory. We set this to
     // prevent that from happening: https://github.com/aduros/wasm4/issues/292
     module->memoryImported = true;
 
-    check(m3_LoadModule(runtime, module));
+    check(runtime, m3_LoadModule(runtime, module));
 
     m3_LinkRawFunction(module, "env", "blit", "v(iiiiii)", blit);
     m3_LinkRawFunction(module, "env", "blitSub", "v(iiiiiiiii)", blitSub);
@@ -228,32 +263,34 @@ void w4_wasmLoadModule (const uint8_t* wasmBuffer, int byteLength) {
     }
 #endif
 
-    m3_FindFunction(&start, runtime, "start");
-    m3_FindFunction(&update, runtime, "update");
+    m3_FindFunction(&wasm->start, runtime, "start");
+    m3_FindFunction(&wasm->update, runtime, "update");
 
     // First call wasm built-in start
-    check(m3_RunStart(module));
+    check(runtime, m3_RunStart(module));
 
     // Call WASI start functions
     M3Function* func;
     m3_FindFunction(&func, runtime, "_start");
     if (func) {
-        check(m3_CallV(func));
+        check(runtime, m3_CallV(func));
     }
     m3_FindFunction(&func, runtime, "_initialize");
     if (func) {
-        check(m3_CallV(func));
+        check(runtime, m3_CallV(func));
     }
 }
 
-void w4_wasmCallStart () {
-    if (start) {
-        check(m3_CallV(start));
+void w4_wasmCallStart (w4_Instance* instance) {
+    w4_Wasm* wasm = instance->wasm;
+    if (wasm->start) {
+        check(wasm->runtime, m3_CallV(wasm->start));
     }
 }
 
-void w4_wasmCallUpdate () {
-    if (update) {
-        check(m3_CallV(update));
+void w4_wasmCallUpdate (w4_Instance* instance) {
+    w4_Wasm* wasm = instance->wasm;
+    if (wasm->update) {
+        check(wasm->runtime, m3_CallV(wasm->update));
     }
 }
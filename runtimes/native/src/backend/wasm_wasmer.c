@@ -3,37 +3,42 @@
 #include <string.h>
 #include <wasm.h>
 
+#include "../instance.h"
+#include "../util.h"
 #include "../wasm.h"
-#include "../runtime.h"
 
-static wasm_engine_t* engine;
-static wasm_store_t* store;
-static wasm_memory_t* memory;
-static wasm_module_t* module;
-static wasm_instance_t* instance;
+struct w4_Wasm {
+    wasm_engine_t* engine;
+    wasm_store_t* store;
+    wasm_memory_t* memory;
+    wasm_module_t* module;
+    wasm_instance_t* wasmInstance;
 
-static wasm_func_t* start = NULL;
-static wasm_func_t* update = NULL;
+    wasm_func_t* start;
+    wasm_func_t* update;
+};
 
-static void* getMemoryPointer (wasm_val_t* val) {
-    byte_t* data = wasm_memory_data(memory);
+static void* getMemoryPointer (w4_Instance* instance, wasm_val_t* val) {
+    byte_t* data = wasm_memory_data(instance->wasm->memory);
     int32_t offset = val->of.i32;
     return (offset < 0 || offset >= (1 << 16)) ? NULL : (void*)(data + offset);
 }
 
-static wasm_trap_t* blit (const wasm_val_vec_t* args, wasm_val_vec_t* results) {
-    const uint8_t* sprite = getMemoryPointer(&args->data[0]);
+static wasm_trap_t* blit (void* env, const wasm_val_vec_t* args, wasm_val_vec_t* results) {
+    w4_Instance* instance = env;
+    const uint8_t* sprite = getMemoryPointer(instance, &args->data[0]);
     int32_t x = args->data[1].of.i32;
     int32_t y = args->data[2].of.i32;
     int32_t width = args->data[3].of.i32;
     int32_t height = args->data[4].of.i32;
     int32_t flags = args->data[5].of.i32;
-    w4_runtimeBlit(sprite, x, y, width, height, flags);
+    w4_runtimeBlit(instance, sprite, x, y, width, height, flags);
     return NULL;
 }
 
-static wasm_trap_t* blitSub (const wasm_val_vec_t* args, wasm_val_vec_t* results) {
-    const uint8_t* sprite = getMemoryPointer(&args->data[0]);
+static wasm_trap_t* blitSub (void* env, const wasm_val_vec_t* args, wasm_val_vec_t* results) {
+    w4_Instance* instance = env;
+    const uint8_t* sprite = getMemoryPointer(instance, &args->data[0]);
     int32_t x = args->data[1].of.i32;
     int32_t y = args->data[2].of.i32;
     int32_t width = args->data[3].of.i32;
@@ -42,151 +47,173 @@ static wasm_trap_t* blitSub (const wasm_val_vec_t* args, wasm_val_vec_t* results
     int32_t srcY = args->data[6].of.i32;
     int32_t stride = args->data[7].of.i32;
     int32_t flags = args->data[8].of.i32;
-    w4_runtimeBlitSub(sprite, x, y, width, height, srcX, srcY, stride, flags);
+    w4_runtimeBlitSub(instance, sprite, x, y, width, height, srcX, srcY, stride, flags);
     return NULL;
 }
 
-static wasm_trap_t* line (const wasm_val_vec_t* args, wasm_val_vec_t* results) {
+static wasm_trap_t* line (void* env, const wasm_val_vec_t* args, wasm_val_vec_t* results) {
+    w4_Instance* instance = env;
     int32_t x1 = args->data[0].of.i32;
     int32_t y1 = args->data[1].of.i32;
     int32_t x2 = args->data[2].of.i32;
     int32_t y2 = args->data[3].of.i32;
-    w4_runtimeLine(x1, y1, x2, y2);
+    w4_runtimeLine(instance, x1, y1, x2, y2);
     return NULL;
 }
 
-static wasm_trap_t* hline (const wasm_val_vec_t* args, wasm_val_vec_t* results) {
+static wasm_trap_t* hline (void* env, const wasm_val_vec_t* args, wasm_val_vec_t* results) {
+    w4_Instance* instance = env;
     int32_t x = args->data[0].of.i32;
     int32_t y = args->data[1].of.i32;
     int32_t len = args->data[2].of.i32;
-    w4_runtimeHLine(x, y, len);
+    w4_runtimeHLine(instance, x, y, len);
     return NULL;
 }
 
-static wasm_trap_t* vline (const wasm_val_vec_t* args, wasm_val_vec_t* results) {
+static wasm_trap_t* vline (void* env, const wasm_val_vec_t* args, wasm_val_vec_t* results) {
+    w4_Instance* instance = env;
     int32_t x = args->data[0].of.i32;
     int32_t y = args->data[1].of.i32;
     int32_t len = args->data[2].of.i32;
-    w4_runtimeVLine(x, y, len);
+    w4_runtimeVLine(instance, x, y, len);
     return NULL;
 }
 
-static wasm_trap_t* oval (const wasm_val_vec_t* args, wasm_val_vec_t* results) {
+static wasm_trap_t* oval (void* env, const wasm_val_vec_t* args, wasm_val_vec_t* results) {
+    w4_Instance* instance = env;
     int32_t x = args->data[0].of.i32;
     int32_t y = args->data[1].of.i32;
     int32_t width = args->data[2].of.i32;
     int32_t height = args->data[3].of.i32;
-    w4_runtimeOval(x, y, width, height);
+    w4_runtimeOval(instance, x, y, width, height);
     return NULL;
 }
 
-static wasm_trap_t* rect (const wasm_val_vec_t* args, wasm_val_vec_t* results) {
+static wasm_trap_t* rect (void* env, const wasm_val_vec_t* args, wasm_val_vec_t* results) {
+    w4_Instance* instance = env;
     int32_t x = args->data[0].of.i32;
     int32_t y = args->data[1].of.i32;
     int32_t width = args->data[2].of.i32;
     int32_t height = args->data[3].of.i32;
-    w4_runtimeRect(x, y, width, height);
+    w4_runtimeRect(instance, x, y, width, height);
     return NULL;
 }
 
-static wasm_trap_t* text (const wasm_val_vec_t* args, wasm_val_vec_t* results) {
-    const char* str = getMemoryPointer(&args->data[0]);
+static wasm_trap_t* text (void* env, const wasm_val_vec_t* args, wasm_val_vec_t* results) {
+    w4_Instance* instance = env;
+    const char* str = getMemoryPointer(instance, &args->data[0]);
     int32_t x = args->data[1].of.i32;
     int32_t y = args->data[2].of.i32;
-    w4_runtimeText(str, x, y);
+    w4_runtimeText(instance, str, x, y);
     return NULL;
 }
 
-static wasm_trap_t* textUtf8 (const wasm_val_vec_t* args, wasm_val_vec_t* results) {
-    const uint8_t* str = getMemoryPointer(&args->data[0]);
+static wasm_trap_t* textUtf8 (void* env, const wasm_val_vec_t* args, wasm_val_vec_t* results) {
+    w4_Instance* instance = env;
+    const uint8_t* str = getMemoryPointer(instance, &args->data[0]);
     int32_t byteLength = args->data[1].of.i32;
     int32_t x = args->data[2].of.i32;
     int32_t y = args->data[3].of.i32;
-    w4_runtimeTextUtf8(str, byteLength, x, y);
+    w4_runtimeTextUtf8(instance, str, byteLength, x, y);
     return NULL;
 }
 
-static wasm_trap_t* textUtf16 (const wasm_val_vec_t* args, wasm_val_vec_t* results) {
-    const uint16_t* str = getMemoryPointer(&args->data[0]);
+static wasm_trap_t* textUtf16 (void* env, const wasm_val_vec_t* args, wasm_val_vec_t* results) {
+    w4_Instance* instance = env;
+    const uint16_t* str = getMemoryPointer(instance, &args->data[0]);
     int32_t byteLength = args->data[1].of.i32;
     int32_t x = args->data[2].of.i32;
     int32_t y = args->data[3].of.i32;
-    w4_runtimeTextUtf16(str, byteLength, x, y);
+    w4_runtimeTextUtf16(instance, str, byteLength, x, y);
     return NULL;
 }
 
-static wasm_trap_t* tone (const wasm_val_vec_t* args, wasm_val_vec_t* results) {
+static wasm_trap_t* tone (void* env, const wasm_val_vec_t* args, wasm_val_vec_t* results) {
+    w4_Instance* instance = env;
     int32_t frequency = args->data[0].of.i32;
     int32_t duration = args->data[1].of.i32;
     int32_t volume = args->data[2].of.i32;
     int32_t flags = args->data[3].of.i32;
-    w4_runtimeTone(frequency, duration, volume, flags);
+    w4_runtimeTone(instance, frequency, duration, volume, flags);
     return NULL;
 }
 
-static wasm_trap_t* diskr (const wasm_val_vec_t* args, wasm_val_vec_t* results) {
-    uint8_t* dest = getMemoryPointer(&args->data[0]);
+static wasm_trap_t* diskr (void* env, const wasm_val_vec_t* args, wasm_val_vec_t* results) {
+    w4_Instance* instance = env;
+    uint8_t* dest = getMemoryPointer(instance, &args->data[0]);
     int32_t size = args->data[1].of.i32;
     wasm_val_t* result = &results->data[0];
     result->kind = WASM_I32;
-    result->of.i32 = w4_runtimeDiskr(dest, size);
+    result->of.i32 = w4_runtimeDiskr(instance, dest, size);
     return NULL;
 }
 
-static wasm_trap_t* diskw (const wasm_val_vec_t* args, wasm_val_vec_t* results) {
-    const uint8_t* src = getMemoryPointer(&args->data[0]);
+static wasm_trap_t* diskw (void* env, const wasm_val_vec_t* args, wasm_val_vec_t* results) {
+    w4_Instance* instance = env;
+    const uint8_t* src = getMemoryPointer(instance, &args->data[0]);
     int32_t size = args->data[1].of.i32;
     wasm_val_t* result = &results->data[0];
     result->kind = WASM_I32;
-    result->of.i32 = w4_runtimeDiskw(src, size);
+    result->of.i32 = w4_runtimeDiskw(instance, src, size);
     return NULL;
 }
 
-static wasm_trap_t* trace (const wasm_val_vec_t* args, wasm_val_vec_t* results) {
-    const char* str = getMemoryPointer(&args->data[0]);
-    w4_runtimeTrace(str);
+static wasm_trap_t* trace (void* env, const wasm_val_vec_t* args, wasm_val_vec_t* results) {
+    w4_Instance* instance = env;
+    const char* str = getMemoryPointer(instance, &args->data[0]);
+    w4_runtimeTrace(instance, str);
     return NULL;
 }
 
-static wasm_trap_t* traceUtf8 (const wasm_val_vec_t* args, wasm_val_vec_t* results) {
-    const uint8_t* str = getMemoryPointer(&args->data[0]);
+static wasm_trap_t* traceUtf8 (void* env, const wasm_val_vec_t* args, wasm_val_vec_t* results) {
+    w4_Instance* instance = env;
+    const uint8_t* str = getMemoryPointer(instance, &args->data[0]);
     int32_t byteLength = args->data[1].of.i32;
-    w4_runtimeTraceUtf8(str, byteLength);
+    w4_runtimeTraceUtf8(instance, str, byteLength);
     return NULL;
 }
 
-static wasm_trap_t* traceUtf16 (const wasm_val_vec_t* args, wasm_val_vec_t* results) {
-    const uint16_t* str = getMemoryPointer(&args->data[0]);
+static wasm_trap_t* traceUtf16 (void* env, const wasm_val_vec_t* args, wasm_val_vec_t* results) {
+    w4_Instance* instance = env;
+    const uint16_t* str = getMemoryPointer(instance, &args->data[0]);
     int32_t byteLength = args->data[1].of.i32;
-    w4_runtimeTraceUtf16(str, byteLength);
+    w4_runtimeTraceUtf16(instance, str, byteLength);
     return NULL;
 }
 
-static wasm_trap_t* tracef (const wasm_val_vec_t* args, wasm_val_vec_t* results) {
-    const char* str = getMemoryPointer(&args->data[0]);
-    const void* stack = getMemoryPointer(&args->data[1]);
-    w4_runtimeTracef(str, stack);
+static wasm_trap_t* tracef (void* env, const wasm_val_vec_t* args, wasm_val_vec_t* results) {
+    w4_Instance* instance = env;
+    const char* str = getMemoryPointer(instance, &args->data[0]);
+    const void* stack = getMemoryPointer(instance, &args->data[1]);
+    w4_runtimeTracef(instance, str, stack);
     return NULL;
 }
 
-uint8_t* w4_wasmInit () {
-    engine = wasm_engine_new();
-    store = wasm_store_new(engine);
+uint8_t* w4_wasmInit (w4_Instance* instance) {
+    w4_Wasm* wasm = xmalloc(sizeof(w4_Wasm));
+    memset(wasm, 0, sizeof(w4_Wasm));
+    instance->wasm = wasm;
+
+    wasm->engine = wasm_engine_new();
+    wasm->store = wasm_store_new(wasm->engine);
 
     wasm_limits_t limits = { .max = 1, .min = 1 };
     wasm_memorytype_t* memorytype = wasm_memorytype_new(&limits);
-    memory = wasm_memory_new(store, memorytype);
+    wasm->memory = wasm_memory_new(wasm->store, memorytype);
 
-    byte_t* data = wasm_memory_data(memory);
+    byte_t* data = wasm_memory_data(wasm->memory);
     memset(data, 0, 1 << 16);
     return (uint8_t*)data;
 }
 
-void w4_wasmDestroy () {
-    wasm_instance_delete(instance);
-    wasm_module_delete(module);
-    wasm_store_delete(store);
-    wasm_engine_delete(engine);
+void w4_wasmDestroy (w4_Instance* instance) {
+    w4_Wasm* wasm = instance->wasm;
+    wasm_instance_delete(wasm->wasmInstance);
+    wasm_module_delete(wasm->module);
+    wasm_store_delete(wasm->store);
+    wasm_engine_delete(wasm->engine);
+    free(wasm);
+    instance->wasm = NULL;
 }
 
 static wasm_functype_t* createFuncType (int params, int results) {
@@ -207,7 +234,7 @@ static wasm_functype_t* createFuncType (int params, int results) {
     return wasm_functype_new(&pv, &rv);
 }
 
-void check (wasm_trap_t* trap) {
+static void check (wasm_trap_t* trap) {
     if (trap) {
         wasm_message_t message;
         wasm_trap_message(trap, &message);
@@ -216,10 +243,14 @@ void check (wasm_trap_t* trap) {
     }
 }
 
-void w4_wasmLoadModule (const uint8_t* wasmBuffer, int byteLength) {
+void w4_wasmLoadModule (w4_Instance* instance, const uint8_t* wasmBuffer, int byteLength) {
+    w4_Wasm* wasm = instance->wasm;
+    wasm_store_t* store = wasm->store;
+
     wasm_byte_vec_t bytes;
     wasm_byte_vec_new(&bytes, byteLength, (const char*)wasmBuffer);
-    module = wasm_module_new(store, &bytes);
+    wasm_module_t* module = wasm_module_new(store, &bytes);
+    wasm->module = module;
     wasm_byte_vec_delete(&bytes);
 
     if (!module) {
@@ -316,13 +347,14 @@ void w4_wasmLoadModule (const uint8_t* wasmBuffer, int byteLength) {
                     callback = trace;
                 }
 
-                wasm_func_t* func = wasm_func_new(store, functype, callback);
+                // Host functions receive their instance as the env pointer
+                wasm_func_t* func = wasm_func_new_with_env(store, functype, callback, instance, NULL);
                 // wasm_functype_delete(functype);
                 externs[ii] = wasm_func_as_extern(func);
 
             } else if (externkind == WASM_EXTERN_MEMORY) {
                 if (strcmp(name->data, "memory") == 0) {
-                    externs[ii] = wasm_memory_as_extern(memory);
+                    externs[ii] = wasm_memory_as_extern(wasm->memory);
                 }
             }
         }
@@ -330,9 +362,9 @@ void w4_wasmLoadModule (const uint8_t* wasmBuffer, int byteLength) {
 
     wasm_extern_vec_t extern_vec;
     wasm_extern_vec_new(&extern_vec, imports.size, externs);
-    instance = wasm_instance_new(store, module, &extern_vec, NULL);
+    wasm->wasmInstance = wasm_instance_new(store, module, &extern_vec, NULL);
 
-    if (!instance) {
+    if (!wasm->wasmInstance) {
         fprintf(stderr, "Error instantiating module");
         exit(1);
     }
@@ -340,7 +372,7 @@ void w4_wasmLoadModule (const uint8_t* wasmBuffer, int byteLength) {
     wasm_exporttype_vec_t exports;
     wasm_module_exports(module, &exports);
 
-    wasm_instance_exports(instance, &extern_vec);
+    wasm_instance_exports(wasm->wasmInstance, &extern_vec);
 
     wasm_func_t* _start = NULL;
     wasm_func_t* _initialize = NULL;
@@ -357,13 +389,13 @@ void w4_wasmLoadModule (const uint8_t* wasmBuffer, int byteLength) {
         if (externkind == WASM_EXTERN_FUNC) {
             wasm_func_t* func = wasm_extern_as_func(extern_vec.data[ii]);
             if (strcmp(name->data, "start") == 0) {
-                start = func;
+                wasm->start = func;
             } else if (strcmp(name->data, "_start") == 0) {
                 _start = func;
             } else if (strcmp(name->data, "_initialize") == 0) {
                 _initialize = func;
             } else if (strcmp(name->data, "update") == 0) {
-                update = func;
+                wasm->update = func;
             }
         }
     }
@@ -383,18 +415,20 @@ void w4_wasmLoadModule (const uint8_t* wasmBuffer, int byteLength) {
     }
 }
 
-void w4_wasmCallStart () {
-    if (start) {
+void w4_wasmCallStart (w4_Instance* instance) {
+    w4_Wasm* wasm = instance->wasm;
+    if (wasm->start) {
         wasm_val_vec_t args = WASM_EMPTY_VEC;
         wasm_val_vec_t results = WASM_EMPTY_VEC;
-        check(wasm_func_call(start, &args, &results));
+        check(wasm_func_call(wasm->start, &args, &results));
     }
 }
 
-void w4_wasmCallUpdate () {
-    if (update) {
+void w4_wasmCallUpdate (w4_Instance* instance) {
+    w4_Wasm* wasm = instance->wasm;
+    if (wasm->update) {
         wasm_val_vec_t args = WASM_EMPTY_VEC;
         wasm_val_vec_t results = WASM_EMPTY_VEC;
-        check(wasm_func_call(update, &args, &results));
+        check(wasm_func_call(wasm->update, &args, &results));
     }
 }
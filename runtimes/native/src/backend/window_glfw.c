@@ -7,7 +7,11 @@
 #include <stdlib.h>
 
 #include "../window.h"
+#include "../movie.h"
+#include "../rewind.h"
 #include "../runtime.h"
+#include "../trace.h"
+#include "netplay.h"
 
 static uint32_t table[256];
 static GLuint paletteLocation;
@@ -159,7 +163,8 @@ static void onGlfwError(int error, const char* description)
     fprintf(stderr,"%s\n",description);
 }
 
-static void update (GLFWwindow* window) {
+static void update (w4_Instance* instance, w4_Rewind* rewind, w4_Netplay* netplay, w4_Movie* movie,
+        GLFWwindow* window) {
     // Keyboard handling
     uint8_t gamepad = 0;
     if (glfwGetKey(window, GLFW_KEY_X)) {
@@ -180,12 +185,21 @@ static void update (GLFWwindow* window) {
     if (glfwGetKey(window, GLFW_KEY_DOWN)) {
         gamepad |= W4_BUTTON_DOWN;
     }
-    w4_runtimeSetGamepad(0, gamepad);
 
     if (glfwGetKey(window, GLFW_KEY_ESCAPE)) {
         should_close = true;
     }
 
+    if (netplay) {
+        // Only the local player's gamepad is sent, the other inputs come from the network
+        if (!w4_netplayUpdate(netplay, gamepad)) {
+            // Waiting on the other player, show the last frame again
+            w4_runtimeComposite(instance);
+        }
+        return;
+    }
+    w4_runtimeSetGamepad(instance, 0, gamepad);
+
     // Mouse handling
     double mouseX, mouseY;
     uint8_t mouseButtons = 0;
@@ -199,12 +213,25 @@ static void update (GLFWwindow* window) {
     if (glfwGetMouseButton(window, GLFW_MOUSE_BUTTON_MIDDLE)) {
         mouseButtons |= W4_MOUSE_MIDDLE;
     }
-    w4_runtimeSetMouse(160*(mouseX-contentX)/contentSizeX, 160*(mouseY-contentY)/contentSizeY, mouseButtons);
+    w4_runtimeSetMouse(instance, 160*(mouseX-contentX)/contentSizeX, 160*(mouseY-contentY)/contentSizeY, mouseButtons);
+
+    // The movie's input replaces ours until it runs out
+    if (movie && !w4_moviePlay(movie, instance)) {
+        w4_movieRecord(movie, instance);
+    }
 
-    w4_runtimeUpdate();
+    // Hold backspace to step backwards through the rewind history
+    if (rewind && glfwGetKey(window, GLFW_KEY_BACKSPACE) && w4_rewindRestore(rewind, instance)) {
+        w4_runtimeComposite(instance);
+    } else {
+        w4_runtimeUpdate(instance);
+        if (rewind) {
+            w4_rewindCapture(rewind, instance);
+        }
+    }
 }
 
-void w4_windowBoot (const char* title) {
+void w4_windowBoot (w4_Instance* instance, const char* title, w4_Netplay* netplay, w4_Movie* movie) {
     if(!glfwInit()){
         fprintf(stderr,"Failed to initialise GLFW.");
         return;
@@ -225,6 +252,10 @@ void w4_windowBoot (const char* title) {
     initOpenGL();
     initLookupTable();
 
+    // Rewinding would desync netplay, or the movie from its input
+    w4_Rewind* rewind = netplay || movie ? NULL
+        : w4_rewindCreate(W4_REWIND_DEFAULT_BUDGET, W4_REWIND_DEFAULT_KEYFRAME_INTERVAL);
+
     while (!glfwWindowShouldClose(window) && !should_close) {
         double timeStart = glfwGetTime();
         double timeEnd = timeStart + 1.0/60.0;
@@ -241,14 +272,22 @@ void w4_windowBoot (const char* title) {
 #endif
         }
 
-        update(window);
+        update(instance, rewind, netplay, movie, window);
+        W4_TRACE_BEGIN(presentStart);
         glfwSwapBuffers(window);
         glfwPollEvents();
+        W4_TRACE_END(instance, presentStart, "present");
 
+        W4_TRACE_BEGIN(waitStart);
         double timeRemaining;
         while ((timeRemaining = timeEnd - glfwGetTime()) > 0) {
             glfwWaitEventsTimeout(timeRemaining);
         }
+        W4_TRACE_END(instance, waitStart, "wait");
+    }
+
+    if (rewind) {
+        w4_rewindDestroy(rewind);
     }
 
     glfwDestroyWindow(window);
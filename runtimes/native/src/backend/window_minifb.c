@@ -1,8 +1,13 @@
 #include <MiniFB.h>
+#include <stdbool.h>
 #include <stdio.h>
 
 #include "../window.h"
+#include "../movie.h"
+#include "../rewind.h"
 #include "../runtime.h"
+#include "../trace.h"
+#include "netplay.h"
 
 static uint32_t pixels[160*160];
 
@@ -18,11 +23,15 @@ static void onResize (struct mfb_window* window, int width, int height) {
     mfb_set_viewport(window, viewportX, viewportY, viewportSize, viewportSize);
 }
 
-void w4_windowBoot (const char* title) {
+void w4_windowBoot (w4_Instance* instance, const char* title, w4_Netplay* netplay, w4_Movie* movie) {
     struct mfb_window* window = mfb_open_ex(title, viewportSize, viewportSize, WF_RESIZABLE);
 
     mfb_set_resize_callback(window, onResize);
 
+    // Rewinding would desync netplay, or the movie from its input
+    w4_Rewind* rewind = netplay || movie ? NULL
+        : w4_rewindCreate(W4_REWIND_DEFAULT_BUDGET, W4_REWIND_DEFAULT_KEYFRAME_INTERVAL);
+
     do {
         // Keyboard handling
         const uint8_t* keyBuffer = mfb_get_key_buffer(window);
@@ -47,7 +56,16 @@ void w4_windowBoot (const char* title) {
         if (keyBuffer[KB_KEY_DOWN]) {
             gamepad |= W4_BUTTON_DOWN;
         }
-        w4_runtimeSetGamepad(0, gamepad);
+
+        if (netplay) {
+            // Only the local player's gamepad is sent, the other inputs come from the network
+            if (!w4_netplayUpdate(netplay, gamepad)) {
+                // Waiting on the other player, show the last frame again
+                w4_runtimeComposite(instance);
+            }
+            goto present;
+        }
+        w4_runtimeSetGamepad(instance, 0, gamepad);
 
         // Player 2
         gamepad = 0;
@@ -69,7 +87,7 @@ void w4_windowBoot (const char* title) {
         if (keyBuffer[KB_KEY_D]) {
             gamepad |= W4_BUTTON_DOWN;
         }
-        w4_runtimeSetGamepad(1, gamepad);
+        w4_runtimeSetGamepad(instance, 1, gamepad);
 
         // Mouse handling
         uint8_t mouseButtons = 0;
@@ -85,14 +103,42 @@ void w4_windowBoot (const char* title) {
         }
         int mouseX = mfb_get_mouse_x(window);
         int mouseY = mfb_get_mouse_y(window);
-        w4_runtimeSetMouse(160*(mouseX-viewportX)/viewportSize, 160*(mouseY-viewportY)/viewportSize, mouseButtons);
+        w4_runtimeSetMouse(instance, 160*(mouseX-viewportX)/viewportSize, 160*(mouseY-viewportY)/viewportSize, mouseButtons);
 
-        w4_runtimeUpdate();
+        // The movie's input replaces ours until it runs out
+        if (movie && !w4_moviePlay(movie, instance)) {
+            w4_movieRecord(movie, instance);
+        }
+
+        // Hold backspace to step backwards through the rewind history
+        if (rewind && keyBuffer[KB_KEY_BACKSPACE] && w4_rewindRestore(rewind, instance)) {
+            w4_runtimeComposite(instance);
+        } else {
+            w4_runtimeUpdate(instance);
+            if (rewind) {
+                w4_rewindCapture(rewind, instance);
+            }
+        }
 
+present:
+        ;
+        W4_TRACE_BEGIN(presentStart);
         if (mfb_update_ex(window, pixels, 160, 160) < 0) {
             break;
         }
-    } while (mfb_wait_sync(window));
+        W4_TRACE_END(instance, presentStart, "present");
+
+        W4_TRACE_BEGIN(waitStart);
+        bool open = mfb_wait_sync(window);
+        W4_TRACE_END(instance, waitStart, "wait");
+        if (!open) {
+            break;
+        }
+    } while (true);
+
+    if (rewind) {
+        w4_rewindDestroy(rewind);
+    }
 }
 
 void w4_windowComposite (const uint32_t* palette, const uint8_t* framebuffer) {
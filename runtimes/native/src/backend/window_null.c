@@ -0,0 +1,19 @@
+#include "../window.h"
+#include "../movie.h"
+#include "../runtime.h"
+
+// A window backend that displays nothing, for running carts without a display.
+
+void w4_windowBoot (w4_Instance* instance, const char* title, struct w4_Netplay* netplay,
+        struct w4_Movie* movie) {
+    // No vsync to wait for, run frames as fast as possible
+    for (;;) {
+        if (movie) {
+            w4_moviePlay(movie, instance);
+        }
+        w4_runtimeUpdate(instance);
+    }
+}
+
+void w4_windowComposite (const uint32_t* palette, const uint8_t* framebuffer) {
+}
@@ -0,0 +1,51 @@
+#include "dirty.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "util.h"
+
+struct w4_Dirty {
+    /** The memory as of the last scan. */
+    uint8_t shadow[1 << 16];
+
+    /** The version at which each block last changed. */
+    uint32_t versions[W4_DIRTY_BLOCK_COUNT];
+
+    uint32_t version;
+};
+
+w4_Dirty* w4_dirtyCreate (const uint8_t* memory) {
+    w4_Dirty* dirty = xmalloc(sizeof(w4_Dirty));
+    memcpy(dirty->shadow, memory, sizeof(dirty->shadow));
+    for (int n = 0; n < W4_DIRTY_BLOCK_COUNT; ++n) {
+        dirty->versions[n] = 1;
+    }
+    dirty->version = 1;
+    return dirty;
+}
+
+void w4_dirtyDestroy (w4_Dirty* dirty) {
+    free(dirty);
+}
+
+uint32_t w4_dirtyScan (w4_Dirty* dirty, const uint8_t* memory) {
+    // Changes get a new version, so that they're newer than any snapshot taken so far
+    bool changed = false;
+    for (int n = 0; n < W4_DIRTY_BLOCK_COUNT; ++n) {
+        size_t offset = (size_t)n * W4_DIRTY_BLOCK_SIZE;
+        if (memcmp(&dirty->shadow[offset], &memory[offset], W4_DIRTY_BLOCK_SIZE) != 0) {
+            if (!changed) {
+                ++dirty->version;
+                changed = true;
+            }
+            memcpy(&dirty->shadow[offset], &memory[offset], W4_DIRTY_BLOCK_SIZE);
+            dirty->versions[n] = dirty->version;
+        }
+    }
+    return dirty->version;
+}
+
+bool w4_dirtyChangedSince (const w4_Dirty* dirty, int block, uint32_t version) {
+    return dirty->versions[block] > version;
+}
@@ -0,0 +1,27 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// Tracks which blocks of the 64 KB cart memory changed, for incremental save states.
+//
+// Wasm stores go straight to memory without passing through the host, so changes are found by
+// comparing each block against a shadow copy. Every pass that finds a change bumps a version
+// number, and the changed blocks are stamped with it. A snapshot taken at some version only needs
+// the blocks with a newer stamp to be brought up to date. Writes made outside of wasm, like
+// restoring a save state, are picked up by the next scan the same way.
+
+#define W4_DIRTY_BLOCK_SIZE 256
+#define W4_DIRTY_BLOCK_COUNT ((1 << 16) / W4_DIRTY_BLOCK_SIZE)
+
+typedef struct w4_Dirty w4_Dirty;
+
+/** Starts tracking the given memory, with every block stamped with version 1. */
+w4_Dirty* w4_dirtyCreate (const uint8_t* memory);
+void w4_dirtyDestroy (w4_Dirty* dirty);
+
+/** Finds the blocks that changed since the last scan, and returns the current version. */
+uint32_t w4_dirtyScan (w4_Dirty* dirty, const uint8_t* memory);
+
+/** Whether a block changed after the given version, as of the last scan. */
+bool w4_dirtyChangedSince (const w4_Dirty* dirty, int block, uint32_t version);
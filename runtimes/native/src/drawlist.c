@@ -0,0 +1,456 @@
+#include "drawlist.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "framebuffer.h"
+#include "util.h"
+
+#define ARENA_SIZE (64*1024)
+#define MAX_COMMANDS (ARENA_SIZE / sizeof(Command))
+#define MAX_OCCLUDERS 8
+
+enum {
+    COMMAND_RECT,
+    COMMAND_OVAL,
+    COMMAND_LINE,
+    COMMAND_HLINE,
+    COMMAND_VLINE,
+    COMMAND_TEXT_UTF8,
+    COMMAND_TEXT_UTF16,
+    COMMAND_BLIT,
+};
+
+typedef struct {
+    uint8_t type;
+    uint8_t drawColors[2];
+
+    /** Set during flush for commands that won't be visible. */
+    bool skip;
+
+    /** Size of this command including its trailing data, rounded up to keep alignment. */
+    uint32_t size;
+
+    /** Command arguments: x, y, width, height or x1, y1, x2, y2. */
+    int32_t args[4];
+} Command;
+
+typedef struct {
+    Command command;
+    int32_t srcX;
+    int32_t stride;
+    int32_t flags;
+    int32_t byteLength;
+    // Followed by byteLength bytes of sprite data
+} BlitCommand;
+
+typedef struct {
+    Command command;
+    int32_t byteLength;
+    // Followed by byteLength bytes of string data
+} TextCommand;
+
+typedef struct {
+    int x1, y1, x2, y2;
+} Box;
+
+struct w4_DrawList {
+    w4_Framebuffer* fb;
+    const uint8_t* drawColors;
+
+    union {
+        Command align;
+        uint8_t bytes[ARENA_SIZE];
+    } arena;
+    uint32_t arenaUsed;
+
+    /** The most recently recorded command, used for merging. */
+    Command* lastCommand;
+
+    /** Scratch space for flushing. */
+    Command* commands[MAX_COMMANDS];
+};
+
+static int w4_min (int a, int b) {
+    return a < b ? a : b;
+}
+
+static int w4_max (int a, int b) {
+    return a > b ? a : b;
+}
+
+// Returns whether a span can be stored as an int32 start and length without the framebuffer's
+// start + length overflowing.
+static bool spanFits (int64_t start, int64_t end) {
+    return end <= INT32_MAX && end - start <= INT32_MAX;
+}
+
+// Reserves space for a command, flushing the list if it's full. Returns NULL if the command
+// can't fit even in an empty list.
+static Command* allocCommand (w4_DrawList* list, int type, uint32_t size) {
+    size = (size + sizeof(Command) - 1) / sizeof(Command) * sizeof(Command);
+    if (size > ARENA_SIZE) {
+        return NULL;
+    }
+    if (list->arenaUsed + size > ARENA_SIZE) {
+        w4_drawListFlush(list);
+    }
+
+    Command* command = (Command*)(list->arena.bytes + list->arenaUsed);
+    list->arenaUsed += size;
+    command->type = type;
+    command->drawColors[0] = list->drawColors[0];
+    command->drawColors[1] = list->drawColors[1];
+    command->skip = false;
+    command->size = size;
+    list->lastCommand = command;
+    return command;
+}
+
+static void recordCommand (w4_DrawList* list, int type, int a0, int a1, int a2, int a3) {
+    Command* command = allocCommand(list, type, sizeof(Command));
+    command->args[0] = a0;
+    command->args[1] = a1;
+    command->args[2] = a2;
+    command->args[3] = a3;
+}
+
+// Returns the previous command if it's of the given type and uses the same draw colors.
+static Command* mergeableCommand (w4_DrawList* list, int type) {
+    Command* last = list->lastCommand;
+    if (last && last->type == type
+            && last->drawColors[0] == list->drawColors[0]
+            && last->drawColors[1] == list->drawColors[1]) {
+        return last;
+    }
+    return NULL;
+}
+
+w4_DrawList* w4_drawListCreate (w4_Framebuffer* fb, const uint8_t* drawColors) {
+    w4_DrawList* list = xmalloc(sizeof(w4_DrawList));
+    list->fb = fb;
+    list->drawColors = drawColors;
+    list->arenaUsed = 0;
+    list->lastCommand = NULL;
+    return list;
+}
+
+void w4_drawListDestroy (w4_DrawList* list) {
+    free(list);
+}
+
+void w4_drawListRect (w4_DrawList* list, int x, int y, int width, int height) {
+    // A rect drawn in one color throughout can be merged with a neighbor that exactly shares
+    // one of its sides
+    uint8_t dc0 = list->drawColors[0] & 0xf;
+    uint8_t dc1 = (list->drawColors[0] >> 4) & 0xf;
+    bool solid = dc0 != 0 && (dc1 == 0 || ((dc1 - 1) & 0x3) == ((dc0 - 1) & 0x3));
+    Command* prev = mergeableCommand(list, COMMAND_RECT);
+    if (prev && solid && width > 0 && height > 0 && prev->args[2] > 0 && prev->args[3] > 0) {
+        int32_t* args = prev->args;
+        int64_t endX = (int64_t)x + width, endY = (int64_t)y + height;
+        if (args[0] == x && args[2] == width && (int64_t)args[1] + args[3] == y
+                && spanFits(args[1], endY)) {
+            args[3] = endY - args[1];
+            return;
+        }
+        if (args[1] == y && args[3] == height && (int64_t)args[0] + args[2] == x
+                && spanFits(args[0], endX)) {
+            args[2] = endX - args[0];
+            return;
+        }
+    }
+    recordCommand(list, COMMAND_RECT, x, y, width, height);
+}
+
+void w4_drawListOval (w4_DrawList* list, int x, int y, int width, int height) {
+    recordCommand(list, COMMAND_OVAL, x, y, width, height);
+}
+
+void w4_drawListLine (w4_DrawList* list, int x1, int y1, int x2, int y2) {
+    recordCommand(list, COMMAND_LINE, x1, y1, x2, y2);
+}
+
+void w4_drawListHLine (w4_DrawList* list, int x, int y, int len) {
+    Command* prev = mergeableCommand(list, COMMAND_HLINE);
+    if (prev && len > 0 && prev->args[1] == y && prev->args[2] > 0) {
+        int32_t* args = prev->args;
+        int64_t prevEnd = (int64_t)args[0] + args[2], end = (int64_t)x + len;
+        int start = w4_min(args[0], x);
+        if (x <= prevEnd && args[0] <= end) {
+            int64_t endX = prevEnd > end ? prevEnd : end;
+            if (spanFits(start, endX)) {
+                args[0] = start;
+                args[2] = endX - start;
+                return;
+            }
+        }
+    }
+    recordCommand(list, COMMAND_HLINE, x, y, len, 0);
+}
+
+void w4_drawListVLine (w4_DrawList* list, int x, int y, int len) {
+    Command* prev = mergeableCommand(list, COMMAND_VLINE);
+    if (prev && len > 0 && prev->args[0] == x && prev->args[2] > 0) {
+        int32_t* args = prev->args;
+        int64_t prevEnd = (int64_t)args[1] + args[2], end = (int64_t)y + len;
+        int start = w4_min(args[1], y);
+        if (y <= prevEnd && args[1] <= end) {
+            int64_t endY = prevEnd > end ? prevEnd : end;
+            if (spanFits(start, endY)) {
+                args[1] = start;
+                args[2] = endY - start;
+                return;
+            }
+        }
+    }
+    recordCommand(list, COMMAND_VLINE, x, y, len, 0);
+}
+
+static void recordText (w4_DrawList* list, int type, const void* str, int byteLength, int x, int y) {
+    TextCommand* text = (TextCommand*)allocCommand(list, type, sizeof(TextCommand) + byteLength);
+    if (!text) {
+        w4_drawListFlush(list);
+        if (type == COMMAND_TEXT_UTF8) {
+            w4_framebufferTextUtf8(list->fb, str, byteLength, x, y);
+        } else {
+            w4_framebufferTextUtf16(list->fb, str, byteLength, x, y);
+        }
+        return;
+    }
+    text->command.args[0] = x;
+    text->command.args[1] = y;
+    text->byteLength = byteLength;
+    memcpy(text + 1, str, byteLength);
+}
+
+void w4_drawListTextUtf8 (w4_DrawList* list, const uint8_t* str, int byteLength, int x, int y) {
+    recordText(list, COMMAND_TEXT_UTF8, str, byteLength, x, y);
+}
+
+void w4_drawListTextUtf16 (w4_DrawList* list, const uint16_t* str, int byteLength, int x, int y) {
+    // Text drawing reads whole characters, including the last one of an odd byteLength
+    recordText(list, COMMAND_TEXT_UTF16, str, (byteLength + 1) & ~1, x, y);
+}
+
+void w4_drawListBlit (w4_DrawList* list, const uint8_t* sprite, int byteLength, int x, int y,
+        int width, int height, int srcX, int stride, int flags) {
+    BlitCommand* blit = (BlitCommand*)allocCommand(list, COMMAND_BLIT, sizeof(BlitCommand) + byteLength);
+    if (!blit) {
+        w4_drawListFlush(list);
+        w4_framebufferBlit(list->fb, sprite, x, y, width, height, srcX, 0, stride,
+            flags & 1, flags & 2, flags & 4, flags & 8);
+        return;
+    }
+    blit->command.args[0] = x;
+    blit->command.args[1] = y;
+    blit->command.args[2] = width;
+    blit->command.args[3] = height;
+    blit->srcX = srcX;
+    blit->stride = stride;
+    blit->flags = flags;
+    blit->byteLength = byteLength;
+    memcpy(blit + 1, sprite, byteLength);
+}
+
+// Clips a box to the screen. The framebuffer computes ends in int, so where one overflows the
+// drawing could land anywhere and the whole screen is reported instead.
+static Box screenBox (int64_t x1, int64_t y1, int64_t x2, int64_t y2) {
+    Box box = { 0, 0, WIDTH, HEIGHT };
+    if (x2 <= INT32_MAX && y2 <= INT32_MAX) {
+        box.x1 = x1 > 0 ? x1 : 0;
+        box.y1 = y1 > 0 ? y1 : 0;
+        box.x2 = x2 < WIDTH ? x2 : WIDTH;
+        box.y2 = y2 < HEIGHT ? y2 : HEIGHT;
+    }
+    return box;
+}
+
+// Computes the screen area a text command can touch, 8x8 pixels per character cell.
+static Box textBounds (const TextCommand* text) {
+    const uint8_t* str = (const uint8_t*)(text + 1);
+    int step = (text->command.type == COMMAND_TEXT_UTF16) ? 2 : 1;
+    int columns = 0, maxColumns = 0, lines = 1;
+    for (int n = 0; n + step <= text->byteLength; n += step) {
+        uint16_t c = (step == 2) ? (str[n] | (str[n+1] << 8)) : str[n];
+        if (c == 0) {
+            break;
+        } else if (c == 10) {
+            ++lines;
+            columns = 0;
+        } else {
+            maxColumns = w4_max(maxColumns, ++columns);
+        }
+    }
+    int64_t x = text->command.args[0], y = text->command.args[1];
+    return screenBox(x, y, x + 8*maxColumns, y + 8*lines);
+}
+
+// Returns a box containing every pixel a command may draw, clipped to the screen. Commands
+// with unusual arguments conservatively report the whole screen.
+static Box commandBounds (const Command* command) {
+    const int32_t* args = command->args;
+    switch (command->type) {
+    case COMMAND_RECT:
+    case COMMAND_BLIT:
+        if (args[2] > 0 && args[3] > 0 && args[2] <= WIDTH*4 && args[3] <= HEIGHT*4) {
+            bool rotate = command->type == COMMAND_BLIT && (((const BlitCommand*)command)->flags & 8);
+            return screenBox(args[0], args[1],
+                (int64_t)args[0] + (rotate ? args[3] : args[2]),
+                (int64_t)args[1] + (rotate ? args[2] : args[3]));
+        }
+        break;
+    case COMMAND_OVAL:
+        // The oval scan stays within its bounding box for sizes up to at least 400
+        if (args[2] > 0 && args[3] > 0 && args[2] <= 400 && args[3] <= 400) {
+            return screenBox(args[0], args[1], (int64_t)args[0] + args[2], (int64_t)args[1] + args[3]);
+        }
+        break;
+    case COMMAND_LINE: {
+        int64_t x1 = w4_min(args[0], args[2]), y1 = w4_min(args[1], args[3]);
+        int64_t x2 = w4_max(args[0], args[2]), y2 = w4_max(args[1], args[3]);
+        // The framebuffer steps lines using int deltas
+        if (x2 - x1 <= INT32_MAX && y2 - y1 <= INT32_MAX) {
+            return screenBox(x1, y1, x2 + 1, y2 + 1);
+        }
+        break;
+    }
+    case COMMAND_HLINE:
+        return screenBox(args[0], args[1], (int64_t)args[0] + args[2], (int64_t)args[1] + 1);
+    case COMMAND_VLINE:
+        return screenBox(args[0], args[1], (int64_t)args[0] + 1, (int64_t)args[1] + args[2]);
+    case COMMAND_TEXT_UTF8:
+    case COMMAND_TEXT_UTF16:
+        return textBounds((const TextCommand*)command);
+    }
+    return screenBox(0, 0, WIDTH, HEIGHT);
+}
+
+// Gets the box a rect fills, clipped to the screen. Unlike commandBounds this is exact and never
+// widened, so it's safe to hide other commands behind. Returns false if there's nothing to rely on.
+static bool rectFillBounds (const Command* command, Box* box) {
+    const int32_t* args = command->args;
+    if (!(command->drawColors[0] & 0xf) || args[2] <= 0 || args[3] <= 0) {
+        return false;
+    }
+    // The framebuffer computes the ends in int, so a rect whose ends overflow doesn't fill this
+    int64_t x2 = (int64_t)args[0] + args[2];
+    int64_t y2 = (int64_t)args[1] + args[3];
+    if (x2 > INT32_MAX || y2 > INT32_MAX) {
+        return false;
+    }
+    box->x1 = w4_max(args[0], 0);
+    box->y1 = w4_max(args[1], 0);
+    box->x2 = x2 < WIDTH ? x2 : WIDTH;
+    box->y2 = y2 < HEIGHT ? y2 : HEIGHT;
+    return box->x1 < box->x2 && box->y1 < box->y2;
+}
+
+// Marks commands that draw nothing on screen, or that are entirely painted over by a later
+// opaque rect, so that flushing can skip them.
+static void cullCommands (Command** commands, int count) {
+    Box occluders[MAX_OCCLUDERS];
+    int occluderCount = 0;
+
+    for (int n = count - 1; n >= 0; --n) {
+        Command* command = commands[n];
+        Box box = commandBounds(command);
+        if (box.x1 >= box.x2 || box.y1 >= box.y2) {
+            command->skip = true;
+            continue;
+        }
+
+        for (int m = 0; m < occluderCount; ++m) {
+            const Box* occluder = &occluders[m];
+            if (box.x1 >= occluder->x1 && box.y1 >= occluder->y1
+                    && box.x2 <= occluder->x2 && box.y2 <= occluder->y2) {
+                command->skip = true;
+                break;
+            }
+        }
+
+        // Rects with a fill color paint every pixel in their bounds
+        Box fill;
+        if (!command->skip && command->type == COMMAND_RECT && rectFillBounds(command, &fill)) {
+            if (occluderCount < MAX_OCCLUDERS) {
+                occluders[occluderCount++] = fill;
+            } else {
+                // Replace the smallest occluder
+                int area = (fill.x2 - fill.x1) * (fill.y2 - fill.y1);
+                for (int m = 0; m < MAX_OCCLUDERS; ++m) {
+                    const Box* occluder = &occluders[m];
+                    if ((occluder->x2 - occluder->x1) * (occluder->y2 - occluder->y1) < area) {
+                        occluders[m] = fill;
+                        break;
+                    }
+                }
+            }
+        }
+    }
+}
+
+static void executeCommand (w4_Framebuffer* fb, const Command* command) {
+    const int32_t* args = command->args;
+    switch (command->type) {
+    case COMMAND_RECT:
+        w4_framebufferRect(fb, args[0], args[1], args[2], args[3]);
+        break;
+    case COMMAND_OVAL:
+        w4_framebufferOval(fb, args[0], args[1], args[2], args[3]);
+        break;
+    case COMMAND_LINE:
+        w4_framebufferLine(fb, args[0], args[1], args[2], args[3]);
+        break;
+    case COMMAND_HLINE:
+        w4_framebufferHLine(fb, args[0], args[1], args[2]);
+        break;
+    case COMMAND_VLINE:
+        w4_framebufferVLine(fb, args[0], args[1], args[2]);
+        break;
+    case COMMAND_TEXT_UTF8: {
+        const TextCommand* text = (const TextCommand*)command;
+        w4_framebufferTextUtf8(fb, (const uint8_t*)(text + 1), text->byteLength, args[0], args[1]);
+        break;
+    }
+    case COMMAND_TEXT_UTF16: {
+        const TextCommand* text = (const TextCommand*)command;
+        w4_framebufferTextUtf16(fb, (const uint16_t*)(text + 1), text->byteLength, args[0], args[1]);
+        break;
+    }
+    case COMMAND_BLIT: {
+        const BlitCommand* blit = (const BlitCommand*)command;
+        int flags = blit->flags;
+        w4_framebufferBlit(fb, (const uint8_t*)(blit + 1), args[0], args[1], args[2], args[3],
+            blit->srcX, 0, blit->stride, flags & 1, flags & 2, flags & 4, flags & 8);
+        break;
+    }
+    }
+}
+
+void w4_drawListFlush (w4_DrawList* list) {
+    if (list->arenaUsed == 0) {
+        return;
+    }
+
+    Command** commands = list->commands;
+    int count = 0;
+    for (uint32_t offset = 0; offset < list->arenaUsed; ) {
+        Command* command = (Command*)(list->arena.bytes + offset);
+        commands[count++] = command;
+        offset += command->size;
+    }
+
+    cullCommands(commands, count);
+
+    for (int n = 0; n < count; ++n) {
+        const Command* command = commands[n];
+        if (!command->skip) {
+            w4_framebufferSetDrawColors(list->fb, command->drawColors);
+            executeCommand(list->fb, command);
+        }
+    }
+    w4_framebufferSetDrawColors(list->fb, list->drawColors);
+
+    list->arenaUsed = 0;
+    list->lastCommand = NULL;
+}
@@ -0,0 +1,41 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "framebuffer.h"
+
+// Deferred drawing. Draw calls are recorded into a per-frame command list along with the draw
+// colors and any sprite or string data they read, and rasterized together by
+// w4_drawListFlush. Before rasterizing, adjacent spans and rects of the same color are merged
+// and commands that are entirely covered by a later opaque rect are dropped.
+//
+// The list must be flushed before anything reads the framebuffer. Carts that read or write
+// framebuffer memory directly from wasm in the middle of a frame can't be detected, so deferred
+// drawing is opt-in.
+
+typedef struct w4_DrawList w4_DrawList;
+
+/** Creates an empty list that draws into fb, recording the draw colors read from drawColors. */
+w4_DrawList* w4_drawListCreate (w4_Framebuffer* fb, const uint8_t* drawColors);
+void w4_drawListDestroy (w4_DrawList* list);
+
+void w4_drawListRect (w4_DrawList* list, int x, int y, int width, int height);
+void w4_drawListOval (w4_DrawList* list, int x, int y, int width, int height);
+void w4_drawListLine (w4_DrawList* list, int x1, int y1, int x2, int y2);
+void w4_drawListHLine (w4_DrawList* list, int x, int y, int len);
+void w4_drawListVLine (w4_DrawList* list, int x, int y, int len);
+
+/** Records text, copying byteLength bytes of str. */
+void w4_drawListTextUtf8 (w4_DrawList* list, const uint8_t* str, int byteLength, int x, int y);
+void w4_drawListTextUtf16 (w4_DrawList* list, const uint16_t* str, int byteLength, int x, int y);
+
+/**
+ * Records a blit, copying byteLength bytes of sprite data. srcX is relative to the start of the
+ * copied data and may include whole rows of the source.
+ */
+void w4_drawListBlit (w4_DrawList* list, const uint8_t* sprite, int byteLength, int x, int y,
+    int width, int height, int srcX, int stride, int flags);
+
+/** Rasterizes all recorded commands and empties the list. */
+void w4_drawListFlush (w4_DrawList* list);
@@ -3,6 +3,7 @@
 #include <stdlib.h>
 #include <string.h>
 
+#include "framebuffer_simd.h"
 #include "util.h"
 
 static const uint8_t font[1792] = {
@@ -232,8 +233,54 @@ static const uint8_t font[1792] = {
     0x93, 0xff, 0x39, 0x39, 0x39, 0x81, 0xf9, 0x83
 };
 
-static const uint8_t* drawColors;
-static uint8_t* framebuffer;
+#if defined(__GNUC__)
+#define ALWAYS_INLINE inline __attribute__((always_inline))
+#else
+#define ALWAYS_INLINE inline
+#endif
+
+#define GLYPH_COUNT (sizeof(font) / 8)
+#define GLYPH_CACHE_SLOTS 4
+
+// A font glyph expanded to framebuffer bytes for one drawColors value. Each of the four x
+// alignments within a framebuffer byte has its own copy, so that a row of a visible glyph is a
+// single masked write of 2 or 3 bytes.
+typedef struct {
+    uint8_t color[8][3];
+    uint8_t mask[8][3];
+} ExpandedGlyph;
+
+typedef struct {
+    /** drawColors[0] this slot was expanded for. */
+    uint8_t colors;
+
+    /** Incremented on every use, to pick which slot to evict. */
+    uint32_t lastUse;
+
+    /** Bitmask of which alignments of each glyph have been expanded. */
+    uint8_t expanded[GLYPH_COUNT];
+
+    ExpandedGlyph glyphs[GLYPH_COUNT][4];
+} GlyphCache;
+
+struct w4_Framebuffer {
+    const uint8_t* drawColors;
+    uint8_t* pixels;
+
+    // Maps a packed index byte to the finished framebuffer byte and its opacity mask, for the
+    // drawColors value the tables were last built with.
+    uint8_t blitLutColor[256];
+    uint8_t blitLutMask[256];
+    uint16_t blitLutColors;
+    bool blitLutReady;
+
+    // The same mapping for the vectorized row merge, and the merge routine picked for this CPU.
+    w4_SimdPalette blitPalette;
+    w4_SimdMergeRow simdMergeRow;
+
+    GlyphCache glyphCaches[GLYPH_CACHE_SLOTS];
+    uint32_t glyphCacheClock;
+};
 
 static int w4_min (int a, int b) {
     return a < b ? a : b;
@@ -243,42 +290,90 @@ static int w4_max (int a, int b) {
     return a > b ? a : b;
 }
 
-static void drawPoint (uint8_t color, int x, int y) {
+static void drawPoint (w4_Framebuffer* fb, uint8_t color, int x, int y) {
     int idx = (WIDTH * y + x) >> 2;
     int shift = (x & 0x3) << 1;
     int mask = 0x3 << shift;
-    framebuffer[idx] = (color << shift) | (framebuffer[idx] & ~mask);
+    fb->pixels[idx] = (color << shift) | (fb->pixels[idx] & ~mask);
 }
 
-static void drawPointUnclipped (uint8_t color, int x, int y) {
+static void drawPointUnclipped (w4_Framebuffer* fb, uint8_t color, int x, int y) {
     if (x >= 0 && x < WIDTH && y >= 0 && y < HEIGHT) {
-        drawPoint(color, x, y);
+        drawPoint(fb, color, x, y);
     }
 }
 
-static void drawHLine (uint8_t color, int startX, int y, int endX) {
-    int fillEnd = endX - (endX & 3);
-    int fillStart = w4_min((startX + 3) & ~3, fillEnd);
+// Masks of the pixels covered in the first and last framebuffer byte of a span, indexed by
+// startX & 3 and endX & 3 respectively
+static const uint8_t leftEdgeMasks[4] = { 0xff, 0xfc, 0xf0, 0xc0 };
+static const uint8_t rightEdgeMasks[4] = { 0xff, 0x03, 0x0f, 0x3f };
 
-    if (fillEnd - fillStart > 3) {
-        for (int xx = startX; xx < fillStart; xx++) {
-            drawPoint(color, xx, y);
-        }
+static ALWAYS_INLINE void fillBytes (uint8_t* dst, uint8_t value, int length) {
+    uint64_t pattern = value * 0x0101010101010101ULL;
+    for (; length >= 8; length -= 8, dst += 8) {
+        memcpy(dst, &pattern, 8);
+    }
+    if (length >= 4) {
+        memcpy(dst, &pattern, 4);
+        dst += 4;
+        length -= 4;
+    }
+    while (length-- > 0) {
+        *dst++ = value;
+    }
+}
+
+// Fills the already clipped rectangle [startX, endX) x [startY, endY) with a solid color.
+static void drawSpans (w4_Framebuffer* fb, uint8_t color, int startX, int startY, int endX, int endY) {
+    if (startX >= endX || startY >= endY) {
+        return;
+    }
 
-        int from = (WIDTH * y + fillStart) >> 2;
-        int to = (WIDTH * y + fillEnd) >> 2;
-        uint8_t fillColor = color * 0x55;
+    uint8_t fillColor = color * 0x55;
+    if (startX == 0 && endX == WIDTH) {
+        // Full width rows are contiguous
+        memset(fb->pixels + ((WIDTH * startY) >> 2), fillColor, (WIDTH * (endY - startY)) >> 2);
+        return;
+    }
+
+    int firstByte = startX >> 2;
+    int lastByte = (endX - 1) >> 2;
+    uint8_t leftMask = leftEdgeMasks[startX & 3];
+    uint8_t rightMask = rightEdgeMasks[endX & 3];
+    uint8_t* row = fb->pixels + ((WIDTH * startY) >> 2) + firstByte;
 
-        memset(framebuffer+from, fillColor, to-from);
-        startX = fillEnd;
+    if (firstByte == lastByte) {
+        uint8_t mask = leftMask & rightMask;
+        for (int y = startY; y < endY; ++y, row += WIDTH >> 2) {
+            *row = (fillColor & mask) | (*row & ~mask);
+        }
+        return;
     }
 
-    for (int xx = startX; xx < endX; xx++) {
-        drawPoint(color, xx, y);
+    int middle = lastByte - firstByte - 1;
+    for (int y = startY; y < endY; ++y, row += WIDTH >> 2) {
+        row[0] = (fillColor & leftMask) | (row[0] & ~leftMask);
+        fillBytes(row + 1, fillColor, middle);
+        row[middle + 1] = (fillColor & rightMask) | (row[middle + 1] & ~rightMask);
     }
 }
 
-static void drawHLineUnclipped (uint8_t color, int startX, int y, int endX) {
+static void drawHLine (w4_Framebuffer* fb, uint8_t color, int startX, int y, int endX) {
+    drawSpans(fb, color, startX, y, endX, y + 1);
+}
+
+// Draws the already clipped column [startY, endY) at x.
+static void drawVLine (w4_Framebuffer* fb, uint8_t color, int x, int startY, int endY) {
+    int shift = (x & 0x3) << 1;
+    uint8_t mask = 0x3 << shift;
+    uint8_t bits = color << shift;
+    uint8_t* dst = fb->pixels + ((WIDTH * startY + x) >> 2);
+    for (int y = startY; y < endY; ++y, dst += WIDTH >> 2) {
+        *dst = bits | (*dst & ~mask);
+    }
+}
+
+static void drawHLineUnclipped (w4_Framebuffer* fb, uint8_t color, int startX, int y, int endX) {
     if (y >= 0 && y < HEIGHT) {
         if (startX < 0) {
             startX = 0;
@@ -287,36 +382,387 @@ static void drawHLineUnclipped (uint8_t color, int startX, int y, int endX) {
             endX = WIDTH;
         }
         if (startX < endX) {
-            drawHLine(color, startX, y, endX);
+            drawHLine(fb, color, startX, y, endX);
+        }
+    }
+}
+
+// Lookup tables used by the blit kernels. Sprite pixels are stored MSB-first, while framebuffer
+// pixels are stored LSB-first, so the kernels work on "packed index" bytes holding four 2-bit
+// color indices with the first pixel in the top two bits.
+
+// Spreads 8 1bpp pixels into two packed index bytes (first four pixels in the high byte).
+#define SPREAD1(n) (n), (n)+0x1
+#define SPREAD2(n) SPREAD1(n), SPREAD1((n)+0x4)
+#define SPREAD3(n) SPREAD2(n), SPREAD2((n)+0x10)
+#define SPREAD4(n) SPREAD3(n), SPREAD3((n)+0x40)
+#define SPREAD5(n) SPREAD4(n), SPREAD4((n)+0x100)
+#define SPREAD6(n) SPREAD5(n), SPREAD5((n)+0x400)
+#define SPREAD7(n) SPREAD6(n), SPREAD6((n)+0x1000)
+#define SPREAD8(n) SPREAD7(n), SPREAD7((n)+0x4000)
+static const uint16_t spread1bpp[256] = { SPREAD8(0) };
+
+// Reverses the order of the 8 pixels in a 1bpp byte, used for flipX.
+#define REVERSE1(n) (n), (n)+0x80
+#define REVERSE2(n) REVERSE1(n), REVERSE1((n)+0x40)
+#define REVERSE3(n) REVERSE2(n), REVERSE2((n)+0x20)
+#define REVERSE4(n) REVERSE3(n), REVERSE3((n)+0x10)
+#define REVERSE5(n) REVERSE4(n), REVERSE4((n)+0x8)
+#define REVERSE6(n) REVERSE5(n), REVERSE5((n)+0x4)
+#define REVERSE7(n) REVERSE6(n), REVERSE6((n)+0x2)
+#define REVERSE8(n) REVERSE7(n), REVERSE7((n)+0x1)
+static const uint8_t reverse1bpp[256] = { REVERSE8(0) };
+
+// Reverses the order of the 4 pixels in a 2bpp byte, used for flipX.
+#define REVERSE2BPP1(n) (n), (n)+0x40, (n)+0x80, (n)+0xc0
+#define REVERSE2BPP2(n) REVERSE2BPP1(n), REVERSE2BPP1((n)+0x10), REVERSE2BPP1((n)+0x20), REVERSE2BPP1((n)+0x30)
+#define REVERSE2BPP3(n) REVERSE2BPP2(n), REVERSE2BPP2((n)+0x4), REVERSE2BPP2((n)+0x8), REVERSE2BPP2((n)+0xc)
+#define REVERSE2BPP4(n) REVERSE2BPP3(n), REVERSE2BPP3((n)+0x1), REVERSE2BPP3((n)+0x2), REVERSE2BPP3((n)+0x3)
+static const uint8_t reverse2bpp[256] = { REVERSE2BPP4(0) };
+
+// Rows narrower than this many framebuffer bytes are cheaper to write with the lookup tables.
+#define SIMD_MIN_ROW_BYTES 8
+
+static void updateBlitLut (w4_Framebuffer* fb, uint16_t colors) {
+    if (fb->blitLutReady && fb->blitLutColors == colors) {
+        return;
+    }
+    for (int n = 0; n < 256; ++n) {
+        uint8_t color = 0, mask = 0;
+        for (int p = 0; p < 4; ++p) {
+            int colorIdx = (n >> (6 - (p << 1))) & 0x3;
+            uint8_t dc = (colors >> (colorIdx << 2)) & 0x0f;
+            if (dc != 0) {
+                color |= ((dc - 1) & 0x03) << (p << 1);
+                mask |= 0x3 << (p << 1);
+            }
+        }
+        fb->blitLutColor[n] = color;
+        fb->blitLutMask[n] = mask;
+    }
+    for (int colorIdx = 0; colorIdx < 4; ++colorIdx) {
+        uint8_t dc = (colors >> (colorIdx << 2)) & 0x0f;
+        fb->blitPalette.color[colorIdx] = ((dc - 1) & 0x03) * 0x55;
+        fb->blitPalette.opaque[colorIdx] = dc ? 0xff : 0;
+    }
+    fb->blitLutColors = colors;
+    fb->blitLutReady = true;
+}
+
+typedef struct {
+    w4_Framebuffer* fb;
+    const uint8_t* sprite;
+    int dstX, dstY;
+    int width, height;
+    int srcX, srcY, srcStride;
+
+    // Clipped iteration range in sprite space, as (x, y) before rotation
+    int clipXMin, clipYMin, clipXMax, clipYMax;
+} BlitJob;
+
+// Reads the 8 sprite bits starting at bit offset `bit`, only touching the sprite bytes that
+// overlap the bit range [firstBit, lastBit]. Bits outside that range read as zero.
+static ALWAYS_INLINE uint8_t readSpriteBits (const uint8_t* sprite, int bit, int firstBit, int lastBit) {
+    int byte = bit >> 3;
+    int shift = bit & 7;
+    int firstByte = firstBit >> 3;
+    int lastByte = lastBit >> 3;
+    unsigned int hi = (byte >= firstByte && byte <= lastByte) ? sprite[byte] : 0;
+    unsigned int lo = (shift && byte + 1 >= firstByte && byte + 1 <= lastByte) ? sprite[byte + 1] : 0;
+    return (((hi << 8) | lo) << shift) >> 8;
+}
+
+// Writes 4 pixels of packed indices to a framebuffer byte, limited to the pixels in `edge`.
+static ALWAYS_INLINE void writeBlitByte (const w4_Framebuffer* fb, uint8_t* dst, uint8_t indices, uint8_t edge) {
+    uint8_t mask = fb->blitLutMask[indices] & edge;
+    if (mask == 0xff) {
+        *dst = fb->blitLutColor[indices];
+    } else if (mask) {
+        *dst = (fb->blitLutColor[indices] & mask) | (*dst & ~mask);
+    }
+}
+
+// Writes one fetch worth of pixels (8 for 1bpp, 4 for 2bpp) starting at a 4-aligned
+// framebuffer x, keeping only pixels [first, last) of the group.
+static ALWAYS_INLINE void writeBlitGroup (const w4_Framebuffer* fb, uint8_t* dst, uint8_t bits, int first, int last, bool bpp2) {
+    uint16_t edge = ((1u << (last << 1)) - 1) & ~((1u << (first << 1)) - 1);
+    if (bpp2) {
+        writeBlitByte(fb, dst, bits, edge);
+    } else {
+        uint16_t indices = spread1bpp[bits];
+        writeBlitByte(fb, dst, indices >> 8, edge);
+        writeBlitByte(fb, dst + 1, indices, edge >> 8);
+    }
+}
+
+// Transposes an 8x8 1bpp block, where each byte is a row with its first pixel in the MSB.
+static ALWAYS_INLINE void transpose1bpp (uint8_t* rows) {
+    uint64_t x = 0;
+    for (int n = 0; n < 8; ++n) {
+        x = (x << 8) | rows[n];
+    }
+    uint64_t t;
+    t = (x ^ (x >> 7)) & 0x00aa00aa00aa00aaULL;
+    x = x ^ t ^ (t << 7);
+    t = (x ^ (x >> 14)) & 0x0000cccc0000ccccULL;
+    x = x ^ t ^ (t << 14);
+    t = (x ^ (x >> 28)) & 0x00000000f0f0f0f0ULL;
+    x = x ^ t ^ (t << 28);
+    for (int n = 7; n >= 0; --n) {
+        rows[n] = x;
+        x >>= 8;
+    }
+}
+
+// Transposes a 4x4 2bpp block, where each byte is a row with its first pixel in the top bits.
+static ALWAYS_INLINE void transpose2bpp (uint8_t* rows) {
+    uint32_t x = ((uint32_t)rows[0] << 24) | (rows[1] << 16) | (rows[2] << 8) | rows[3];
+    uint32_t t;
+    t = (x ^ (x >> 6)) & 0x00cc00cc;
+    x = x ^ t ^ (t << 6);
+    t = (x ^ (x >> 12)) & 0x0000f0f0;
+    x = x ^ t ^ (t << 12);
+    rows[0] = x >> 24;
+    rows[1] = x >> 16;
+    rows[2] = x >> 8;
+    rows[3] = x;
+}
+
+// Generic blit body. It is only ever called with constant flags, so that each of the 16 kernels
+// below is compiled into a specialized loop with no per-pixel branching on the flags.
+//
+// Pixels are processed in groups of 8 sprite bits (8 pixels for 1bpp, 4 for 2bpp), aligned so
+// that each group lands on whole framebuffer bytes. Unrotated blits read one group per sprite
+// row; rotated blits read a square block of rows and transpose it into framebuffer rows.
+static ALWAYS_INLINE void blitKernel (const BlitJob* job, bool bpp2, bool flipX, bool flipY, bool rotate) {
+    const w4_Framebuffer* fb = job->fb;
+    const uint8_t* sprite = job->sprite;
+    const int bpp = bpp2 ? 2 : 1;
+    const int groupSize = bpp2 ? 4 : 8;
+    const uint8_t* reverse = bpp2 ? reverse2bpp : reverse1bpp;
+
+    if (rotate) {
+        flipX = !flipX;
+    }
+
+    // u runs along framebuffer rows, v runs down framebuffer columns
+    const int uMin = rotate ? job->clipYMin : job->clipXMin;
+    const int uMax = rotate ? job->clipYMax : job->clipXMax;
+    const int vMin = rotate ? job->clipXMin : job->clipYMin;
+    const int vMax = rotate ? job->clipXMax : job->clipYMax;
+    const int uStart = ((job->dstX + uMin) & ~3) - job->dstX;
+
+    if (!rotate) {
+        // Framebuffer bytes touched by each row, and the pixels to keep in the first and last one
+        const int rowBytes = ((job->dstX + uMax + 3) >> 2) - ((job->dstX + uStart) >> 2);
+        const uint8_t firstEdge = 0xff << (((job->dstX + uMin) & 3) << 1);
+        const uint8_t lastEdge = 0xff >> ((-(job->dstX + uMax) & 3) << 1);
+        const bool simdRow = fb->simdMergeRow && rowBytes >= SIMD_MIN_ROW_BYTES;
+
+        for (int v = vMin; v < vMax; ++v) {
+            int sy = job->srcY + (flipY ? job->height - v - 1 : v);
+            int rowPixel = sy * job->srcStride + job->srcX;
+            int firstPixel = flipX ? rowPixel + job->width - uMax : rowPixel + uMin;
+            int lastPixel = flipX ? rowPixel + job->width - uMin - 1 : rowPixel + uMax - 1;
+            int firstBit = firstPixel * bpp;
+            int lastBit = lastPixel * bpp + bpp - 1;
+            uint8_t* dst = fb->pixels + ((WIDTH * (job->dstY + v) + job->dstX + uStart) >> 2);
+
+            if (simdRow) {
+                // Gather the packed indices for the whole row, then merge them in one pass
+                uint8_t indices[WIDTH/4 + 2];
+                uint8_t* out = indices;
+                for (int u = uStart; u < uMax; u += groupSize) {
+                    uint8_t bits;
+                    if (flipX) {
+                        bits = reverse[readSpriteBits(sprite, (rowPixel + job->width - u - groupSize) * bpp, firstBit, lastBit)];
+                    } else {
+                        bits = readSpriteBits(sprite, (rowPixel + u) * bpp, firstBit, lastBit);
+                    }
+                    if (bpp2) {
+                        *out++ = bits;
+                    } else {
+                        uint16_t spread = spread1bpp[bits];
+                        *out++ = spread >> 8;
+                        *out++ = spread;
+                    }
+                }
+
+                // Restore the pixels outside of the clipped row in the partial edge bytes
+                uint8_t first = dst[0], last = dst[rowBytes - 1];
+                fb->simdMergeRow(dst, indices, rowBytes, &fb->blitPalette);
+                dst[0] = (dst[0] & firstEdge) | (first & ~firstEdge);
+                dst[rowBytes - 1] = (dst[rowBytes - 1] & lastEdge) | (last & ~lastEdge);
+                continue;
+            }
+
+            for (int u = uStart; u < uMax; u += groupSize, dst += groupSize >> 2) {
+                uint8_t bits;
+                if (flipX) {
+                    bits = reverse[readSpriteBits(sprite, (rowPixel + job->width - u - groupSize) * bpp, firstBit, lastBit)];
+                } else {
+                    bits = readSpriteBits(sprite, (rowPixel + u) * bpp, firstBit, lastBit);
+                }
+                writeBlitGroup(fb, dst, bits, w4_max(0, uMin - u), w4_min(groupSize, uMax - u), bpp2);
+            }
+        }
+
+    } else {
+        for (int v0 = vMin; v0 < vMax; v0 += groupSize) {
+            int rows = w4_min(groupSize, vMax - v0);
+            int startColumn = job->srcX + (flipX ? job->width - v0 - groupSize : v0);
+            int firstColumn = job->srcX + (flipX ? job->width - v0 - rows : v0);
+            int lastColumn = job->srcX + (flipX ? job->width - v0 - 1 : v0 + rows - 1);
+            uint8_t* dstRow = fb->pixels + ((WIDTH * (job->dstY + v0) + job->dstX + uStart) >> 2);
+
+            for (int u = uStart; u < uMax; u += groupSize, dstRow += groupSize >> 2) {
+                int first = w4_max(0, uMin - u);
+                int last = w4_min(groupSize, uMax - u);
+
+                uint8_t block[8] = { 0 };
+                for (int k = first; k < last; ++k) {
+                    int sy = job->srcY + (flipY ? job->height - u - k - 1 : u + k);
+                    int rowPixel = sy * job->srcStride;
+                    uint8_t bits = readSpriteBits(sprite, (rowPixel + startColumn) * bpp,
+                        (rowPixel + firstColumn) * bpp, (rowPixel + lastColumn) * bpp + bpp - 1);
+                    block[k] = flipX ? reverse[bits] : bits;
+                }
+                if (bpp2) {
+                    transpose2bpp(block);
+                } else {
+                    transpose1bpp(block);
+                }
+
+                uint8_t* dst = dstRow;
+                for (int j = 0; j < rows; ++j, dst += WIDTH >> 2) {
+                    writeBlitGroup(fb, dst, block[j], first, last, bpp2);
+                }
+            }
+        }
+    }
+}
+
+#define BLIT_KERNEL(bpp2, flipX, flipY, rotate) \
+    static void blitKernel##bpp2##flipX##flipY##rotate (const BlitJob* job) { \
+        blitKernel(job, bpp2, flipX, flipY, rotate); \
+    }
+BLIT_KERNEL(0, 0, 0, 0) BLIT_KERNEL(1, 0, 0, 0) BLIT_KERNEL(0, 1, 0, 0) BLIT_KERNEL(1, 1, 0, 0)
+BLIT_KERNEL(0, 0, 1, 0) BLIT_KERNEL(1, 0, 1, 0) BLIT_KERNEL(0, 1, 1, 0) BLIT_KERNEL(1, 1, 1, 0)
+BLIT_KERNEL(0, 0, 0, 1) BLIT_KERNEL(1, 0, 0, 1) BLIT_KERNEL(0, 1, 0, 1) BLIT_KERNEL(1, 1, 0, 1)
+BLIT_KERNEL(0, 0, 1, 1) BLIT_KERNEL(1, 0, 1, 1) BLIT_KERNEL(0, 1, 1, 1) BLIT_KERNEL(1, 1, 1, 1)
+
+// Indexed by the blit flags: BLIT_2BPP | BLIT_FLIP_X << 1 | BLIT_FLIP_Y << 2 | BLIT_ROTATE << 3
+static void (*const blitKernels[16]) (const BlitJob* job) = {
+    blitKernel0000, blitKernel1000, blitKernel0100, blitKernel1100,
+    blitKernel0010, blitKernel1010, blitKernel0110, blitKernel1110,
+    blitKernel0001, blitKernel1001, blitKernel0101, blitKernel1101,
+    blitKernel0011, blitKernel1011, blitKernel0111, blitKernel1111,
+};
+
+// Returns the cache slot for the current drawColors, recycling the least recently used one if
+// these colors aren't cached yet.
+static GlyphCache* getGlyphCache (w4_Framebuffer* fb) {
+    uint8_t colors = fb->drawColors[0];
+    GlyphCache* oldest = &fb->glyphCaches[0];
+    ++fb->glyphCacheClock;
+
+    for (int n = 0; n < GLYPH_CACHE_SLOTS; ++n) {
+        GlyphCache* cache = &fb->glyphCaches[n];
+        if (cache->lastUse && cache->colors == colors) {
+            cache->lastUse = fb->glyphCacheClock;
+            return cache;
+        }
+        if (cache->lastUse < oldest->lastUse) {
+            oldest = cache;
         }
     }
+
+    oldest->colors = colors;
+    oldest->lastUse = fb->glyphCacheClock;
+    memset(oldest->expanded, 0, sizeof(oldest->expanded));
+    return oldest;
 }
 
-void w4_framebufferInit (const uint8_t* drawColors_, uint8_t* framebuffer_) {
-    drawColors = drawColors_;
-    framebuffer = framebuffer_;
+static void expandGlyph (ExpandedGlyph* glyph, uint8_t colors, int glyphIdx, int align) {
+    for (int row = 0; row < 8; ++row) {
+        uint8_t bits = font[(glyphIdx << 3) + row];
+        uint32_t color = 0, mask = 0;
+        for (int x = 0; x < 8; ++x) {
+            int colorIdx = (bits >> (7 - x)) & 0x1;
+            uint8_t dc = (colors >> (colorIdx << 2)) & 0x0f;
+            if (dc != 0) {
+                int shift = (align + x) << 1;
+                color |= (uint32_t)((dc - 1) & 0x03) << shift;
+                mask |= (uint32_t)0x3 << shift;
+            }
+        }
+        for (int n = 0; n < 3; ++n) {
+            glyph->color[row][n] = color >> (n << 3);
+            glyph->mask[row][n] = mask >> (n << 3);
+        }
+    }
 }
 
-void w4_framebufferClear () {
-    memset(framebuffer, 0, WIDTH*HEIGHT >> 2);
+static void drawGlyph (w4_Framebuffer* fb, GlyphCache* cache, int glyphIdx, int x, int y) {
+    if (x < 0 || x > WIDTH - 8 || y < 0 || y > HEIGHT - 8) {
+        // Partially visible glyphs go through the clipping blitter
+        w4_framebufferBlit(fb, font, x, y, 8, 8, 0, glyphIdx << 3, 8, false, false, false, false);
+        return;
+    }
+
+    int align = x & 3;
+    ExpandedGlyph* glyph = &cache->glyphs[glyphIdx][align];
+    if (!(cache->expanded[glyphIdx] & (1 << align))) {
+        expandGlyph(glyph, cache->colors, glyphIdx, align);
+        cache->expanded[glyphIdx] |= 1 << align;
+    }
+
+    uint8_t* dst = fb->pixels + ((WIDTH * y + x) >> 2);
+    int bytes = align ? 3 : 2;
+    for (int row = 0; row < 8; ++row, dst += WIDTH >> 2) {
+        for (int n = 0; n < bytes; ++n) {
+            dst[n] = glyph->color[row][n] | (dst[n] & ~glyph->mask[row][n]);
+        }
+    }
+}
+
+w4_Framebuffer* w4_framebufferCreate (const uint8_t* drawColors, uint8_t* pixels) {
+    w4_Framebuffer* fb = xmalloc(sizeof(w4_Framebuffer));
+    memset(fb, 0, sizeof(w4_Framebuffer));
+    fb->drawColors = drawColors;
+    fb->pixels = pixels;
+    fb->simdMergeRow = w4_framebufferSimdInit();
+    return fb;
+}
+
+void w4_framebufferDestroy (w4_Framebuffer* fb) {
+    free(fb);
+}
+
+void w4_framebufferSetDrawColors (w4_Framebuffer* fb, const uint8_t* drawColors) {
+    fb->drawColors = drawColors;
+}
+
+void w4_framebufferClear (w4_Framebuffer* fb) {
+    memset(fb->pixels, 0, WIDTH*HEIGHT >> 2);
 }
 
-void w4_framebufferHLine (int x, int y, int len) {
-    uint8_t dc0 = drawColors[0] & 0xf;
+void w4_framebufferHLine (w4_Framebuffer* fb, int x, int y, int len) {
+    uint8_t dc0 = fb->drawColors[0] & 0xf;
     if (dc0 == 0) {
         return;
     }
 
     uint8_t strokeColor = (dc0 - 1) & 0x3;
-    drawHLineUnclipped(strokeColor, x, y, x + len);
+    drawHLineUnclipped(fb, strokeColor, x, y, x + len);
 }
 
-void w4_framebufferVLine (int x, int y, int len) {
+void w4_framebufferVLine (w4_Framebuffer* fb, int x, int y, int len) {
     if (y + len <= 0 || x < 0 || x >= WIDTH) {
         return;
     }
 
-    uint8_t dc0 = drawColors[0] & 0xf;
+    uint8_t dc0 = fb->drawColors[0] & 0xf;
     if (dc0 == 0) {
         return;
     }
@@ -324,12 +770,10 @@ void w4_framebufferVLine (int x, int y, int len) {
     int startY = w4_max(0, y);
     int endY = w4_min(HEIGHT, y + len);
     uint8_t strokeColor = (dc0 - 1) & 0x3;
-    for (int yy = startY; yy < endY; yy++) {
-        drawPoint(strokeColor, x, yy);
-    }
+    drawVLine(fb, strokeColor, x, startY, endY);
 }
 
-void w4_framebufferRect (int x, int y, int width, int height) {
+void w4_framebufferRect (w4_Framebuffer* fb, int x, int y, int width, int height) {
     int startX = w4_max(0, x);
     int startY = w4_max(0, y);
     int endXUnclamped = x + width;
@@ -337,15 +781,13 @@ void w4_framebufferRect (int x, int y, int width, int height) {
     int endX = w4_max(0, w4_min(endXUnclamped, WIDTH));
     int endY = w4_max(0, w4_min(endYUnclamped, HEIGHT));
 
-    uint8_t dc01 = drawColors[0];
+    uint8_t dc01 = fb->drawColors[0];
     uint8_t dc0 = dc01 & 0xf;
     uint8_t dc1 = (dc01 >> 4) & 0xf;
 
     if (dc0 != 0) {
         uint8_t fillColor = (dc0 - 1) & 0x3;
-        for (int yy = startY; yy < endY; ++yy) {
-            drawHLine(fillColor, startX, yy, endX);
-        }
+        drawSpans(fb, fillColor, startX, startY, endX, endY);
     }
 
     if (dc1 != 0) {
@@ -353,45 +795,28 @@ void w4_framebufferRect (int x, int y, int width, int height) {
 
         // Left edge
         if (x >= 0 && x < WIDTH) {
-            for (int yy = startY; yy < endY; ++yy) {
-                drawPoint(strokeColor, x, yy);
-            }
+            drawVLine(fb, strokeColor, x, startY, endY);
         }
 
         // Right edge
         if (endXUnclamped > 0 && endXUnclamped <= WIDTH) {
-            for (int yy = startY; yy < endY; ++yy) {
-                drawPoint(strokeColor, endXUnclamped - 1, yy);
-            }
+            drawVLine(fb, strokeColor, endXUnclamped - 1, startY, endY);
         }
 
         // Top edge
         if (y >= 0 && y < HEIGHT) {
-            drawHLine(strokeColor, startX, y, endX);
+            drawHLine(fb, strokeColor, startX, y, endX);
         }
 
         // Bottom edge
         if (endYUnclamped > 0 && endYUnclamped <= HEIGHT) {
-            drawHLine(strokeColor, startX, endYUnclamped - 1, endX);
+            drawHLine(fb, strokeColor, startX, endYUnclamped - 1, endX);
         }
     }
 }
 
-// Oval drawing function using a variation on the midpoint algorithm.
-// TIC-80's ellipse drawing function used as reference.
-// https://github.com/nesbox/TIC-80/blob/main/src/core/draw.c
-//
-// Javatpoint has a in depth academic explanation that mostly went over my head:
-// https://www.javatpoint.com/computer-graphics-midpoint-ellipse-algorithm
-//
-// Draws the ellipse by "scanning" along the edge in one quadrant, and mirroring
-// the movement for the other four quadrants.
-//
-// There are a lot of details to get correct while implementing this algorithm,
-// so ensure the edge cases are covered when changing it. Long, thin ellipses
-// are particularly susceptible to being drawn incorrectly.
-void w4_framebufferOval (int x, int y, int width, int height) {
-    uint8_t dc01 = drawColors[0];
+static ALWAYS_INLINE void drawOval (w4_Framebuffer* fb, int x, int y, int width, int height, bool clip) {
+    uint8_t dc01 = fb->drawColors[0];
     uint8_t dc0 = dc01 & 0xf;
     uint8_t dc1 = (dc01 >> 4) & 0xf;
 
@@ -425,23 +850,36 @@ void w4_framebufferOval (int x, int y, int width, int height) {
     a = 8 * a2;
     b1 = 8 * b2;
 
+    // Whether north and south moved onto new rows in the last step. Fills are only drawn on the
+    // first step of each row: later steps on the same row only narrow the span, and the stroke
+    // points they draw land on top of the earlier fill either way.
+    bool newRow = true;
+
+#define PLOT(px, py) (clip ? drawPointUnclipped(fb, strokeColor, px, py) : drawPoint(fb, strokeColor, px, py))
+
     do {
-        drawPointUnclipped(strokeColor, east, north); /*   I. Quadrant     */
-        drawPointUnclipped(strokeColor, west, north); /*   II. Quadrant    */
-        drawPointUnclipped(strokeColor, west, south); /*   III. Quadrant   */
-        drawPointUnclipped(strokeColor, east, south); /*   IV. Quadrant    */
+        PLOT(east, north); /*   I. Quadrant     */
+        PLOT(west, north); /*   II. Quadrant    */
+        PLOT(west, south); /*   III. Quadrant   */
+        PLOT(east, south); /*   IV. Quadrant    */
 
         const int start = west + 1;
         const int len = east - start;
 
-        if (dc0 != 0 && len > 0) { // Only draw fill if the length from west to east is not 0
-            drawHLineUnclipped(fillColor, start, north, east); /*   I and III. Quadrant */
-            drawHLineUnclipped(fillColor, start, south, east); /*  II and IV. Quadrant */
+        if (dc0 != 0 && len > 0 && newRow) { // Only draw fill if the length from west to east is not 0
+            if (clip) {
+                drawHLineUnclipped(fb, fillColor, start, north, east); /*   I and III. Quadrant */
+                drawHLineUnclipped(fb, fillColor, start, south, east); /*  II and IV. Quadrant */
+            } else {
+                drawHLine(fb, fillColor, start, north, east);
+                drawHLine(fb, fillColor, start, south, east);
+            }
         }
 
         const int err2 = 2 * err;
 
-        if (err2 <= dy) {
+        newRow = (err2 <= dy);
+        if (newRow) {
             // Move vertical scan
             north += 1;
             south -= 1;
@@ -460,22 +898,50 @@ void w4_framebufferOval (int x, int y, int width, int height) {
 
     // Make sure north and south have moved the entire way so top/bottom aren't missing
     while (north - south < height) {
-        drawPointUnclipped(strokeColor, west - 1, north); /*   II. Quadrant    */
-        drawPointUnclipped(strokeColor, east + 1, north); /*   I. Quadrant     */
+        PLOT(west - 1, north); /*   II. Quadrant    */
+        PLOT(east + 1, north); /*   I. Quadrant     */
         north += 1;
-        drawPointUnclipped(strokeColor, west - 1, south); /*   III. Quadrant   */
-        drawPointUnclipped(strokeColor, east + 1, south); /*   IV. Quadrant    */
+        PLOT(west - 1, south); /*   III. Quadrant   */
+        PLOT(east + 1, south); /*   IV. Quadrant    */
         south -= 1;
     }
+
+#undef PLOT
 }
 
-void w4_framebufferLine (int x1, int y1, int x2, int y2) {
-    uint8_t dc0 = drawColors[0] & 0xf;
-    if (dc0 == 0) {
-        return;
+// Oval drawing function using a variation on the midpoint algorithm.
+// TIC-80's ellipse drawing function used as reference.
+// https://github.com/nesbox/TIC-80/blob/main/src/core/draw.c
+//
+// Javatpoint has a in depth academic explanation that mostly went over my head:
+// https://www.javatpoint.com/computer-graphics-midpoint-ellipse-algorithm
+//
+// Draws the ellipse by "scanning" along the edge in one quadrant, and mirroring
+// the movement for the other four quadrants.
+//
+// There are a lot of details to get correct while implementing this algorithm,
+// so ensure the edge cases are covered when changing it. Long, thin ellipses
+// are particularly susceptible to being drawn incorrectly.
+void w4_framebufferOval (w4_Framebuffer* fb, int x, int y, int width, int height) {
+    // Every point of the scan stays within the bounding box, so ovals that are entirely on
+    // screen can skip the per-pixel clipping
+    if (width > 0 && height > 0 && x >= 0 && y >= 0 && x <= WIDTH - width && y <= HEIGHT - height) {
+        drawOval(fb, x, y, width, height, false);
+    } else {
+        drawOval(fb, x, y, width, height, true);
     }
-    uint8_t strokeColor = (dc0 - 1) & 0x3;
+}
+
+static int64_t floorDiv (int64_t a, int64_t b) {
+    return (a >= 0 ? a : a - b + 1) / b;
+}
 
+/**
+ * Steps through the part of a line that's on screen, drawing it into fb unless fb is NULL.
+ * Returns the number of pixels on screen.
+ */
+static ALWAYS_INLINE int64_t stepLine (w4_Framebuffer* fb, uint8_t strokeColor, int x1, int y1,
+        int x2, int y2) {
     if (y1 > y2) {
         int swap = x1;
         x1 = x2;
@@ -490,9 +956,67 @@ void w4_framebufferLine (int x1, int y1, int x2, int y2) {
     int dy = y2 - y1;
     int err = (dx > dy ? dx : -dy) / 2, e2;
 
-    for (;;) {
-        drawPointUnclipped(strokeColor, x1, y1);
-        if (x1 == x2 && y1 == y2) {
+    // Clip the line before stepping it, so the loop below doesn't need to bounds check.
+    //
+    // Every step of the loop moves one pixel along the major axis. After k steps, the number of
+    // steps m taken along the minor axis is ceil((k*minor - err0) / major), where err0 is
+    // major/2, and the error term is err0 - k*minor + m*major (negated for y-major lines). This
+    // makes both coordinates monotonic in k, so the visible part of the line is a range of k
+    // that can be found by solving for each screen edge, and the loop can start there with
+    // exactly the same state it would have reached by stepping.
+    bool xMajor = dx > dy;
+    int64_t major = xMajor ? dx : dy;
+    int64_t minor = xMajor ? dy : dx;
+    int64_t err0 = major / 2;
+
+    // Screen bounds as a range of steps along each axis
+    int64_t xLo = sx > 0 ? -(int64_t)x1 : (int64_t)x1 - (WIDTH - 1);
+    int64_t xHi = sx > 0 ? (int64_t)(WIDTH - 1) - x1 : x1;
+    int64_t yLo = -(int64_t)y1;
+    int64_t yHi = (int64_t)(HEIGHT - 1) - y1;
+    int64_t majorLo = xMajor ? xLo : yLo, majorHi = xMajor ? xHi : yHi;
+    int64_t minorLo = xMajor ? yLo : xLo, minorHi = xMajor ? yHi : xHi;
+
+    int64_t kStart = majorLo > 0 ? majorLo : 0;
+    int64_t kEnd = majorHi < major ? majorHi : major;
+    if (minor == 0) {
+        if (minorLo > 0 || minorHi < 0) {
+            return 0;
+        }
+    } else {
+        int64_t minorStart = floorDiv((minorLo - 1) * major + err0, minor) + 1;
+        int64_t minorEnd = floorDiv(minorHi * major + err0, minor);
+        if (minorStart > kStart) {
+            kStart = minorStart;
+        }
+        if (minorEnd < kEnd) {
+            kEnd = minorEnd;
+        }
+    }
+    if (kStart > kEnd) {
+        return 0;
+    }
+    if (!fb) {
+        return kEnd - kStart + 1;
+    }
+
+    if (kStart > 0) {
+        int64_t m = -floorDiv(err0 - kStart * minor, major);
+        int64_t e = err0 - kStart * minor + m * major;
+        if (xMajor) {
+            x1 += sx * kStart;
+            y1 += m;
+            err = e;
+        } else {
+            x1 += sx * m;
+            y1 += kStart;
+            err = -e;
+        }
+    }
+
+    for (int steps = kEnd - kStart; ; --steps) {
+        drawPoint(fb, strokeColor, x1, y1);
+        if (steps == 0) {
             break;
         }
         e2 = err;
@@ -505,16 +1029,28 @@ void w4_framebufferLine (int x1, int y1, int x2, int y2) {
             y1++;
         }
     }
+    return kEnd - kStart + 1;
+}
+
+uint64_t w4_framebufferLinePixels (int x1, int y1, int x2, int y2) {
+    return stepLine(NULL, 0, x1, y1, x2, y2);
+}
+
+void w4_framebufferLine (w4_Framebuffer* fb, int x1, int y1, int x2, int y2) {
+    uint8_t dc0 = fb->drawColors[0] & 0xf;
+    if (dc0 != 0) {
+        stepLine(fb, (dc0 - 1) & 0x3, x1, y1, x2, y2);
+    }
 }
 
-void w4_framebufferText (const uint8_t* str, int x, int y) {
+void w4_framebufferText (w4_Framebuffer* fb, const uint8_t* str, int x, int y) {
+    GlyphCache* cache = getGlyphCache(fb);
     for (int currentX = x; *str; ++str) {
         if (*str == 10) {
             y += 8;
             currentX = x;
         } else if (*str >= 32 && *str <= 255) {
-            w4_framebufferBlit(font, currentX, y, 8, 8, 0, (*str - 32) << 3, 8,
-                false, false, false, false);
+            drawGlyph(fb, cache, *str - 32, currentX, y);
             currentX += 8;
         } else {
             currentX += 8;
@@ -522,14 +1058,14 @@ void w4_framebufferText (const uint8_t* str, int x, int y) {
     }
 }
 
-void w4_framebufferTextUtf8 (const uint8_t* str, int byteLength, int x, int y) {
+void w4_framebufferTextUtf8 (w4_Framebuffer* fb, const uint8_t* str, int byteLength, int x, int y) {
+    GlyphCache* cache = getGlyphCache(fb);
     for (int currentX = x; byteLength > 0 && *str; ++str, --byteLength) {
         if (*str == 10) {
             y += 8;
             currentX = x;
         } else if (*str >= 32 && *str <= 255) {
-            w4_framebufferBlit(font, currentX, y, 8, 8, 0, (*str - 32) << 3, 8,
-                false, false, false, false);
+            drawGlyph(fb, cache, *str - 32, currentX, y);
             currentX += 8;
         } else {
             currentX += 8;
@@ -537,15 +1073,15 @@ void w4_framebufferTextUtf8 (const uint8_t* str, int byteLength, int x, int y) {
     }
 }
 
-void w4_framebufferTextUtf16 (const uint16_t* str, int byteLength, int x, int y) {
+void w4_framebufferTextUtf16 (w4_Framebuffer* fb, const uint16_t* str, int byteLength, int x, int y) {
+    GlyphCache* cache = getGlyphCache(fb);
     for (int currentX = x; byteLength > 0 && *str; ++str, byteLength -= 2) {
         uint16_t c = w4_read16LE(str);
         if (c == 10) {
             y += 8;
             currentX = x;
         } else if (c >= 32 && c <= 255) {
-            w4_framebufferBlit(font, currentX, y, 8, 8, 0, (c - 32) << 3, 8,
-                false, false, false, false);
+            drawGlyph(fb, cache, c - 32, currentX, y);
             currentX += 8;
         } else {
             currentX += 8;
@@ -553,15 +1089,14 @@ void w4_framebufferTextUtf16 (const uint16_t* str, int byteLength, int x, int y)
     }
 }
 
-void w4_framebufferBlit (const uint8_t* sprite, int dstX, int dstY, int width, int height,
+void w4_framebufferBlit (w4_Framebuffer* fb, const uint8_t* sprite, int dstX, int dstY, int width, int height,
     int srcX, int srcY, int srcStride, bool bpp2, bool flipX, bool flipY, bool rotate) {
 
-    uint16_t colors = drawColors[0] | (drawColors[1] << 8);
+    uint16_t colors = fb->drawColors[0] | (fb->drawColors[1] << 8);
 
     // Clip rectangle to screen
     int clipXMin, clipYMin, clipXMax, clipYMax;
     if (rotate) {
-        flipX = !flipX;
         clipXMin = w4_max(0, dstY) - dstY;
         clipYMin = w4_max(0, dstX) - dstX;
         clipXMax = w4_min(width, HEIGHT - dstY);
@@ -572,37 +1107,20 @@ void w4_framebufferBlit (const uint8_t* sprite, int dstX, int dstY, int width, i
         clipXMax = w4_min(width, WIDTH - dstX);
         clipYMax = w4_min(height, HEIGHT - dstY);
     }
+    if (clipXMin >= clipXMax || clipYMin >= clipYMax) {
+        return;
+    }
 
-    // Iterate pixels in rectangle
-    for (int y = clipYMin; y < clipYMax; y++) {
-        for (int x = clipXMin; x < clipXMax; x++) {
-            // Calculate sprite target coords
-            const int tx = dstX + (rotate ? y : x);
-            const int ty = dstY + (rotate ? x : y);
-
-            // Calculate sprite source coords
-            const int sx = srcX + (flipX ? width - x - 1 : x);
-            const int sy = srcY + (flipY ? height - y - 1 : y);
-
-            // Sample the sprite to get a color index
-            int colorIdx;
-            int bitIndex = sy * srcStride + sx;
-            if (bpp2) {
-                uint8_t byte = sprite[bitIndex >> 2];
-                int shift = 6 - ((bitIndex & 0x03) << 1);
-                colorIdx = (byte >> shift) & 0x3;
-
-            } else {
-                uint8_t byte = sprite[bitIndex >> 3];
-                int shift = 7 - (bitIndex & 0x07);
-                colorIdx = (byte >> shift) & 0x1;
-            }
+    updateBlitLut(fb, colors);
 
-            // Get the final color using the drawColors indirection
-            uint8_t dc = (colors >> (colorIdx << 2)) & 0x0f;
-            if (dc != 0) {
-                drawPoint((dc - 1) & 0x03, tx, ty);
-            }
-        }
-    }
+    BlitJob job = {
+        .fb = fb,
+        .sprite = sprite,
+        .dstX = dstX, .dstY = dstY,
+        .width = width, .height = height,
+        .srcX = srcX, .srcY = srcY, .srcStride = srcStride,
+        .clipXMin = clipXMin, .clipYMin = clipYMin,
+        .clipXMax = clipXMax, .clipYMax = clipYMax,
+    };
+    blitKernels[bpp2 | (flipX << 1) | (flipY << 2) | (rotate << 3)](&job);
 }
@@ -6,23 +6,34 @@
 #define WIDTH 160
 #define HEIGHT 160
 
-void w4_framebufferInit (const uint8_t* drawColors, uint8_t* framebuffer);
+/** Drawing state for one framebuffer, along with its lookup tables and glyph cache. */
+typedef struct w4_Framebuffer w4_Framebuffer;
 
-void w4_framebufferClear ();
+/** Creates drawing state that reads drawColors and draws into the given 2bpp pixels. */
+w4_Framebuffer* w4_framebufferCreate (const uint8_t* drawColors, uint8_t* pixels);
+void w4_framebufferDestroy (w4_Framebuffer* fb);
 
-void w4_framebufferHLine (int x, int y, int length);
+/** Changes where the draw colors are read from, used when replaying deferred draws. */
+void w4_framebufferSetDrawColors (w4_Framebuffer* fb, const uint8_t* drawColors);
 
-void w4_framebufferVLine (int x, int y, int length);
+void w4_framebufferClear (w4_Framebuffer* fb);
 
-void w4_framebufferRect (int x, int y, int width, int height);
+void w4_framebufferHLine (w4_Framebuffer* fb, int x, int y, int length);
 
-void w4_framebufferLine (int x1, int y1, int x2, int y2);
+void w4_framebufferVLine (w4_Framebuffer* fb, int x, int y, int length);
 
-void w4_framebufferOval (int x, int y, int width, int height);
+void w4_framebufferRect (w4_Framebuffer* fb, int x, int y, int width, int height);
 
-void w4_framebufferText (const uint8_t* str, int x, int y);
-void w4_framebufferTextUtf8 (const uint8_t* str, int byteLength, int x, int y);
-void w4_framebufferTextUtf16 (const uint16_t* str, int byteLength, int x, int y);
+void w4_framebufferLine (w4_Framebuffer* fb, int x1, int y1, int x2, int y2);
 
-void w4_framebufferBlit (const uint8_t* sprite, int dstX, int dstY, int width, int height,
+/** The number of pixels of a line that are on screen. */
+uint64_t w4_framebufferLinePixels (int x1, int y1, int x2, int y2);
+
+void w4_framebufferOval (w4_Framebuffer* fb, int x, int y, int width, int height);
+
+void w4_framebufferText (w4_Framebuffer* fb, const uint8_t* str, int x, int y);
+void w4_framebufferTextUtf8 (w4_Framebuffer* fb, const uint8_t* str, int byteLength, int x, int y);
+void w4_framebufferTextUtf16 (w4_Framebuffer* fb, const uint16_t* str, int byteLength, int x, int y);
+
+void w4_framebufferBlit (w4_Framebuffer* fb, const uint8_t* sprite, int dstX, int dstY, int width, int height,
     int srcX, int srcY, int srcStride, bool bpp2, bool flipX, bool flipY, bool rotate);
@@ -0,0 +1,79 @@
+#include "framebuffer_simd.h"
+
+#include <string.h>
+
+// The vector code is written with GCC/Clang vector extensions, which lower to SSE2/AVX2 on x86
+// and NEON on ARM. Other compilers and targets fall back to the scalar blit kernels.
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__)) && defined(__SSE2__)
+#define SIMD_X86
+#elif defined(__GNUC__) && defined(__ARM_NEON)
+#define SIMD_NEON
+#endif
+
+#if defined(SIMD_X86) || defined(SIMD_NEON)
+
+// Defines a merge routine for a given vector width. Each pass converts the indices to the
+// framebuffer's LSB-first pixel order, selects the color and opacity of every pixel with bitwise
+// masks, and blends the result into the framebuffer.
+#define DEFINE_MERGE_ROW(name, size, target) \
+    typedef uint8_t name##Vec __attribute__((vector_size(size))); \
+    \
+    target static inline name##Vec name##Pixels (name##Vec indices, name##Vec pixels, \
+            const w4_SimdPalette* palette) { \
+        name##Vec idx = (indices >> 6) | ((indices >> 2) & 0x0c) \
+            | ((indices << 2) & 0x30) | (indices << 6); \
+        name##Vec lo = idx & 0x55; \
+        name##Vec hi = (idx >> 1) & 0x55; \
+        name##Vec e0 = (lo | hi) ^ 0x55, e1 = lo & ~hi, e2 = hi & ~lo, e3 = lo & hi; \
+        e0 |= e0 << 1; \
+        e1 |= e1 << 1; \
+        e2 |= e2 << 1; \
+        e3 |= e3 << 1; \
+        name##Vec color = (e0 & palette->color[0]) | (e1 & palette->color[1]) \
+            | (e2 & palette->color[2]) | (e3 & palette->color[3]); \
+        name##Vec mask = (e0 & palette->opaque[0]) | (e1 & palette->opaque[1]) \
+            | (e2 & palette->opaque[2]) | (e3 & palette->opaque[3]); \
+        return (pixels & ~mask) | (color & mask); \
+    } \
+    \
+    target static void name (uint8_t* dst, const uint8_t* indices, int length, \
+            const w4_SimdPalette* palette) { \
+        name##Vec idx, pixels; \
+        int n = 0; \
+        for (; n + size <= length; n += size) { \
+            memcpy(&idx, indices + n, size); \
+            memcpy(&pixels, dst + n, size); \
+            pixels = name##Pixels(idx, pixels, palette); \
+            memcpy(dst + n, &pixels, size); \
+        } \
+        if (n < length) { \
+            memset(&idx, 0, size); \
+            memcpy(&idx, indices + n, length - n); \
+            memcpy(&pixels, dst + n, length - n); \
+            pixels = name##Pixels(idx, pixels, palette); \
+            memcpy(dst + n, &pixels, length - n); \
+        } \
+    }
+
+#endif
+
+#if defined(SIMD_X86)
+DEFINE_MERGE_ROW(mergeRowSse2, 16, )
+DEFINE_MERGE_ROW(mergeRowAvx2, 32, __attribute__((target("avx2"))))
+#elif defined(SIMD_NEON)
+DEFINE_MERGE_ROW(mergeRowNeon, 16, )
+#endif
+
+w4_SimdMergeRow w4_framebufferSimdInit () {
+#if defined(SIMD_X86)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        return mergeRowAvx2;
+    }
+    return mergeRowSse2;
+#elif defined(SIMD_NEON)
+    return mergeRowNeon;
+#else
+    return NULL;
+#endif
+}
@@ -0,0 +1,23 @@
+#pragma once
+
+#include <stdint.h>
+
+/** drawColors resolved for each 2-bit sprite color index. */
+typedef struct {
+    /** The framebuffer color, replicated into all 4 pixels of a byte. */
+    uint8_t color[4];
+
+    /** 0xff if the color index is opaque, 0 if it's transparent. */
+    uint8_t opaque[4];
+} w4_SimdPalette;
+
+/**
+ * Merges a row of sprite pixels into the framebuffer. Each byte of `indices` holds 4 packed
+ * 2-bit color indices, first pixel in the top bits, and maps to the framebuffer byte at the same
+ * offset in `dst`.
+ */
+typedef void (*w4_SimdMergeRow) (uint8_t* dst, const uint8_t* indices, int length,
+    const w4_SimdPalette* palette);
+
+/** Picks the widest merge routine supported by the running CPU, or NULL if there is none. */
+w4_SimdMergeRow w4_framebufferSimdInit ();
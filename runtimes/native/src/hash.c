@@ -0,0 +1,165 @@
+#include "hash.h"
+
+#include <string.h>
+
+// The vector code is written with GCC/Clang vector extensions, like framebuffer_simd.c. It assumes
+// a little-endian target, which all the ones enabled here are.
+#if defined(__GNUC__) && ((defined(__x86_64__) || defined(__i386__)) && defined(__SSE2__) \
+    || defined(__ARM_NEON))
+#define HASH_VECTOR
+#endif
+
+#define LANES 8
+#define STRIPE_SIZE (LANES*8)
+
+// Scramble the lanes after this many stripes, so that high bits get mixed back down
+#define STRIPES_PER_BLOCK 16
+
+#define PRIME32_1 0x9e3779b1ULL
+#define PRIME64_1 0x9e3779b185ebca87ULL
+#define PRIME64_2 0xc2b2ae3d27d4eb4fULL
+#define PRIME64_3 0x165667b19e3779f9ULL
+#define PRIME64_4 0x85ebca77c2b2ae63ULL
+
+static const uint64_t initial[LANES] = {
+    0x00000000c2b2ae3dULL, 0x9e3779b185ebca87ULL, 0xc2b2ae3d27d4eb4fULL, 0x165667b19e3779f9ULL,
+    0x85ebca77c2b2ae63ULL, 0x0000000085ebca77ULL, 0x27d4eb2f165667c5ULL, 0x000000009e3779b1ULL,
+};
+
+static const uint64_t keys[LANES] = {
+    0xbe4ba423396cfeb8ULL, 0x1cad21f72c81017cULL, 0xdb979083e96dd4deULL, 0x1f67b3b7a4a44072ULL,
+    0x78e5c0cc4ee679cbULL, 0x2172ffcc7dd05a82ULL, 0x8e2443f7744608b8ULL, 0x4c263a81e69035e0ULL,
+};
+
+static uint64_t rotl64 (uint64_t x, int bits) {
+    return (x << bits) | (x >> (64 - bits));
+}
+
+static uint64_t avalanche (uint64_t h) {
+    h ^= h >> 33;
+    h *= PRIME64_2;
+    h ^= h >> 29;
+    h *= PRIME64_3;
+    h ^= h >> 32;
+    return h;
+}
+
+#if defined(HASH_VECTOR)
+
+// Two lanes per vector, so that the 32x32->64 bit multiply maps to a single instruction
+typedef uint64_t Lanes __attribute__((vector_size(16)));
+
+#if defined(__ARM_NEON)
+#include <arm_neon.h>
+
+static inline Lanes multiplyHalves (Lanes x) {
+    return (Lanes)vmull_u32(vmovn_u64((uint64x2_t)x), vshrn_n_u64((uint64x2_t)x, 32));
+}
+#else
+#include <emmintrin.h>
+
+static inline Lanes multiplyHalves (Lanes x) {
+    return (Lanes)_mm_mul_epu32((__m128i)x, _mm_srli_epi64((__m128i)x, 32));
+}
+#endif
+
+static inline Lanes mix (Lanes acc, const uint8_t* data, Lanes key) {
+    Lanes in;
+    memcpy(&in, data, sizeof(in));
+    return acc + in + multiplyHalves(in ^ key);
+}
+
+static inline Lanes scramble (Lanes acc, Lanes key) {
+    return (acc ^ (acc >> 47) ^ key) * PRIME32_1;
+}
+
+/** Consumes whole stripes into the lanes. */
+static void accumulate (uint64_t* acc, const uint8_t* data, size_t stripes, size_t* stripeIdx) {
+    // Spelled out so the lanes stay in registers
+    Lanes acc0, acc1, acc2, acc3, key0, key1, key2, key3;
+    memcpy(&acc0, &acc[0], sizeof(Lanes));
+    memcpy(&acc1, &acc[2], sizeof(Lanes));
+    memcpy(&acc2, &acc[4], sizeof(Lanes));
+    memcpy(&acc3, &acc[6], sizeof(Lanes));
+    memcpy(&key0, &keys[0], sizeof(Lanes));
+    memcpy(&key1, &keys[2], sizeof(Lanes));
+    memcpy(&key2, &keys[4], sizeof(Lanes));
+    memcpy(&key3, &keys[6], sizeof(Lanes));
+
+    size_t idx = *stripeIdx;
+    for (size_t n = 0; n < stripes; ++n, data += STRIPE_SIZE) {
+        acc0 = mix(acc0, &data[0], key0);
+        acc1 = mix(acc1, &data[16], key1);
+        acc2 = mix(acc2, &data[32], key2);
+        acc3 = mix(acc3, &data[48], key3);
+
+        if (++idx % STRIPES_PER_BLOCK == 0) {
+            acc0 = scramble(acc0, key0);
+            acc1 = scramble(acc1, key1);
+            acc2 = scramble(acc2, key2);
+            acc3 = scramble(acc3, key3);
+        }
+    }
+
+    memcpy(&acc[0], &acc0, sizeof(Lanes));
+    memcpy(&acc[2], &acc1, sizeof(Lanes));
+    memcpy(&acc[4], &acc2, sizeof(Lanes));
+    memcpy(&acc[6], &acc3, sizeof(Lanes));
+    *stripeIdx = idx;
+}
+
+#else
+
+static uint64_t read64 (const uint8_t* in) {
+    return (uint64_t)in[0] | (uint64_t)in[1] << 8 | (uint64_t)in[2] << 16 | (uint64_t)in[3] << 24
+        | (uint64_t)in[4] << 32 | (uint64_t)in[5] << 40 | (uint64_t)in[6] << 48
+        | (uint64_t)in[7] << 56;
+}
+
+static void accumulate (uint64_t* acc, const uint8_t* data, size_t stripes, size_t* stripeIdx) {
+    size_t idx = *stripeIdx;
+    for (size_t n = 0; n < stripes; ++n, data += STRIPE_SIZE) {
+        for (int lane = 0; lane < LANES; ++lane) {
+            uint64_t in = read64(&data[8*lane]);
+            uint64_t mixed = in ^ keys[lane];
+            acc[lane] += in + (mixed & 0xffffffff) * (mixed >> 32);
+        }
+
+        if (++idx % STRIPES_PER_BLOCK == 0) {
+            for (int lane = 0; lane < LANES; ++lane) {
+                acc[lane] = (acc[lane] ^ (acc[lane] >> 47) ^ keys[lane]) * PRIME32_1;
+            }
+        }
+    }
+    *stripeIdx = idx;
+}
+
+#endif
+
+uint64_t w4_hash (const void* data, size_t length, uint64_t seed) {
+    const uint8_t* in = data;
+    size_t stripeIdx = 0;
+
+    uint64_t acc[LANES];
+    for (int lane = 0; lane < LANES; ++lane) {
+        acc[lane] = initial[lane] + seed;
+    }
+
+    size_t stripes = length / STRIPE_SIZE;
+    accumulate(acc, in, stripes, &stripeIdx);
+
+    // Pad out the last partial stripe with zeroes, the length is mixed in below
+    size_t remaining = length % STRIPE_SIZE;
+    if (remaining) {
+        uint8_t last[STRIPE_SIZE] = {0};
+        memcpy(last, &in[stripes*STRIPE_SIZE], remaining);
+        accumulate(acc, last, 1, &stripeIdx);
+    }
+
+    uint64_t h = seed ^ (length * PRIME64_1);
+    for (int lane = 0; lane < LANES; ++lane) {
+        h ^= avalanche(acc[lane]);
+        h = rotl64(h, 27) * PRIME64_1 + PRIME64_4;
+    }
+    return avalanche(h);
+}
@@ -0,0 +1,13 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+// A fast non-cryptographic 64-bit hash, used to compare the state of instances that should be in
+// sync. Data is consumed in 64 byte stripes by 8 independent 64-bit lanes, which vectorize well.
+//
+// The result only depends on the bytes hashed, never on the platform or on whether the vector
+// code was used, so hashes can be compared across machines.
+
+/** Hashes a buffer. Hashes can be chained by passing the previous result as the seed. */
+uint64_t w4_hash (const void* data, size_t length, uint64_t seed);
@@ -0,0 +1,41 @@
+#include "instance.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "trace.h"
+#include "util.h"
+#include "wasm.h"
+
+w4_Instance* w4_instanceCreate () {
+    w4_Instance* instance = xmalloc(sizeof(w4_Instance));
+    memset(instance, 0, sizeof(w4_Instance));
+#if defined(W4_TRACE)
+    // Instances are only created from the main thread
+    static int traceIds = 0;
+    instance->traceId = ++traceIds;
+#endif
+    return instance;
+}
+
+void w4_instanceDestroy (w4_Instance* instance) {
+#if defined(W4_TRACE)
+    w4_traceDestroy(instance);
+#endif
+    if (instance->dirty) {
+        w4_dirtyDestroy(instance->dirty);
+    }
+    if (instance->drawList) {
+        w4_drawListDestroy(instance->drawList);
+    }
+    if (instance->apu) {
+        w4_apuDestroy(instance->apu);
+    }
+    if (instance->framebuffer) {
+        w4_framebufferDestroy(instance->framebuffer);
+    }
+    if (instance->wasm) {
+        w4_wasmDestroy(instance);
+    }
+    free(instance);
+}
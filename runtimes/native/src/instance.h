@@ -0,0 +1,70 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "apu.h"
+#include "dirty.h"
+#include "drawlist.h"
+#include "framebuffer.h"
+#include "profile.h"
+#include "runtime.h"
+
+#pragma pack(1)
+typedef struct {
+    uint8_t _padding[4];
+    uint32_t palette[4];
+    uint8_t drawColors[2];
+    uint8_t gamepads[4];
+    int16_t mouseX;
+    int16_t mouseY;
+    uint8_t mouseButtons;
+    uint8_t systemFlags;
+    uint8_t netplay;
+    uint8_t _reserved[127];
+    uint8_t framebuffer[WIDTH*HEIGHT>>2];
+    uint8_t _user[58976];
+} w4_Memory;
+#pragma pack()
+
+/** State owned by the wasm backend, defined by each backend. */
+typedef struct w4_Wasm w4_Wasm;
+
+/**
+ * Everything belonging to one running cart. Instances share no state, so any number of them can
+ * be hosted in one process, each driven from its own thread.
+ */
+struct w4_Instance {
+    w4_Memory* memory;
+    w4_Disk* disk;
+    bool firstFrame;
+
+    w4_Framebuffer* framebuffer;
+    w4_Apu* apu;
+
+    /** Pending draws while deferred drawing is enabled, otherwise NULL. */
+    w4_DrawList* drawList;
+
+    /** Change tracking for incremental save states, created on first use. */
+    w4_Dirty* dirty;
+
+    /** Whether host functions and the cart are timed, see w4_runtimeSetProfiling. */
+    bool profiling;
+
+    /** Totals over every finished frame, the last finished frame, and the frame being run. */
+    w4_Profile profile;
+    w4_Profile lastFrameProfile;
+    w4_Profile frameProfile;
+
+#if defined(W4_TRACE)
+    /** Trace events not yet written out, see trace.h. */
+    char* traceBuffer;
+    size_t traceLength;
+
+    /** The thread this instance is shown as in the trace. */
+    int traceId;
+#endif
+
+    w4_Wasm* wasm;
+};
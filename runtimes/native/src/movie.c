@@ -0,0 +1,314 @@
+#include "movie.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "rle.h"
+#include "util.h"
+
+#define VERSION 1
+#define HEADER_SIZE 24
+
+// 4 gamepads, mouse x and y, mouse buttons
+#define INPUT_SIZE 9
+
+#define MAX_RUN 65536
+
+struct w4_Movie {
+    int keyframeInterval;
+
+    /** INPUT_SIZE bytes for each frame. */
+    uint8_t* inputs;
+    uint32_t frameCount;
+    uint32_t frameCapacity;
+
+    /** The frame to play or record next. */
+    uint32_t frame;
+
+    /** Whether the instance was left at the start of that frame, so seeking can continue from it. */
+    bool synced;
+
+    /** Compressed keyframes back to back, keyframe n is the state at the start of frame n*interval. */
+    uint8_t* keyframes;
+    size_t keyframesSize;
+    size_t keyframesCapacity;
+
+    /** Where each keyframe starts in keyframes. */
+    size_t* keyframeOffsets;
+    uint32_t keyframeCount;
+    uint32_t keyframeCapacity;
+
+    int stateSize;
+
+    /** Scratch space for serializing and compressing states. */
+    uint8_t* state;
+    uint8_t* compressed;
+};
+
+static size_t keyframeSize (const w4_Movie* movie, uint32_t idx) {
+    size_t end = idx+1 < movie->keyframeCount ? movie->keyframeOffsets[idx+1] : movie->keyframesSize;
+    return end - movie->keyframeOffsets[idx];
+}
+
+static uint32_t keyframeFrame (const w4_Movie* movie, uint32_t idx) {
+    return idx * movie->keyframeInterval;
+}
+
+static void addKeyframe (w4_Movie* movie, const uint8_t* data, size_t size) {
+    if (movie->keyframeCount == movie->keyframeCapacity) {
+        movie->keyframeCapacity = movie->keyframeCapacity ? 2*movie->keyframeCapacity : 64;
+        movie->keyframeOffsets = xrealloc(movie->keyframeOffsets,
+            movie->keyframeCapacity * sizeof(size_t));
+    }
+    if (movie->keyframesSize + size > movie->keyframesCapacity) {
+        size_t capacity = movie->keyframesCapacity ? movie->keyframesCapacity : (1 << 20);
+        while (movie->keyframesSize + size > capacity) {
+            capacity *= 2;
+        }
+        movie->keyframes = xrealloc(movie->keyframes, capacity);
+        movie->keyframesCapacity = capacity;
+    }
+
+    movie->keyframeOffsets[movie->keyframeCount++] = movie->keyframesSize;
+    memcpy(&movie->keyframes[movie->keyframesSize], data, size);
+    movie->keyframesSize += size;
+}
+
+static void addFrame (w4_Movie* movie, const uint8_t* input) {
+    if (movie->frameCount == movie->frameCapacity) {
+        movie->frameCapacity = movie->frameCapacity ? 2*movie->frameCapacity : 3600;
+        movie->inputs = xrealloc(movie->inputs, (size_t)movie->frameCapacity * INPUT_SIZE);
+    }
+    memcpy(&movie->inputs[(size_t)movie->frameCount * INPUT_SIZE], input, INPUT_SIZE);
+    ++movie->frameCount;
+}
+
+w4_Movie* w4_movieCreate (int keyframeInterval) {
+    w4_Movie* movie = xmalloc(sizeof(w4_Movie));
+    memset(movie, 0, sizeof(w4_Movie));
+
+    // An interval of 0 keeps only the keyframe at the start
+    movie->keyframeInterval = keyframeInterval > 0 ? keyframeInterval : 0;
+
+    movie->stateSize = w4_runtimeSerializeSize();
+    movie->state = xmalloc(movie->stateSize);
+    movie->compressed = xmalloc(w4_rleCompressBound(movie->stateSize));
+    return movie;
+}
+
+void w4_movieDestroy (w4_Movie* movie) {
+    free(movie->compressed);
+    free(movie->state);
+    free(movie->keyframeOffsets);
+    free(movie->keyframes);
+    free(movie->inputs);
+    free(movie);
+}
+
+uint32_t w4_movieFrameCount (const w4_Movie* movie) {
+    return movie->frameCount;
+}
+
+uint32_t w4_movieFrame (const w4_Movie* movie) {
+    return movie->frame;
+}
+
+void w4_movieRecord (w4_Movie* movie, w4_Instance* instance) {
+    // Drop everything after the current frame, including its keyframe which is captured again
+    movie->frameCount = movie->frame;
+    uint32_t keep = movie->keyframeInterval
+        ? (movie->frame + movie->keyframeInterval - 1) / movie->keyframeInterval
+        : (movie->frame > 0);
+    if (keep < movie->keyframeCount) {
+        movie->keyframesSize = movie->keyframeOffsets[keep];
+        movie->keyframeCount = keep;
+    }
+
+    if (keyframeFrame(movie, movie->keyframeCount) == movie->frame
+            && (movie->keyframeInterval || movie->keyframeCount == 0)) {
+        w4_runtimeSerialize(instance, movie->state);
+        addKeyframe(movie, movie->compressed,
+            w4_rleCompress(movie->state, movie->stateSize, movie->compressed));
+    }
+
+    uint8_t input[INPUT_SIZE];
+    for (int idx = 0; idx < 4; ++idx) {
+        input[idx] = w4_runtimeGetGamepad(instance, idx);
+    }
+    int16_t mouseX, mouseY;
+    w4_runtimeGetMouse(instance, &mouseX, &mouseY, &input[8]);
+    w4_write16LE(&input[4], mouseX);
+    w4_write16LE(&input[6], mouseY);
+    addFrame(movie, input);
+
+    movie->frame = movie->frameCount;
+    movie->synced = true;
+}
+
+bool w4_moviePlay (w4_Movie* movie, w4_Instance* instance) {
+    if (movie->frame >= movie->frameCount) {
+        return false;
+    }
+    const uint8_t* input = &movie->inputs[(size_t)movie->frame * INPUT_SIZE];
+    for (int idx = 0; idx < 4; ++idx) {
+        w4_runtimeSetGamepad(instance, idx, input[idx]);
+    }
+    w4_runtimeSetMouse(instance, w4_read16LE(&input[4]), w4_read16LE(&input[6]), input[8]);
+    ++movie->frame;
+    return true;
+}
+
+bool w4_movieSeek (w4_Movie* movie, w4_Instance* instance, uint32_t frame) {
+    if (frame > movie->frameCount || movie->keyframeCount == 0) {
+        return false;
+    }
+
+    uint32_t idx = movie->keyframeInterval ? frame / movie->keyframeInterval : 0;
+    if (idx >= movie->keyframeCount) {
+        idx = movie->keyframeCount - 1;
+    }
+
+    // Already between that keyframe and the target, it's faster to keep going from here
+    bool resume = movie->synced && movie->frame <= frame
+        && movie->frame > keyframeFrame(movie, idx);
+    if (!resume) {
+        if (!w4_rleDecompress(&movie->keyframes[movie->keyframeOffsets[idx]],
+                keyframeSize(movie, idx), movie->state, movie->stateSize, false)) {
+            return false;
+        }
+        if (!w4_runtimeUnserialize(instance, movie->state)) {
+            return false;
+        }
+        movie->frame = keyframeFrame(movie, idx);
+    }
+
+    while (movie->frame < frame) {
+        w4_moviePlay(movie, instance);
+        w4_runtimeStep(instance);
+    }
+    movie->synced = true;
+    return true;
+}
+
+bool w4_movieSave (const w4_Movie* movie, const char* path) {
+    FILE* file = fopen(path, "wb");
+    if (file == NULL) {
+        fprintf(stderr, "Error opening %s\n", path);
+        return false;
+    }
+
+    uint8_t header[HEADER_SIZE] = { 'W', '4', 'M', 'V', VERSION };
+    w4_write32LE(&header[8], movie->frameCount);
+    w4_write32LE(&header[12], movie->keyframeInterval);
+    w4_write32LE(&header[16], movie->keyframeCount);
+    w4_write32LE(&header[20], movie->stateSize);
+    fwrite(header, 1, sizeof(header), file);
+
+    for (uint32_t idx = 0; idx < movie->keyframeCount; ++idx) {
+        uint8_t size[4];
+        w4_write32LE(size, keyframeSize(movie, idx));
+        fwrite(size, 1, sizeof(size), file);
+    }
+
+    for (uint32_t frame = 0; frame < movie->frameCount; ) {
+        const uint8_t* input = &movie->inputs[(size_t)frame * INPUT_SIZE];
+        uint32_t run = 1;
+        while (frame + run < movie->frameCount && run < MAX_RUN
+                && !memcmp(&movie->inputs[(size_t)(frame + run) * INPUT_SIZE], input, INPUT_SIZE)) {
+            ++run;
+        }
+        uint8_t record[2 + INPUT_SIZE];
+        w4_write16LE(record, run - 1);
+        memcpy(&record[2], input, INPUT_SIZE);
+        fwrite(record, 1, sizeof(record), file);
+        frame += run;
+    }
+
+    fwrite(movie->keyframes, 1, movie->keyframesSize, file);
+
+    bool ok = !ferror(file);
+    if (fclose(file) != 0 || !ok) {
+        fprintf(stderr, "Error writing %s\n", path);
+        return false;
+    }
+    return true;
+}
+
+static w4_Movie* invalid (w4_Movie* movie, uint8_t* bytes, const char* path) {
+    fprintf(stderr, "%s is not a valid movie for this runtime\n", path);
+    if (movie) {
+        w4_movieDestroy(movie);
+    }
+    free(bytes);
+    return NULL;
+}
+
+w4_Movie* w4_movieLoad (const char* path) {
+    FILE* file = fopen(path, "rb");
+    if (file == NULL) {
+        fprintf(stderr, "Error opening %s\n", path);
+        return NULL;
+    }
+    fseek(file, 0, SEEK_END);
+    long length = ftell(file);
+    fseek(file, 0, SEEK_SET);
+    uint8_t* bytes = xmalloc(length > 0 ? length : 1);
+    size_t size = fread(bytes, 1, length > 0 ? length : 0, file);
+    fclose(file);
+
+    if (size < HEADER_SIZE || memcmp(bytes, "W4MV", 4) || bytes[4] != VERSION) {
+        return invalid(NULL, bytes, path);
+    }
+    uint32_t frameCount = w4_read32LE(&bytes[8]);
+    uint32_t keyframeInterval = w4_read32LE(&bytes[12]);
+    uint32_t keyframeCount = w4_read32LE(&bytes[16]);
+    uint32_t stateSize = w4_read32LE(&bytes[20]);
+
+    if (keyframeInterval > INT32_MAX) {
+        return invalid(NULL, bytes, path);
+    }
+
+    // A keyframe was recorded at every multiple of the interval, or only at the start
+    uint32_t expectedKeyframes = keyframeInterval
+        ? frameCount / keyframeInterval + (frameCount % keyframeInterval != 0)
+        : frameCount > 0;
+    w4_Movie* movie = w4_movieCreate(keyframeInterval);
+    if (stateSize != (uint32_t)movie->stateSize || keyframeCount == 0
+            || keyframeCount != expectedKeyframes || keyframeCount > (size - HEADER_SIZE) / 4) {
+        return invalid(movie, bytes, path);
+    }
+
+    const uint8_t* in = &bytes[HEADER_SIZE];
+    const uint8_t* end = &bytes[size];
+    const uint8_t* sizes = in;
+    in += 4 * keyframeCount;
+
+    while (movie->frameCount < frameCount) {
+        if (end - in < 2 + INPUT_SIZE) {
+            return invalid(movie, bytes, path);
+        }
+        uint32_t run = w4_read16LE(in) + 1;
+        if (run > frameCount - movie->frameCount) {
+            return invalid(movie, bytes, path);
+        }
+        for (uint32_t n = 0; n < run; ++n) {
+            addFrame(movie, &in[2]);
+        }
+        in += 2 + INPUT_SIZE;
+    }
+
+    for (uint32_t idx = 0; idx < keyframeCount; ++idx) {
+        uint32_t keyframeSize = w4_read32LE(&sizes[4*idx]);
+        // Seeking trusts keyframes to decompress to a whole state, so check them all up front
+        if ((size_t)(end - in) < keyframeSize
+                || !w4_rleDecompress(in, keyframeSize, movie->state, movie->stateSize, false)) {
+            return invalid(movie, bytes, path);
+        }
+        addKeyframe(movie, in, keyframeSize);
+        in += keyframeSize;
+    }
+
+    free(bytes);
+    return movie;
+}
@@ -0,0 +1,54 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "runtime.h"
+
+// Input movies. A movie is the gamepad and mouse input of every frame, starting from a snapshot
+// of the instance, so playing it back reproduces the run exactly. A snapshot is also stored every
+// few frames as a keyframe, so seeking only needs to simulate the frames since the nearest one.
+//
+// On disk, all little-endian:
+//   header:    "W4MV", version (u8), 3 reserved bytes, frame count (u32), keyframe interval (u32),
+//              keyframe count (u32), serialized state size (u32)
+//   index:     the compressed size of each keyframe (u32)
+//   inputs:    runs of identical frames, as the run length minus one (u16) followed by the 4
+//              gamepads, mouse x and y (i16) and mouse buttons
+//   keyframes: each a w4_runtimeSerialize state compressed with w4_rleCompress
+
+#define W4_MOVIE_DEFAULT_KEYFRAME_INTERVAL 300
+
+typedef struct w4_Movie w4_Movie;
+
+/** Creates an empty movie, with a keyframe every keyframeInterval frames, or only at the start. */
+w4_Movie* w4_movieCreate (int keyframeInterval);
+
+/** Loads a movie written by w4_movieSave. Returns NULL and prints an error on failure. */
+w4_Movie* w4_movieLoad (const char* path);
+
+bool w4_movieSave (const w4_Movie* movie, const char* path);
+void w4_movieDestroy (w4_Movie* movie);
+
+uint32_t w4_movieFrameCount (const w4_Movie* movie);
+
+/** The frame that w4_moviePlay or w4_movieRecord will handle next. */
+uint32_t w4_movieFrame (const w4_Movie* movie);
+
+/**
+ * Records the input the instance is about to run a frame with, so call it right before
+ * w4_runtimeUpdate. Any frames after the current one are dropped first, which allows recording
+ * over the rest of a movie that was played back part way.
+ */
+void w4_movieRecord (w4_Movie* movie, w4_Instance* instance);
+
+/** Sets the input for the next frame of playback. Returns false at the end of the movie. */
+bool w4_moviePlay (w4_Movie* movie, w4_Instance* instance);
+
+/**
+ * Moves playback to a frame, by restoring the nearest keyframe before it and simulating the frames
+ * in between without compositing. Seeking to frame 0 restores the state the movie started from.
+ * Returns false if the frame is past the end of the movie, or its keyframe is corrupt or can't be
+ * restored.
+ */
+bool w4_movieSeek (w4_Movie* movie, w4_Instance* instance, uint32_t frame);
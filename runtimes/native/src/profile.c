@@ -0,0 +1,68 @@
+#include "profile.h"
+
+static const char* names[W4_HOST_FUNCTIONS] = {
+    "blit",
+    "blitSub",
+    "line",
+    "hline",
+    "vline",
+    "oval",
+    "rect",
+    "text",
+    "textUtf8",
+    "textUtf16",
+    "tone",
+    "diskr",
+    "diskw",
+    "trace",
+    "traceUtf8",
+    "traceUtf16",
+    "tracef",
+};
+
+const char* w4_hostFunctionName (w4_HostFunction function) {
+    return names[function];
+}
+
+void w4_profileAdd (w4_Profile* dest, const w4_Profile* src) {
+    dest->frames += src->frames;
+    dest->cartNanos += src->cartNanos;
+    for (int n = 0; n < W4_HOST_FUNCTIONS; ++n) {
+        dest->host[n].calls += src->host[n].calls;
+        dest->host[n].nanos += src->host[n].nanos;
+        dest->host[n].pixels += src->host[n].pixels;
+        dest->host[n].bytes += src->host[n].bytes;
+    }
+}
+
+void w4_profilePrint (FILE* out, const w4_Profile* profile) {
+    uint64_t calls = 0;
+    uint64_t hostNanos = 0;
+    for (int n = 0; n < W4_HOST_FUNCTIONS; ++n) {
+        calls += profile->host[n].calls;
+        hostNanos += profile->host[n].nanos;
+    }
+    double frames = profile->frames > 0 ? profile->frames : 1;
+    double cartNanos = profile->cartNanos > 0 ? profile->cartNanos : 1;
+    double wasmNanos = (double)profile->cartNanos - hostNanos;
+
+    fprintf(out, "frames: %llu\n", (unsigned long long)profile->frames);
+    fprintf(out, "cart: %.3f ms, %.1f us/frame\n", profile->cartNanos / 1e6,
+        profile->cartNanos / 1e3 / frames);
+    fprintf(out, "  host functions: %.3f ms (%.1f%%), %llu calls\n", hostNanos / 1e6,
+        100 * hostNanos / cartNanos, (unsigned long long)calls);
+    // Includes the cost of calling from wasm into the host and back
+    fprintf(out, "  wasm: %.3f ms (%.1f%%)\n", wasmNanos / 1e6, 100 * wasmNanos / cartNanos);
+
+    fprintf(out, "%-12s %12s %11s %10s %8s %14s %12s\n",
+        "function", "calls", "calls/frame", "ms", "ns/call", "pixels", "bytes");
+    for (int n = 0; n < W4_HOST_FUNCTIONS; ++n) {
+        const w4_HostStats* stats = &profile->host[n];
+        if (stats->calls > 0) {
+            fprintf(out, "%-12s %12llu %11.1f %10.3f %8.0f %14llu %12llu\n", names[n],
+                (unsigned long long)stats->calls, stats->calls / frames, stats->nanos / 1e6,
+                (double)stats->nanos / stats->calls, (unsigned long long)stats->pixels,
+                (unsigned long long)stats->bytes);
+        }
+    }
+}
@@ -0,0 +1,65 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdio.h>
+
+/** The functions a cart can import, in the order they're reported. */
+typedef enum {
+    W4_HOST_BLIT,
+    W4_HOST_BLIT_SUB,
+    W4_HOST_LINE,
+    W4_HOST_HLINE,
+    W4_HOST_VLINE,
+    W4_HOST_OVAL,
+    W4_HOST_RECT,
+    W4_HOST_TEXT,
+    W4_HOST_TEXT_UTF8,
+    W4_HOST_TEXT_UTF16,
+    W4_HOST_TONE,
+    W4_HOST_DISKR,
+    W4_HOST_DISKW,
+    W4_HOST_TRACE,
+    W4_HOST_TRACE_UTF8,
+    W4_HOST_TRACE_UTF16,
+    W4_HOST_TRACEF,
+    W4_HOST_FUNCTIONS,
+} w4_HostFunction;
+
+typedef struct {
+    uint64_t calls;
+
+    /** Time spent in the function, only measured while profiling is enabled. */
+    uint64_t nanos;
+
+    /**
+     * Pixels drawn, clipped to the screen. Ovals count their bounding box, and text isn't
+     * clipped.
+     */
+    uint64_t pixels;
+
+    /** Bytes read from cart memory: sprites, strings and disk writes. */
+    uint64_t bytes;
+} w4_HostStats;
+
+/** Where a cart's frames spend their time. See w4_runtimeProfile. */
+typedef struct {
+    uint64_t frames;
+
+    /**
+     * Time spent running the cart's start and update, host functions included, only measured
+     * while profiling is enabled. Whatever wasn't spent in host functions went to running wasm and
+     * calling out of it.
+     */
+    uint64_t cartNanos;
+
+    w4_HostStats host[W4_HOST_FUNCTIONS];
+} w4_Profile;
+
+/** The name a cart imports a function by. */
+const char* w4_hostFunctionName (w4_HostFunction function);
+
+/** Adds the counts of one profile to another, for totalling frames or instances. */
+void w4_profileAdd (w4_Profile* dest, const w4_Profile* src);
+
+/** Prints a table of the functions called, and how the cart's time was split. */
+void w4_profilePrint (FILE* out, const w4_Profile* profile);
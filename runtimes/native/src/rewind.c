@@ -0,0 +1,269 @@
+#include "rewind.h"
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "dirty.h"
+#include "rle.h"
+#include "util.h"
+
+typedef struct {
+    size_t offset;
+    size_t size;
+    bool keyframe;
+} Entry;
+
+struct w4_Rewind {
+    int keyframeInterval;
+
+    uint8_t* ring;
+    size_t ringSize;
+
+    /** Circular queue of the stored snapshots, oldest first. The oldest is always a keyframe. */
+    Entry* entries;
+    int entryCapacity;
+    int entryFirst;
+    int entryCount;
+    int keyframeCount;
+
+    int stateSize;
+
+    /** The last serialized state, and its version for incremental serialization, or 0. */
+    uint8_t* state;
+    uint32_t stateVersion;
+
+    /** Scratch space for the XOR of the state against the keyframe, and compressed snapshots. */
+    uint8_t* delta;
+    uint8_t* compressed;
+
+    /** The uncompressed newest keyframe, that new deltas are taken against. */
+    uint8_t* keyframe;
+    bool keyframeLoaded;
+
+    /**
+     * The version the keyframe was captured at, or 0 if it was loaded back from the ring. While
+     * set, delta only needs updating for the blocks of memory that changed since.
+     */
+    uint32_t keyframeVersion;
+
+    /** The number of deltas stored after the newest keyframe. */
+    int sinceKeyframe;
+};
+
+static Entry* entryAt (const w4_Rewind* rewind, int idx) {
+    return &rewind->entries[(rewind->entryFirst + idx) % rewind->entryCapacity];
+}
+
+static void pushEntry (w4_Rewind* rewind, size_t offset, size_t size, bool keyframe) {
+    if (rewind->entryCount == rewind->entryCapacity) {
+        int capacity = rewind->entryCapacity ? 2*rewind->entryCapacity : 256;
+        Entry* entries = xmalloc(capacity * sizeof(Entry));
+        for (int n = 0; n < rewind->entryCount; ++n) {
+            entries[n] = *entryAt(rewind, n);
+        }
+        free(rewind->entries);
+        rewind->entries = entries;
+        rewind->entryCapacity = capacity;
+        rewind->entryFirst = 0;
+    }
+
+    Entry* entry = entryAt(rewind, rewind->entryCount++);
+    entry->offset = offset;
+    entry->size = size;
+    entry->keyframe = keyframe;
+    if (keyframe) {
+        ++rewind->keyframeCount;
+    }
+}
+
+/** Drops the oldest keyframe along with the deltas that depend on it. */
+static void evictOldest (w4_Rewind* rewind) {
+    do {
+        if (entryAt(rewind, 0)->keyframe) {
+            --rewind->keyframeCount;
+        }
+        rewind->entryFirst = (rewind->entryFirst + 1) % rewind->entryCapacity;
+        --rewind->entryCount;
+    } while (rewind->entryCount > 0 && !entryAt(rewind, 0)->keyframe);
+}
+
+/**
+ * Finds room in the ring for a snapshot of the given size, evicting old snapshots as needed.
+ * Fails if a delta can only fit by evicting its own keyframe.
+ */
+static bool reserve (w4_Rewind* rewind, size_t size, bool keyframe, size_t* offset) {
+    if (size > rewind->ringSize) {
+        return false;
+    }
+    for (;;) {
+        if (rewind->entryCount == 0) {
+            *offset = 0;
+            return true;
+        }
+
+        const Entry* oldest = entryAt(rewind, 0);
+        const Entry* newest = entryAt(rewind, rewind->entryCount - 1);
+        size_t head = newest->offset + newest->size;
+        if (oldest->offset <= newest->offset) {
+            // The stored snapshots are one contiguous range, try after it and then wrap around
+            if (head + size <= rewind->ringSize) {
+                *offset = head;
+                return true;
+            }
+            if (size <= oldest->offset) {
+                *offset = 0;
+                return true;
+            }
+        } else if (head + size <= oldest->offset) {
+            *offset = head;
+            return true;
+        }
+
+        if (!keyframe && rewind->keyframeCount <= 1) {
+            return false;
+        }
+        evictOldest(rewind);
+    }
+}
+
+/** Decompresses the newest stored keyframe, if it isn't already. */
+static void loadKeyframe (w4_Rewind* rewind) {
+    if (rewind->keyframeLoaded) {
+        return;
+    }
+    for (int n = rewind->entryCount - 1; n >= 0; --n) {
+        const Entry* entry = entryAt(rewind, n);
+        if (entry->keyframe) {
+            w4_rleDecompress(&rewind->ring[entry->offset], entry->size, rewind->keyframe,
+                rewind->stateSize, false);
+            rewind->keyframeLoaded = true;
+            rewind->keyframeVersion = 0;
+            rewind->sinceKeyframe = rewind->entryCount - 1 - n;
+            return;
+        }
+    }
+}
+
+static bool store (w4_Rewind* rewind, size_t size, bool keyframe) {
+    size_t offset;
+    if (!reserve(rewind, size, keyframe, &offset)) {
+        return false;
+    }
+    memcpy(&rewind->ring[offset], rewind->compressed, size);
+    pushEntry(rewind, offset, size, keyframe);
+    return true;
+}
+
+w4_Rewind* w4_rewindCreate (size_t budget, int keyframeInterval) {
+    w4_Rewind* rewind = xmalloc(sizeof(w4_Rewind));
+    memset(rewind, 0, sizeof(w4_Rewind));
+
+    rewind->keyframeInterval = keyframeInterval > 0 ? keyframeInterval : 1;
+    rewind->ringSize = budget;
+    rewind->ring = xmalloc(budget);
+
+    rewind->stateSize = w4_runtimeSerializeSize();
+    rewind->state = xmalloc(rewind->stateSize);
+    rewind->delta = xmalloc(rewind->stateSize);
+    rewind->keyframe = xmalloc(rewind->stateSize);
+    rewind->compressed = xmalloc(w4_rleCompressBound(rewind->stateSize));
+    return rewind;
+}
+
+void w4_rewindDestroy (w4_Rewind* rewind) {
+    free(rewind->compressed);
+    free(rewind->keyframe);
+    free(rewind->delta);
+    free(rewind->state);
+    free(rewind->entries);
+    free(rewind->ring);
+    free(rewind);
+}
+
+/** Updates delta to the XOR of the current state against the keyframe. */
+static void computeDelta (w4_Rewind* rewind, w4_Instance* instance) {
+    const uint8_t* state = rewind->state;
+    const uint8_t* keyframe = rewind->keyframe;
+    uint8_t* delta = rewind->delta;
+
+    if (rewind->keyframeVersion == 0) {
+        w4_rleXor(delta, state, keyframe, rewind->stateSize);
+        return;
+    }
+
+    // Memory blocks that haven't changed since the keyframe are still zero in the delta
+    for (int n = 0; n < W4_DIRTY_BLOCK_COUNT; ++n) {
+        if (w4_runtimeChangedSince(instance, n, rewind->keyframeVersion)) {
+            size_t offset = (size_t)n * W4_DIRTY_BLOCK_SIZE;
+            w4_rleXor(&delta[offset], &state[offset], &keyframe[offset], W4_DIRTY_BLOCK_SIZE);
+        }
+    }
+    size_t memorySize = 1 << 16;
+    w4_rleXor(&delta[memorySize], &state[memorySize], &keyframe[memorySize],
+        rewind->stateSize - memorySize);
+}
+
+void w4_rewindCapture (w4_Rewind* rewind, w4_Instance* instance) {
+    rewind->stateVersion = w4_runtimeSerializeIncremental(instance, rewind->state,
+        rewind->stateVersion);
+
+    loadKeyframe(rewind);
+    if (rewind->entryCount > 0 && rewind->sinceKeyframe + 1 < rewind->keyframeInterval) {
+        computeDelta(rewind, instance);
+        if (store(rewind, w4_rleCompress(rewind->delta, rewind->stateSize, rewind->compressed), false)) {
+            ++rewind->sinceKeyframe;
+            return;
+        }
+
+        // The keyframe's group alone fills the budget, start over from a new keyframe
+        w4_rewindClear(rewind);
+    }
+
+    if (store(rewind, w4_rleCompress(rewind->state, rewind->stateSize, rewind->compressed), true)) {
+        memcpy(rewind->keyframe, rewind->state, rewind->stateSize);
+        memset(rewind->delta, 0, rewind->stateSize);
+        rewind->keyframeLoaded = true;
+        rewind->keyframeVersion = rewind->stateVersion;
+        rewind->sinceKeyframe = 0;
+    }
+}
+
+bool w4_rewindRestore (w4_Rewind* rewind, w4_Instance* instance) {
+    if (rewind->entryCount == 0) {
+        return false;
+    }
+
+    const Entry* entry = entryAt(rewind, rewind->entryCount - 1);
+    const uint8_t* data = &rewind->ring[entry->offset];
+    if (entry->keyframe) {
+        w4_rleDecompress(data, entry->size, rewind->state, rewind->stateSize, false);
+        --rewind->keyframeCount;
+        rewind->keyframeLoaded = false;
+    } else {
+        loadKeyframe(rewind);
+        memcpy(rewind->state, rewind->keyframe, rewind->stateSize);
+        w4_rleDecompress(data, entry->size, rewind->state, rewind->stateSize, true);
+        --rewind->sinceKeyframe;
+    }
+    --rewind->entryCount;
+
+    w4_runtimeUnserialize(instance, rewind->state);
+
+    // The state buffer was used for decompressing, so the next capture needs to start over
+    rewind->stateVersion = 0;
+    return true;
+}
+
+int w4_rewindCount (const w4_Rewind* rewind) {
+    return rewind->entryCount;
+}
+
+void w4_rewindClear (w4_Rewind* rewind) {
+    rewind->entryFirst = 0;
+    rewind->entryCount = 0;
+    rewind->keyframeCount = 0;
+    rewind->keyframeLoaded = false;
+    rewind->keyframeVersion = 0;
+    rewind->sinceKeyframe = 0;
+}
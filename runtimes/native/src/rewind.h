@@ -0,0 +1,32 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "runtime.h"
+
+// Rewind history. Snapshots from w4_runtimeSerialize are captured every frame into a ring buffer
+// with a fixed size. Every few frames a full keyframe is stored, and the frames in between are
+// stored as the XOR against their keyframe. Both are run-length compressed, which makes
+// the mostly-zero deltas of a typical frame a few hundred bytes. When the buffer fills up, the
+// oldest keyframe is dropped along with its deltas.
+
+#define W4_REWIND_DEFAULT_BUDGET (32 << 20)
+#define W4_REWIND_DEFAULT_KEYFRAME_INTERVAL 60
+
+typedef struct w4_Rewind w4_Rewind;
+
+/** Creates an empty history that uses at most budget bytes for compressed snapshots. */
+w4_Rewind* w4_rewindCreate (size_t budget, int keyframeInterval);
+void w4_rewindDestroy (w4_Rewind* rewind);
+
+/** Appends a snapshot of the instance, dropping the oldest snapshots if needed. */
+void w4_rewindCapture (w4_Rewind* rewind, w4_Instance* instance);
+
+/** Restores the newest snapshot into the instance and removes it. Returns false if empty. */
+bool w4_rewindRestore (w4_Rewind* rewind, w4_Instance* instance);
+
+/** The number of snapshots stored. */
+int w4_rewindCount (const w4_Rewind* rewind);
+
+void w4_rewindClear (w4_Rewind* rewind);
@@ -0,0 +1,120 @@
+#include "rle.h"
+
+#include <string.h>
+
+// Each run starts with a control byte:
+//   0x00-0x7f: c+1 literal bytes follow
+//   0x80-0xff: a run of ((c & 0x7f) << 8 | next byte) + 1 zero bytes
+#define MAX_LITERALS 128
+#define MAX_ZEROS 32768
+
+// Shorter zero runs are stored as literals, since breaking up a literal run costs bytes too
+#define MIN_ZEROS 4
+
+static size_t countZeros (const uint8_t* src, size_t n, size_t length) {
+    size_t start = n;
+    uint64_t word;
+    while (n + 8 <= length) {
+        memcpy(&word, &src[n], 8);
+        if (word != 0) {
+            break;
+        }
+        n += 8;
+    }
+    while (n < length && src[n] == 0) {
+        ++n;
+    }
+    return n - start;
+}
+
+void w4_rleXor (uint8_t* dst, const uint8_t* a, const uint8_t* b, size_t length) {
+    size_t n = 0;
+    for (; n + 8 <= length; n += 8) {
+        uint64_t x, y;
+        memcpy(&x, &a[n], 8);
+        memcpy(&y, &b[n], 8);
+        x ^= y;
+        memcpy(&dst[n], &x, 8);
+    }
+    for (; n < length; ++n) {
+        dst[n] = a[n] ^ b[n];
+    }
+}
+
+static uint8_t* writeLiterals (uint8_t* out, const uint8_t* src, size_t length) {
+    while (length > 0) {
+        size_t run = length < MAX_LITERALS ? length : MAX_LITERALS;
+        *out++ = run - 1;
+        memcpy(out, src, run);
+        out += run;
+        src += run;
+        length -= run;
+    }
+    return out;
+}
+
+size_t w4_rleCompress (const uint8_t* src, size_t length, uint8_t* dst) {
+    uint8_t* out = dst;
+    size_t literalStart = 0;
+    size_t n = 0;
+    while (n < length) {
+        size_t zeros = countZeros(src, n, length);
+        if (zeros >= MIN_ZEROS) {
+            out = writeLiterals(out, &src[literalStart], n - literalStart);
+            n += zeros;
+            literalStart = n;
+            while (zeros > 0) {
+                size_t run = zeros < MAX_ZEROS ? zeros : MAX_ZEROS;
+                *out++ = 0x80 | ((run - 1) >> 8);
+                *out++ = (run - 1) & 0xff;
+                zeros -= run;
+            }
+        } else if (zeros > 0) {
+            n += zeros;
+        } else {
+            // Skip ahead to the next zero byte
+            const uint8_t* zero = memchr(&src[n], 0, length - n);
+            n = zero ? (size_t)(zero - src) : length;
+        }
+    }
+    out = writeLiterals(out, &src[literalStart], length - literalStart);
+    return out - dst;
+}
+
+size_t w4_rleCompressBound (size_t length) {
+    return length + length/MAX_LITERALS + 16;
+}
+
+bool w4_rleDecompress (const uint8_t* src, size_t size, uint8_t* dst, size_t length, bool xor) {
+    const uint8_t* end = src + size;
+    size_t n = 0;
+    while (src < end) {
+        uint8_t control = *src++;
+        if (control < 0x80) {
+            size_t run = control + 1;
+            if (n + run > length || (size_t)(end - src) < run) {
+                return false;
+            }
+            if (xor) {
+                w4_rleXor(&dst[n], &dst[n], src, run);
+            } else {
+                memcpy(&dst[n], src, run);
+            }
+            src += run;
+            n += run;
+        } else {
+            if (src == end) {
+                return false;
+            }
+            size_t run = ((control & 0x7f) << 8 | *src++) + 1;
+            if (n + run > length) {
+                return false;
+            }
+            if (!xor) {
+                memset(&dst[n], 0, run);
+            }
+            n += run;
+        }
+    }
+    return n == length;
+}
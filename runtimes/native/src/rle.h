@@ -0,0 +1,24 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// A run-length encoding for serialized states. Only runs of zeros are encoded, which suits the
+// XOR deltas between states, and the mostly empty memory of a typical cart.
+
+/** Compresses length bytes of src into dst, which must hold w4_rleCompressBound(length) bytes. */
+size_t w4_rleCompress (const uint8_t* src, size_t length, uint8_t* dst);
+
+/** The largest size w4_rleCompress can produce. */
+size_t w4_rleCompressBound (size_t length);
+
+/**
+ * Decompresses size bytes of src into the length bytes of dst. If xor is set the decompressed
+ * bytes are XORed into dst, for applying a delta, otherwise they overwrite it. Returns false if
+ * src is truncated or doesn't decompress to exactly length bytes.
+ */
+bool w4_rleDecompress (const uint8_t* src, size_t size, uint8_t* dst, size_t length, bool xor);
+
+/** Stores a ^ b into dst, which may be the same as a. */
+void w4_rleXor (uint8_t* dst, const uint8_t* a, const uint8_t* b, size_t length);
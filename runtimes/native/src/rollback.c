@@ -0,0 +1,290 @@
+#include "rollback.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "util.h"
+
+// How far ahead of the local simulation inputs can be queued
+#define FUTURE_LENGTH 256
+
+/** A single frame of input history. */
+typedef struct {
+    /** The frame number, or 0 if unused. */
+    uint32_t frame;
+
+    uint8_t inputs[W4_ROLLBACK_PLAYER_COUNT];
+
+    /** For each input, whether it was a prediction. */
+    bool predicted[W4_ROLLBACK_PLAYER_COUNT];
+
+    /** The state at the beginning of this frame, and its version for incremental serialization. */
+    uint8_t* state;
+    uint32_t version;
+} History;
+
+/** An input queued for a frame that we haven't simulated locally yet. */
+typedef struct {
+    /** The frame number, or 0 if unused. */
+    uint32_t frame;
+    uint8_t input;
+} FutureInput;
+
+struct w4_Rollback {
+    w4_Instance* instance;
+    uint32_t currentFrame;
+
+    /** Circular buffer of the last historyLength frames, oldest first. */
+    History* history;
+    int historyLength;
+    int historyFirst;
+
+    /** The oldest history index that needs to be simulated again, or historyLength. */
+    int rollbackIdx;
+
+    FutureInput futureInputs[W4_ROLLBACK_PLAYER_COUNT][FUTURE_LENGTH];
+};
+
+static History* historyAt (const w4_Rollback* rollback, int idx) {
+    return &rollback->history[(rollback->historyFirst + idx) % rollback->historyLength];
+}
+
+/** The history index of a frame, or -1 if it's not in the history. */
+static int frameIndex (const w4_Rollback* rollback, uint32_t frame) {
+    if (frame == 0 || frame >= rollback->currentFrame
+            || rollback->currentFrame - frame > (uint32_t)rollback->historyLength) {
+        return -1;
+    }
+    int idx = rollback->historyLength - (rollback->currentFrame - frame);
+    return (historyAt(rollback, idx)->frame == frame) ? idx : -1;
+}
+
+/** Updates predicted inputs after the scheduled rollback, propagating corrections forward. */
+static void propagatePredictions (w4_Rollback* rollback) {
+    for (int ii = rollback->rollbackIdx+1; ii < rollback->historyLength; ++ii) {
+        History* history = historyAt(rollback, ii);
+        const History* prevHistory = historyAt(rollback, ii-1);
+        for (int playerIdx = 0; playerIdx < W4_ROLLBACK_PLAYER_COUNT; ++playerIdx) {
+            if (history->predicted[playerIdx]) {
+                history->inputs[playerIdx] = prevHistory->inputs[playerIdx];
+            }
+        }
+    }
+}
+
+static void step (w4_Rollback* rollback, const History* history, bool present) {
+    for (int playerIdx = 0; playerIdx < W4_ROLLBACK_PLAYER_COUNT; ++playerIdx) {
+        w4_runtimeSetGamepad(rollback->instance, playerIdx, history->inputs[playerIdx]);
+    }
+    if (present) {
+        w4_runtimeUpdate(rollback->instance);
+    } else {
+        w4_runtimeStep(rollback->instance);
+    }
+}
+
+w4_Rollback* w4_rollbackCreate (w4_Instance* instance, uint32_t currentFrame, int historyLength) {
+    w4_Rollback* rollback = xmalloc(sizeof(w4_Rollback));
+    memset(rollback, 0, sizeof(w4_Rollback));
+
+    rollback->instance = instance;
+    rollback->currentFrame = currentFrame;
+
+    if (historyLength < 1) {
+        historyLength = 1;
+    }
+    rollback->historyLength = historyLength;
+    rollback->rollbackIdx = historyLength;
+    rollback->history = xmalloc(historyLength * sizeof(History));
+    memset(rollback->history, 0, historyLength * sizeof(History));
+    for (int n = 0; n < historyLength; ++n) {
+        History* history = &rollback->history[n];
+        history->state = xmalloc(w4_runtimeSerializeSize());
+        for (int playerIdx = 0; playerIdx < W4_ROLLBACK_PLAYER_COUNT; ++playerIdx) {
+            history->predicted[playerIdx] = true;
+        }
+    }
+
+    return rollback;
+}
+
+void w4_rollbackDestroy (w4_Rollback* rollback) {
+    for (int n = 0; n < rollback->historyLength; ++n) {
+        free(rollback->history[n].state);
+    }
+    free(rollback->history);
+    free(rollback);
+}
+
+uint32_t w4_rollbackCurrentFrame (const w4_Rollback* rollback) {
+    return rollback->currentFrame;
+}
+
+int w4_rollbackHistoryLength (const w4_Rollback* rollback) {
+    return rollback->historyLength;
+}
+
+void w4_rollbackAddInputs (w4_Rollback* rollback, int playerIdx, uint32_t frame,
+        const uint8_t* inputs, int count) {
+    for (int n = 0; n < count; ++n, ++frame) {
+        uint8_t input = inputs[n];
+
+        if (frame >= rollback->currentFrame) {
+            // We haven't simulated this frame locally yet, schedule the input for later
+            if (frame - rollback->currentFrame < FUTURE_LENGTH) {
+                FutureInput* future = &rollback->futureInputs[playerIdx][frame % FUTURE_LENGTH];
+                // Never overwrite a previously added input
+                if (future->frame != frame) {
+                    future->frame = frame;
+                    future->input = input;
+                }
+            }
+
+        } else if (rollback->currentFrame - frame <= (uint32_t)rollback->historyLength) {
+            // History holds consecutive frames, ending with the one before the current frame
+            int idx = rollback->historyLength - (rollback->currentFrame - frame);
+            History* history = historyAt(rollback, idx);
+
+            // We only consider frames that have been predicted
+            if (history->frame == frame && history->predicted[playerIdx]) {
+                history->predicted[playerIdx] = false;
+
+                // If the input is different than we predicted, schedule a rollback
+                if (history->inputs[playerIdx] != input) {
+                    history->inputs[playerIdx] = input;
+                    if (idx < rollback->rollbackIdx) {
+                        rollback->rollbackIdx = idx;
+                    }
+                }
+            }
+        }
+    }
+}
+
+int w4_rollbackUpdate (w4_Rollback* rollback) {
+    w4_Instance* instance = rollback->instance;
+    int historyLength = rollback->historyLength;
+    int resimulated = 0;
+
+    // Apply any rollbacks
+    if (rollback->rollbackIdx < historyLength) {
+        propagatePredictions(rollback);
+
+        // Restore runtime state to the beginning of the rollback
+        History* first = historyAt(rollback, rollback->rollbackIdx);
+        w4_runtimeUnserializeIncremental(instance, first->state, first->version);
+
+        while (rollback->rollbackIdx < historyLength) {
+            History* history = historyAt(rollback, rollback->rollbackIdx);
+            if (history != first) {
+                // Update the saved state for this frame
+                history->version = w4_runtimeSerializeIncremental(instance, history->state,
+                    history->version);
+            }
+            step(rollback, history, false);
+            ++rollback->rollbackIdx;
+            ++resimulated;
+        }
+    }
+
+    // Recycle the oldest frame for the current one
+    const History* prevHistory = historyAt(rollback, historyLength-1);
+    History* nextHistory = historyAt(rollback, 0);
+    rollback->historyFirst = (rollback->historyFirst + 1) % historyLength;
+
+    nextHistory->frame = rollback->currentFrame;
+
+    // Save state before executing the frame
+    nextHistory->version = w4_runtimeSerializeIncremental(instance, nextHistory->state,
+        nextHistory->version);
+
+    // Copy inputs into the next frame
+    for (int playerIdx = 0; playerIdx < W4_ROLLBACK_PLAYER_COUNT; ++playerIdx) {
+        FutureInput* future = &rollback->futureInputs[playerIdx][rollback->currentFrame % FUTURE_LENGTH];
+        if (future->frame == rollback->currentFrame) {
+            nextHistory->predicted[playerIdx] = false;
+            nextHistory->inputs[playerIdx] = future->input;
+            future->frame = 0;
+        } else {
+            // No known input for this player, repeat the input from the last frame
+            nextHistory->predicted[playerIdx] = true;
+            nextHistory->inputs[playerIdx] = prevHistory->inputs[playerIdx];
+        }
+    }
+
+    step(rollback, nextHistory, true);
+    ++rollback->currentFrame;
+
+    return resimulated;
+}
+
+uint32_t w4_rollbackScheduledFrame (const w4_Rollback* rollback) {
+    if (rollback->rollbackIdx >= rollback->historyLength) {
+        return 0;
+    }
+    return historyAt(rollback, rollback->rollbackIdx)->frame;
+}
+
+uint32_t w4_rollbackFirstPredictedFrame (const w4_Rollback* rollback, int playerIdx) {
+    uint32_t frame = rollback->currentFrame;
+    for (int ii = rollback->historyLength-1; ii >= 0; --ii) {
+        const History* history = historyAt(rollback, ii);
+        if (history->frame == 0 || !history->predicted[playerIdx]) {
+            break;
+        }
+        frame = history->frame;
+    }
+    return frame;
+}
+
+bool w4_rollbackGetInputs (const w4_Rollback* rollback, uint32_t frame, uint8_t* inputs) {
+    int idx = frameIndex(rollback, frame);
+    if (idx < 0) {
+        return false;
+    }
+    memcpy(inputs, historyAt(rollback, idx)->inputs, W4_ROLLBACK_PLAYER_COUNT);
+    return true;
+}
+
+const void* w4_rollbackGetState (const w4_Rollback* rollback, uint32_t frame) {
+    int idx = frameIndex(rollback, frame);
+    if (idx < 0) {
+        return NULL;
+    }
+    return historyAt(rollback, idx)->state;
+}
+
+bool w4_rollbackResolve (w4_Rollback* rollback, uint32_t frame, const uint8_t* inputs, void** states) {
+    int startIdx = frameIndex(rollback, frame);
+    if (startIdx < 0 || startIdx > rollback->rollbackIdx
+            || rollback->rollbackIdx >= rollback->historyLength) {
+        return false;
+    }
+
+    // The branch must have been simulated with exactly the inputs we now believe are correct
+    propagatePredictions(rollback);
+    for (int ii = startIdx; ii < rollback->historyLength; ++ii) {
+        const History* history = historyAt(rollback, ii);
+        if (memcmp(history->inputs, &inputs[(ii-startIdx)*W4_ROLLBACK_PLAYER_COUNT],
+                W4_ROLLBACK_PLAYER_COUNT)) {
+            return false;
+        }
+    }
+
+    // Swap in the branch's states for the frames after the first one, which is unchanged
+    void** state = states;
+    for (int ii = startIdx+1; ii < rollback->historyLength; ++ii, ++state) {
+        History* history = historyAt(rollback, ii);
+        void* replaced = history->state;
+        history->state = *state;
+        *state = replaced;
+
+        // Not serialized from our instance, the next save needs to be a full copy
+        history->version = 0;
+    }
+
+    // The last state is the start of the current frame
+    w4_runtimeUnserialize(rollback->instance, *state);
+    rollback->rollbackIdx = rollback->historyLength;
+    return true;
+}
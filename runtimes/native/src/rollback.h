@@ -0,0 +1,76 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "runtime.h"
+
+// Rollback netcode, ported from the web runtime's RollbackManager. The inputs of every player and
+// the state at the start of each frame are kept for the last few frames. Missing remote inputs are
+// predicted by repeating the player's last input. When an input arrives that differs from the
+// prediction, the state is restored to that frame and the frames since are simulated again.
+//
+// States are saved with w4_runtimeSerializeIncremental, so keeping a long history is cheap.
+
+/** The number of frames that can be rolled back by default. The web runtime uses 20. */
+#define W4_ROLLBACK_DEFAULT_HISTORY 60
+
+#define W4_ROLLBACK_PLAYER_COUNT 4
+
+typedef struct w4_Rollback w4_Rollback;
+
+/** Starts tracking inputs at the given frame, which should be nonzero. */
+w4_Rollback* w4_rollbackCreate (w4_Instance* instance, uint32_t currentFrame, int historyLength);
+void w4_rollbackDestroy (w4_Rollback* rollback);
+
+/** The frame that the next w4_rollbackUpdate will simulate. */
+uint32_t w4_rollbackCurrentFrame (const w4_Rollback* rollback);
+
+int w4_rollbackHistoryLength (const w4_Rollback* rollback);
+
+/**
+ * Adds a player's inputs for consecutive frames starting at the given frame. Inputs for frames
+ * that were already simulated with a wrong prediction schedule a rollback.
+ */
+void w4_rollbackAddInputs (w4_Rollback* rollback, int playerIdx, uint32_t frame,
+    const uint8_t* inputs, int count);
+
+/**
+ * Applies any scheduled rollback, then simulates the current frame. Returns the number of frames
+ * that were simulated again.
+ */
+int w4_rollbackUpdate (w4_Rollback* rollback);
+
+/** The frame the next w4_rollbackUpdate will roll back to, or 0 if none is scheduled. */
+uint32_t w4_rollbackScheduledFrame (const w4_Rollback* rollback);
+
+/**
+ * The first frame in the history where the player's input is still a prediction, or the current
+ * frame if none of it is.
+ */
+uint32_t w4_rollbackFirstPredictedFrame (const w4_Rollback* rollback, int playerIdx);
+
+/**
+ * Copies the W4_ROLLBACK_PLAYER_COUNT inputs used for a frame in the history. Returns false if the
+ * frame is not in the history.
+ */
+bool w4_rollbackGetInputs (const w4_Rollback* rollback, uint32_t frame, uint8_t* inputs);
+
+/**
+ * The state saved at the start of a frame in the history, in the w4_runtimeSerialize format, or
+ * NULL if the frame is not in the history. It is overwritten by the next w4_rollbackUpdate.
+ */
+const void* w4_rollbackGetState (const w4_Rollback* rollback, uint32_t frame);
+
+/**
+ * Applies the scheduled rollback using frames that were simulated elsewhere, instead of simulating
+ * them again. The frames run from the given frame up to the current frame: inputs holds the
+ * W4_ROLLBACK_PLAYER_COUNT inputs used for each of them, and states the w4_runtimeSerialize state
+ * reached after each of them.
+ *
+ * This only succeeds if the rollback starts at or after the given frame and the inputs match the
+ * corrected ones. The states are then swapped into the history, giving the replaced buffers back
+ * in the states array, and the instance is restored to the last one. Returns false and changes
+ * nothing otherwise.
+ */
+bool w4_rollbackResolve (w4_Rollback* rollback, uint32_t frame, const uint8_t* inputs, void** states);
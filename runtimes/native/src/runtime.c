@@ -1,47 +1,31 @@
 #include "runtime.h"
 
 #include <inttypes.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
 #include "apu.h"
+#include "dirty.h"
+#include "drawlist.h"
 #include "framebuffer.h"
+#include "hash.h"
+#include "instance.h"
+#include "trace.h"
 #include "util.h"
 #include "wasm.h"
 #include "window.h"
 
-#define WIDTH 160
-#define HEIGHT 160
-
 #define SYSTEM_PRESERVE_FRAMEBUFFER 1
 
-#pragma pack(1)
-typedef struct {
-    uint8_t _padding[4];
-    uint32_t palette[4];
-    uint8_t drawColors[2];
-    uint8_t gamepads[4];
-    int16_t mouseX;
-    int16_t mouseY;
-    uint8_t mouseButtons;
-    uint8_t systemFlags;
-    uint8_t _reserved[128];
-    uint8_t framebuffer[WIDTH*HEIGHT>>2];
-    uint8_t _user[58976];
-} Memory;
-#pragma pack()
-
 typedef struct {
-    Memory memory;
+    w4_Memory memory;
     w4_Disk disk;
     bool firstFrame;
+    uint8_t apu[W4_APU_SERIALIZED_SIZE];
 } SerializedState;
 
-static Memory* memory;
-static w4_Disk* disk;
-static bool firstFrame;
-
 static void panic(const char *msg)
 {
     /* REVISIT: it's cleaner to raise a wasm trap */
@@ -63,9 +47,9 @@ static uint32_t mul_u32_with_overflow_check(uint32_t a, uint32_t b)
     return c;
 }
 
-static void bounds_check(const void *sp, size_t sz)
+static void bounds_check(const w4_Instance *instance, const void *sp, size_t sz)
 {
-    const void *memory_sp = (const void *)memory;
+    const void *memory_sp = (const void *)instance->memory;
     const void *memory_ep = (const uint8_t *)memory_sp + (1 << 16);
     const void *ep = (const uint8_t *)sp + sz;
     if (ep < sp || sp < memory_sp || memory_ep < ep) {
@@ -73,9 +57,19 @@ static void bounds_check(const void *sp, size_t sz)
     }
 }
 
-static void bounds_check_cstr(const char *p)
+// Rasterizes pending deferred draws before a host function accesses framebuffer memory.
+static void flush_if_framebuffer(w4_Instance *instance, const void *p, size_t sz)
+{
+    const uint8_t *fb = instance->memory->framebuffer;
+    if (instance->drawList && (const uint8_t *)p < fb + sizeof(instance->memory->framebuffer)
+            && (const uint8_t *)p + sz > fb) {
+        w4_drawListFlush(instance->drawList);
+    }
+}
+
+static void bounds_check_cstr(const w4_Instance *instance, const char *p)
 {
-    const void *memory_sp = (const void *)memory;
+    const void *memory_sp = (const void *)instance->memory;
     const void *memory_ep = (const uint8_t *)memory_sp + (1 << 16);
     if (p < memory_sp || memory_ep <= p) {
         out_of_bounds_access();
@@ -87,10 +81,88 @@ static void bounds_check_cstr(const char *p)
     }
 }
 
-void w4_runtimeInit (uint8_t* memoryBytes, w4_Disk* diskBytes) {
-    memory = (Memory*)memoryBytes;
-    disk = diskBytes;
-    firstFrame = true;
+// Each host function starts with HOST_BEGIN and ends with HOST_END, which count its calls in the
+// frame's profile, and time it while profiling or tracing. In between, hostStats is the function's
+// entry in the profile, to add pixels and bytes to.
+#define HOST_BEGIN(function) \
+    w4_HostStats* hostStats = &instance->frameProfile.host[function]; \
+    uint64_t hostStart = host_begin(instance, hostStats); \
+    W4_TRACE_BEGIN(traceStart)
+
+#define HOST_END(function) \
+    host_end(hostStats, hostStart); \
+    W4_TRACE_END(instance, traceStart, w4_hostFunctionName(function))
+
+static uint64_t host_begin(const w4_Instance *instance, w4_HostStats *stats)
+{
+    ++stats->calls;
+    return instance->profiling ? w4_nanos() : 0;
+}
+
+static void host_end(w4_HostStats *stats, uint64_t start)
+{
+    if (start) {
+        stats->nanos += w4_nanos() - start;
+    }
+}
+
+// The number of pixels of a rectangle that are on screen.
+static uint64_t clipped_area(int x, int y, int width, int height)
+{
+    int64_t x1 = x > 0 ? x : 0;
+    int64_t y1 = y > 0 ? y : 0;
+    int64_t x2 = (int64_t)x + width < WIDTH ? (int64_t)x + width : WIDTH;
+    int64_t y2 = (int64_t)y + height < HEIGHT ? (int64_t)y + height : HEIGHT;
+    return x2 > x1 && y2 > y1 ? (x2 - x1) * (y2 - y1) : 0;
+}
+
+// The pixels covered by the glyphs of a string, which aren't clipped.
+static uint64_t text_pixels(const uint8_t *str, size_t len)
+{
+    uint64_t glyphs = 0;
+    for (size_t n = 0; n < len && str[n] != 0; ++n) {
+        glyphs += str[n] >= 32;
+    }
+    return 8*8 * glyphs;
+}
+
+static void blit_sub(w4_Instance *instance, w4_HostStats *stats, const uint8_t* sprite, int x, int y, int width, int height, int srcX, int srcY, int stride, int flags)
+{
+    bool bpp2 = (flags & 1);
+    bool flipX = (flags & 2);
+    bool flipY = (flags & 4);
+    bool rotate = (flags & 8);
+    uint32_t bpp = (int)bpp2 + 1;
+    uint32_t nbits = mul_u32_with_overflow_check(mul_u32_with_overflow_check(width, height), bpp);
+    bounds_check(instance, sprite, nbits / 8);
+
+    stats->pixels += rotate ? clipped_area(x, y, height, width) : clipped_area(x, y, width, height);
+    stats->bytes += (nbits + 7) / 8;
+
+    if (instance->drawList) {
+        // Copy the rows of the sprite covered by the source rect
+        int64_t firstPixel = (int64_t)srcY * stride + srcX;
+        int64_t lastPixel = (int64_t)(srcY + height - 1) * stride + srcX + width - 1;
+        int64_t firstByte = firstPixel * bpp >> 3;
+        int64_t lastByte = (lastPixel * bpp + bpp - 1) >> 3;
+        const uint8_t *memoryEnd = (const uint8_t *)instance->memory + (1 << 16);
+        if (width > 0 && height > 0 && stride >= 0 && firstPixel >= 0
+                && firstByte <= memoryEnd - sprite && lastByte < memoryEnd - sprite) {
+            flush_if_framebuffer(instance, sprite + firstByte, lastByte - firstByte + 1);
+            w4_drawListBlit(instance->drawList, sprite + firstByte, lastByte - firstByte + 1, x, y, width, height,
+                firstPixel - (firstByte << 3) / bpp, stride, flags);
+            return;
+        }
+        w4_drawListFlush(instance->drawList);
+    }
+    w4_framebufferBlit(instance->framebuffer, sprite, x, y, width, height, srcX, srcY, stride, bpp2, flipX, flipY, rotate);
+}
+
+void w4_runtimeInit (w4_Instance* instance, uint8_t* memoryBytes, w4_Disk* disk) {
+    w4_Memory* memory = (w4_Memory*)memoryBytes;
+    instance->memory = memory;
+    instance->disk = disk;
+    instance->firstFrame = true;
 
     // Set memory to initial state
     memset(memory, 0, 1 << 16);
@@ -103,167 +175,290 @@ void w4_runtimeInit (uint8_t* memoryBytes, w4_Disk* diskBytes) {
     w4_write16LE(&memory->mouseX, 0x7fff);
     w4_write16LE(&memory->mouseY, 0x7fff);
 
-    w4_apuInit();
-    w4_framebufferInit(memory->drawColors, memory->framebuffer);
+    instance->apu = w4_apuCreate();
+    instance->framebuffer = w4_framebufferCreate(memory->drawColors, memory->framebuffer);
+}
+
+void w4_runtimeSetDeferredDraw (w4_Instance* instance, bool enabled) {
+    if (enabled && !instance->drawList) {
+        instance->drawList = w4_drawListCreate(instance->framebuffer, instance->memory->drawColors);
+    } else if (!enabled && instance->drawList) {
+        w4_drawListFlush(instance->drawList);
+        w4_drawListDestroy(instance->drawList);
+        instance->drawList = NULL;
+    }
+}
+
+void w4_runtimeSetGamepad (w4_Instance* instance, int idx, uint8_t gamepad) {
+    instance->memory->gamepads[idx] = gamepad;
+}
+
+void w4_runtimeSetMouse (w4_Instance* instance, int16_t x, int16_t y, uint8_t buttons) {
+    w4_write16LE(&instance->memory->mouseX, x);
+    w4_write16LE(&instance->memory->mouseY, y);
+    instance->memory->mouseButtons = buttons;
 }
 
-void w4_runtimeSetGamepad (int idx, uint8_t gamepad) {
-    memory->gamepads[idx] = gamepad;
+uint8_t w4_runtimeGetGamepad (w4_Instance* instance, int idx) {
+    return instance->memory->gamepads[idx];
 }
 
-void w4_runtimeSetMouse (int16_t x, int16_t y, uint8_t buttons) {
-    w4_write16LE(&memory->mouseX, x);
-    w4_write16LE(&memory->mouseY, y);
-    memory->mouseButtons = buttons;
+void w4_runtimeGetMouse (w4_Instance* instance, int16_t* x, int16_t* y, uint8_t* buttons) {
+    *x = w4_read16LE(&instance->memory->mouseX);
+    *y = w4_read16LE(&instance->memory->mouseY);
+    *buttons = instance->memory->mouseButtons;
 }
 
-void w4_runtimeBlit (const uint8_t* sprite, int x, int y, int width, int height, int flags) {
+void w4_runtimeSetNetplay (w4_Instance* instance, int localPlayerIdx) {
+    instance->memory->netplay = 0b100 | (localPlayerIdx & 0b11);
+}
+
+void w4_runtimeBlit (w4_Instance* instance, const uint8_t* sprite, int x, int y, int width, int height, int flags) {
+    HOST_BEGIN(W4_HOST_BLIT);
     // printf("blit: %p, %d, %d, %d, %d, %d\n", sprite, x, y, width, height, flags);
 
-    w4_runtimeBlitSub(sprite, x, y, width, height, 0, 0, width, flags);
+    blit_sub(instance, hostStats, sprite, x, y, width, height, 0, 0, width, flags);
+    HOST_END(W4_HOST_BLIT);
 }
 
-void w4_runtimeBlitSub (const uint8_t* sprite, int x, int y, int width, int height, int srcX, int srcY, int stride, int flags) {
+void w4_runtimeBlitSub (w4_Instance* instance, const uint8_t* sprite, int x, int y, int width, int height, int srcX, int srcY, int stride, int flags) {
+    HOST_BEGIN(W4_HOST_BLIT_SUB);
     // printf("blitSub: %p, %d, %d, %d, %d, %d, %d, %d, %d\n", sprite, x, y, width, height, srcX, srcY, stride, flags);
 
-    bool bpp2 = (flags & 1);
-    bool flipX = (flags & 2);
-    bool flipY = (flags & 4);
-    bool rotate = (flags & 8);
-    uint32_t bpp = (int)bpp2 + 1;
-    uint32_t nbits = mul_u32_with_overflow_check(mul_u32_with_overflow_check(width, height), bpp);
-    bounds_check(sprite, nbits / 8);
-    w4_framebufferBlit(sprite, x, y, width, height, srcX, srcY, stride, bpp2, flipX, flipY, rotate);
+    blit_sub(instance, hostStats, sprite, x, y, width, height, srcX, srcY, stride, flags);
+    HOST_END(W4_HOST_BLIT_SUB);
 }
 
-void w4_runtimeLine (int x1, int y1, int x2, int y2) {
+void w4_runtimeLine (w4_Instance* instance, int x1, int y1, int x2, int y2) {
+    HOST_BEGIN(W4_HOST_LINE);
     // printf("line: %d, %d, %d, %d\n", x1, y1, x2, y2);
-    w4_framebufferLine(x1, y1, x2, y2);
+    hostStats->pixels += w4_framebufferLinePixels(x1, y1, x2, y2);
+    if (instance->drawList) {
+        w4_drawListLine(instance->drawList, x1, y1, x2, y2);
+    } else {
+        w4_framebufferLine(instance->framebuffer, x1, y1, x2, y2);
+    }
+    HOST_END(W4_HOST_LINE);
 }
 
-void w4_runtimeHLine (int x, int y, int len) {
+void w4_runtimeHLine (w4_Instance* instance, int x, int y, int len) {
+    HOST_BEGIN(W4_HOST_HLINE);
     // printf("hline: %d, %d, %d\n", x, y, len);
-    w4_framebufferHLine(x, y, len);
+    hostStats->pixels += clipped_area(x, y, len, 1);
+    if (instance->drawList) {
+        w4_drawListHLine(instance->drawList, x, y, len);
+    } else {
+        w4_framebufferHLine(instance->framebuffer, x, y, len);
+    }
+    HOST_END(W4_HOST_HLINE);
 }
 
-void w4_runtimeVLine (int x, int y, int len) {
+void w4_runtimeVLine (w4_Instance* instance, int x, int y, int len) {
+    HOST_BEGIN(W4_HOST_VLINE);
     // printf("vline: %d, %d, %d\n", x, y, len);
-    w4_framebufferVLine(x, y, len);
+    hostStats->pixels += clipped_area(x, y, 1, len);
+    if (instance->drawList) {
+        w4_drawListVLine(instance->drawList, x, y, len);
+    } else {
+        w4_framebufferVLine(instance->framebuffer, x, y, len);
+    }
+    HOST_END(W4_HOST_VLINE);
 }
 
-void w4_runtimeOval (int x, int y, int width, int height) {
+void w4_runtimeOval (w4_Instance* instance, int x, int y, int width, int height) {
+    HOST_BEGIN(W4_HOST_OVAL);
     // printf("oval: %d, %d, %d, %d\n", x, y, width, height);
-    w4_framebufferOval(x, y, width, height);
+    hostStats->pixels += clipped_area(x, y, width, height);
+    if (instance->drawList) {
+        w4_drawListOval(instance->drawList, x, y, width, height);
+    } else {
+        w4_framebufferOval(instance->framebuffer, x, y, width, height);
+    }
+    HOST_END(W4_HOST_OVAL);
 }
 
-void w4_runtimeRect (int x, int y, int width, int height) {
+void w4_runtimeRect (w4_Instance* instance, int x, int y, int width, int height) {
+    HOST_BEGIN(W4_HOST_RECT);
     // printf("rect: %d, %d, %d, %d\n", x, y, width, height);
-    w4_framebufferRect(x, y, width, height);
+    hostStats->pixels += clipped_area(x, y, width, height);
+    if (instance->drawList) {
+        w4_drawListRect(instance->drawList, x, y, width, height);
+    } else {
+        w4_framebufferRect(instance->framebuffer, x, y, width, height);
+    }
+    HOST_END(W4_HOST_RECT);
 }
 
-void w4_runtimeText (const uint8_t* str, int x, int y) {
-    bounds_check_cstr(str);
+void w4_runtimeText (w4_Instance* instance, const uint8_t* str, int x, int y) {
+    HOST_BEGIN(W4_HOST_TEXT);
+    bounds_check_cstr(instance, str);
     // printf("text: %s, %d, %d\n", str, x, y);
-    w4_framebufferText(str, x, y);
+    size_t len = strlen((const char*)str);
+    hostStats->pixels += text_pixels(str, len);
+    hostStats->bytes += len;
+    if (instance->drawList) {
+        flush_if_framebuffer(instance, str, len);
+        w4_drawListTextUtf8(instance->drawList, str, len, x, y);
+    } else {
+        w4_framebufferText(instance->framebuffer, str, x, y);
+    }
+    HOST_END(W4_HOST_TEXT);
 }
 
-void w4_runtimeTextUtf8 (const uint8_t* str, int byteLength, int x, int y) {
-    bounds_check(str, byteLength);
+void w4_runtimeTextUtf8 (w4_Instance* instance, const uint8_t* str, int byteLength, int x, int y) {
+    HOST_BEGIN(W4_HOST_TEXT_UTF8);
+    bounds_check(instance, str, byteLength);
     // printf("textUtf8: %p, %d, %d, %d\n", str, byteLength, x, y);
-    w4_framebufferTextUtf8(str, byteLength, x, y);
+    hostStats->pixels += text_pixels(str, byteLength);
+    hostStats->bytes += byteLength;
+    if (instance->drawList) {
+        flush_if_framebuffer(instance, str, byteLength);
+        w4_drawListTextUtf8(instance->drawList, str, byteLength, x, y);
+    } else {
+        w4_framebufferTextUtf8(instance->framebuffer, str, byteLength, x, y);
+    }
+    HOST_END(W4_HOST_TEXT_UTF8);
 }
 
-void w4_runtimeTextUtf16 (const uint16_t* str, int byteLength, int x, int y) {
-    bounds_check(str, byteLength);
+void w4_runtimeTextUtf16 (w4_Instance* instance, const uint16_t* str, int byteLength, int x, int y) {
+    HOST_BEGIN(W4_HOST_TEXT_UTF16);
+    bounds_check(instance, str, byteLength);
     // printf("textUtf16: %p, %d, %d, %d\n", str, byteLength, x, y);
-    w4_framebufferTextUtf16(str, byteLength, x, y);
+    for (int n = 0; n < byteLength/2; ++n) {
+        uint16_t c = w4_read16LE(&str[n]);
+        if (c == 0) {
+            break;
+        }
+        if (c >= 32 && c <= 255) {
+            hostStats->pixels += 8*8;
+        }
+    }
+    hostStats->bytes += byteLength;
+    if (instance->drawList) {
+        flush_if_framebuffer(instance, str, byteLength);
+        w4_drawListTextUtf16(instance->drawList, str, byteLength, x, y);
+    } else {
+        w4_framebufferTextUtf16(instance->framebuffer, str, byteLength, x, y);
+    }
+    HOST_END(W4_HOST_TEXT_UTF16);
 }
 
-void w4_runtimeTone (int frequency, int duration, int volume, int flags) {
+void w4_runtimeTone (w4_Instance* instance, int frequency, int duration, int volume, int flags) {
+    HOST_BEGIN(W4_HOST_TONE);
     // printf("tone: %d, %d, %d, %d\n", frequency, duration, volume, flags);
-    w4_apuTone(frequency, duration, volume, flags);
+    w4_apuTone(instance->apu, frequency, duration, volume, flags);
+    HOST_END(W4_HOST_TONE);
 }
 
-int w4_runtimeDiskr (uint8_t* dest, int size) {
-    bounds_check(dest, size);
-    if (!disk) {
+int w4_runtimeDiskr (w4_Instance* instance, uint8_t* dest, int size) {
+    HOST_BEGIN(W4_HOST_DISKR);
+    bounds_check(instance, dest, size);
+    flush_if_framebuffer(instance, dest, size);
+    if (!instance->disk) {
+        HOST_END(W4_HOST_DISKR);
         return 0;
     }
 
-    if (size > disk->size) {
-        size = disk->size;
+    if (size > instance->disk->size) {
+        size = instance->disk->size;
     }
-    memcpy(dest, disk->data, size);
+    memcpy(dest, instance->disk->data, size);
+    HOST_END(W4_HOST_DISKR);
     return size;
 }
 
-int w4_runtimeDiskw (const uint8_t* src, int size) {
-    bounds_check(src, size);
-    if (!disk) {
+int w4_runtimeDiskw (w4_Instance* instance, const uint8_t* src, int size) {
+    HOST_BEGIN(W4_HOST_DISKW);
+    bounds_check(instance, src, size);
+    flush_if_framebuffer(instance, src, size);
+    if (!instance->disk) {
+        HOST_END(W4_HOST_DISKW);
         return 0;
     }
 
     if (size > 1024) {
         size = 1024;
     }
-    disk->size = size;
-    memcpy(disk->data, src, size);
+    hostStats->bytes += size;
+    instance->disk->size = size;
+    memcpy(instance->disk->data, src, size);
+    HOST_END(W4_HOST_DISKW);
     return size;
 }
 
-void w4_runtimeTrace (const uint8_t* str) {
-    bounds_check_cstr(str);
+void w4_runtimeTrace (w4_Instance* instance, const uint8_t* str) {
+    HOST_BEGIN(W4_HOST_TRACE);
+    bounds_check_cstr(instance, str);
+    size_t len = strlen((const char*)str);
+    hostStats->bytes += len;
+    flush_if_framebuffer(instance, str, len);
     puts(str);
+    HOST_END(W4_HOST_TRACE);
 }
 
-void w4_runtimeTraceUtf8 (const uint8_t* str, int byteLength) {
-    bounds_check(str, byteLength);
+void w4_runtimeTraceUtf8 (w4_Instance* instance, const uint8_t* str, int byteLength) {
+    HOST_BEGIN(W4_HOST_TRACE_UTF8);
+    bounds_check(instance, str, byteLength);
+    hostStats->bytes += byteLength;
+    flush_if_framebuffer(instance, str, byteLength);
     printf("%.*s\n", byteLength, str);
+    HOST_END(W4_HOST_TRACE_UTF8);
 }
 
-void w4_runtimeTraceUtf16 (const uint16_t* str, int byteLength) {
-    bounds_check(str, byteLength);
+void w4_runtimeTraceUtf16 (w4_Instance* instance, const uint16_t* str, int byteLength) {
+    HOST_BEGIN(W4_HOST_TRACE_UTF16);
+    bounds_check(instance, str, byteLength);
     printf("TODO: traceUtf16: %p, %d\n", str, byteLength);
+    HOST_END(W4_HOST_TRACE_UTF16);
 }
 
-void w4_runtimeTracef (const uint8_t* str, const void* stack) {
+void w4_runtimeTracef (w4_Instance* instance, const uint8_t* str, const void* stack) {
+    HOST_BEGIN(W4_HOST_TRACEF);
     const uint8_t* argPtr = stack;
     uint32_t strPtr;
-    bounds_check_cstr(str);
+    bounds_check_cstr(instance, str);
+    hostStats->bytes += strlen((const char*)str);
+    if (instance->drawList) {
+        // Arguments may point anywhere in memory
+        w4_drawListFlush(instance->drawList);
+    }
     for (; *str != 0; ++str) {
         if (*str == '%') {
             const uint8_t sym = *(++str);
             switch (sym) {
             case 0:
+                hostStats->bytes += argPtr - (const uint8_t*)stack;
+                HOST_END(W4_HOST_TRACEF);
                 return; // Interrupted
             case '%':
                 putc('%', stdout);
                 break;
             case 'c':
-                bounds_check(argPtr, 4);
+                bounds_check(instance, argPtr, 4);
                 putc((char)w4_read32LE(argPtr), stdout);
                 argPtr += 4;
                 break;
             case 'd':
-                bounds_check(argPtr, 4);
+                bounds_check(instance, argPtr, 4);
                 printf("%" PRId32, w4_read32LE(argPtr));
                 argPtr += 4;
                 break;
             case 'x':
-                bounds_check(argPtr, 4);
+                bounds_check(instance, argPtr, 4);
                 printf("%" PRIx32, w4_read32LE(argPtr));
                 argPtr += 4;
                 break;
             case 's':
-                bounds_check(argPtr, 4);
+                bounds_check(instance, argPtr, 4);
                 strPtr = w4_read32LE(argPtr);
                 argPtr += 4;
-                const char *strPtr_host = (const char *)memory + strPtr;
-                bounds_check_cstr(strPtr_host);
+                const char *strPtr_host = (const char *)instance->memory + strPtr;
+                bounds_check_cstr(instance, strPtr_host);
+                hostStats->bytes += strlen(strPtr_host);
                 printf("%s", strPtr_host);
                 break;
             case 'f':
-                bounds_check(argPtr, 8);
+                bounds_check(instance, argPtr, 8);
                 printf("%lg", w4_readf64LE(argPtr));
                 argPtr += 8;
                 break;
@@ -275,17 +470,57 @@ void w4_runtimeTracef (const uint8_t* str, const void* stack) {
         }
     }
     putc('\n', stdout);
+    hostStats->bytes += argPtr - (const uint8_t*)stack;
+    HOST_END(W4_HOST_TRACEF);
+}
+
+void w4_runtimeUpdate (w4_Instance* instance) {
+    W4_TRACE_BEGIN(frameStart);
+    w4_runtimeStep(instance);
+    w4_runtimeComposite(instance);
+    W4_TRACE_END(instance, frameStart, "frame");
 }
 
-void w4_runtimeUpdate () {
-    if (firstFrame) {
-        firstFrame = false;
-        w4_wasmCallStart();
+void w4_runtimeStep (w4_Instance* instance) {
+    W4_TRACE_BEGIN(stepStart);
+    w4_Memory* memory = instance->memory;
+    uint64_t cartStart = instance->profiling ? w4_nanos() : 0;
+    if (instance->firstFrame) {
+        instance->firstFrame = false;
+        W4_TRACE_BEGIN(startStart);
+        w4_wasmCallStart(instance);
+        W4_TRACE_END(instance, startStart, "start");
     } else if (!(memory->systemFlags & SYSTEM_PRESERVE_FRAMEBUFFER)) {
-        w4_framebufferClear();
+        w4_framebufferClear(instance->framebuffer);
+    }
+    W4_TRACE_BEGIN(updateStart);
+    w4_wasmCallUpdate(instance);
+    W4_TRACE_END(instance, updateStart, "update");
+    if (cartStart) {
+        instance->frameProfile.cartNanos += w4_nanos() - cartStart;
     }
-    w4_wasmCallUpdate();
-    w4_apuTick();
+
+    // The frame's profile is finished, though deferred draws are rasterized after
+    instance->frameProfile.frames = 1;
+    w4_profileAdd(&instance->profile, &instance->frameProfile);
+    instance->lastFrameProfile = instance->frameProfile;
+    memset(&instance->frameProfile, 0, sizeof(w4_Profile));
+
+    if (instance->drawList) {
+        W4_TRACE_BEGIN(flushStart);
+        w4_drawListFlush(instance->drawList);
+        W4_TRACE_END(instance, flushStart, "drawListFlush");
+    }
+    W4_TRACE_BEGIN(apuStart);
+    w4_apuTick(instance->apu);
+    W4_TRACE_END(instance, apuStart, "apuTick");
+    W4_TRACE_END(instance, stepStart, "step");
+    W4_TRACE_FLUSH(instance);
+}
+
+void w4_runtimeComposite (w4_Instance* instance) {
+    W4_TRACE_BEGIN(compositeStart);
+    w4_Memory* memory = instance->memory;
     uint32_t palette[4] = {
         w4_read32LE(&memory->palette[0]),
         w4_read32LE(&memory->palette[1]),
@@ -293,22 +528,147 @@ void w4_runtimeUpdate () {
         w4_read32LE(&memory->palette[3]),
     };
     w4_windowComposite(palette, memory->framebuffer);
+    W4_TRACE_END(instance, compositeStart, "composite");
+}
+
+void w4_runtimeWriteSamples (w4_Instance* instance, int16_t* output, unsigned long frames) {
+    w4_apuWriteSamples(instance->apu, output, frames);
 }
 
 int w4_runtimeSerializeSize () {
     return sizeof(SerializedState);
 }
 
-void w4_runtimeSerialize (void* dest) {
+void w4_runtimeSerialize (w4_Instance* instance, void* dest) {
+    SerializedState* state = dest;
+    if (instance->drawList) {
+        w4_drawListFlush(instance->drawList);
+    }
+    memcpy(&state->memory, instance->memory, 1 << 16);
+    memcpy(&state->disk, instance->disk, sizeof(w4_Disk));
+    state->firstFrame = instance->firstFrame;
+    w4_apuSerialize(instance->apu, state->apu);
+}
+
+static bool unserializeApu (w4_Instance* instance, const uint8_t* src) {
+    if (!w4_apuUnserialize(instance->apu, src)) {
+        fprintf(stderr, "Audio state has an unknown version, sound was reset\n");
+        return false;
+    }
+    return true;
+}
+
+bool w4_runtimeUnserialize (w4_Instance* instance, const void* src) {
+    const SerializedState* state = src;
+    memcpy(instance->memory, &state->memory, 1 << 16);
+    memcpy(instance->disk, &state->disk, sizeof(w4_Disk));
+    instance->firstFrame = state->firstFrame;
+    return unserializeApu(instance, state->apu);
+}
+
+static uint64_t hashState (const w4_Memory* memory, const w4_Disk* disk, bool firstFrame,
+        const uint8_t* apu) {
+    // Each netplay peer sees a different local player, leave that out so their hashes match
+    uint8_t header[64];
+    memcpy(header, memory, sizeof(header));
+    header[offsetof(w4_Memory, netplay)] &= ~0b11;
+    uint64_t hash = w4_hash(header, sizeof(header), 0);
+    hash = w4_hash((const uint8_t*)memory + sizeof(header), (1 << 16) - sizeof(header), hash);
+
+    // Only the used part of the disk, the rest may hold stale bytes
+    int size = disk->size < sizeof(disk->data) ? disk->size : sizeof(disk->data);
+    uint8_t sizeAndFirstFrame[3] = { size & 0xff, size >> 8, firstFrame };
+    hash = w4_hash(sizeAndFirstFrame, sizeof(sizeAndFirstFrame), hash);
+    hash = w4_hash(disk->data, size, hash);
+
+    uint8_t deterministic[W4_APU_SERIALIZED_SIZE];
+    memcpy(deterministic, apu, W4_APU_SERIALIZED_SIZE);
+    w4_apuClearPlayback(deterministic);
+    return w4_hash(deterministic, sizeof(deterministic), hash);
+}
+
+uint64_t w4_runtimeHostCalls (const w4_Instance* instance) {
+    uint64_t calls = 0;
+    for (int n = 0; n < W4_HOST_FUNCTIONS; ++n) {
+        calls += instance->profile.host[n].calls;
+    }
+    return calls;
+}
+
+void w4_runtimeSetProfiling (w4_Instance* instance, bool enabled) {
+    instance->profiling = enabled;
+}
+
+const w4_Profile* w4_runtimeProfile (const w4_Instance* instance) {
+    return &instance->profile;
+}
+
+const w4_Profile* w4_runtimeFrameProfile (const w4_Instance* instance) {
+    return &instance->lastFrameProfile;
+}
+
+uint64_t w4_runtimeHash (w4_Instance* instance) {
+    if (instance->drawList) {
+        w4_drawListFlush(instance->drawList);
+    }
+    uint8_t apu[W4_APU_SERIALIZED_SIZE];
+    w4_apuSerialize(instance->apu, apu);
+    return hashState(instance->memory, instance->disk, instance->firstFrame, apu);
+}
+
+uint64_t w4_runtimeHashState (const void* src) {
+    const SerializedState* state = src;
+    return hashState(&state->memory, &state->disk, state->firstFrame, state->apu);
+}
+
+static w4_Dirty* getDirty (w4_Instance* instance) {
+    if (!instance->dirty) {
+        instance->dirty = w4_dirtyCreate((const uint8_t*)instance->memory);
+    }
+    return instance->dirty;
+}
+
+uint32_t w4_runtimeSerializeIncremental (w4_Instance* instance, void* dest, uint32_t version) {
     SerializedState* state = dest;
-    memcpy(&state->memory, memory, 1 << 16);
-    memcpy(&state->disk, disk, sizeof(w4_Disk));
-    state->firstFrame = firstFrame;
+    if (instance->drawList) {
+        w4_drawListFlush(instance->drawList);
+    }
+
+    const uint8_t* memory = (const uint8_t*)instance->memory;
+    uint8_t* out = (uint8_t*)&state->memory;
+    w4_Dirty* dirty = getDirty(instance);
+    uint32_t current = w4_dirtyScan(dirty, memory);
+    for (int n = 0; n < W4_DIRTY_BLOCK_COUNT; ++n) {
+        if (w4_dirtyChangedSince(dirty, n, version)) {
+            size_t offset = (size_t)n * W4_DIRTY_BLOCK_SIZE;
+            memcpy(&out[offset], &memory[offset], W4_DIRTY_BLOCK_SIZE);
+        }
+    }
+
+    memcpy(&state->disk, instance->disk, sizeof(w4_Disk));
+    state->firstFrame = instance->firstFrame;
+    w4_apuSerialize(instance->apu, state->apu);
+    return current;
 }
 
-void w4_runtimeUnserialize (const void* src) {
+bool w4_runtimeUnserializeIncremental (w4_Instance* instance, const void* src, uint32_t version) {
     const SerializedState* state = src;
-    memcpy(memory, &state->memory, 1 << 16);
-    memcpy(disk, &state->disk, sizeof(w4_Disk));
-    firstFrame = state->firstFrame;
+    uint8_t* memory = (uint8_t*)instance->memory;
+    const uint8_t* in = (const uint8_t*)&state->memory;
+    w4_Dirty* dirty = getDirty(instance);
+    w4_dirtyScan(dirty, memory);
+    for (int n = 0; n < W4_DIRTY_BLOCK_COUNT; ++n) {
+        if (w4_dirtyChangedSince(dirty, n, version)) {
+            size_t offset = (size_t)n * W4_DIRTY_BLOCK_SIZE;
+            memcpy(&memory[offset], &in[offset], W4_DIRTY_BLOCK_SIZE);
+        }
+    }
+
+    memcpy(instance->disk, &state->disk, sizeof(w4_Disk));
+    instance->firstFrame = state->firstFrame;
+    return unserializeApu(instance, state->apu);
+}
+
+bool w4_runtimeChangedSince (w4_Instance* instance, int block, uint32_t version) {
+    return w4_dirtyChangedSince(getDirty(instance), block, version);
 }
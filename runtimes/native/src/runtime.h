@@ -1,7 +1,10 @@
 #pragma once
 
+#include <stdbool.h>
 #include <stdint.h>
 
+#include "profile.h"
+
 #define W4_BUTTON_X 1
 #define W4_BUTTON_Z 2
 // #define W4_BUTTON_RESERVED 4
@@ -20,34 +23,111 @@ typedef struct {
     uint8_t data[1024];
 } w4_Disk;
 
-void w4_runtimeInit (uint8_t* memory, w4_Disk* disk);
+/** A running cart. See instance.h. */
+typedef struct w4_Instance w4_Instance;
+
+/** Allocates an empty instance, to be set up with w4_wasmInit and w4_runtimeInit. */
+w4_Instance* w4_instanceCreate ();
+
+/** Frees an instance along with its wasm runtime. */
+void w4_instanceDestroy (w4_Instance* instance);
+
+void w4_runtimeInit (w4_Instance* instance, uint8_t* memory, w4_Disk* disk);
+
+/**
+ * Enables deferred drawing, where draw calls are batched and rasterized once per frame. Only
+ * safe for carts that don't access framebuffer memory directly. See drawlist.h.
+ */
+void w4_runtimeSetDeferredDraw (w4_Instance* instance, bool enabled);
+
+void w4_runtimeSetGamepad (w4_Instance* instance, int idx, uint8_t gamepad);
+void w4_runtimeSetMouse (w4_Instance* instance, int16_t x, int16_t y, uint8_t buttons);
+
+/** Reads back the input the next frame will run with. */
+uint8_t w4_runtimeGetGamepad (w4_Instance* instance, int idx);
+void w4_runtimeGetMouse (w4_Instance* instance, int16_t* x, int16_t* y, uint8_t* buttons);
+
+/** Tells the cart that netplay is active and which player is local. */
+void w4_runtimeSetNetplay (w4_Instance* instance, int localPlayerIdx);
+
+void w4_runtimeBlit (w4_Instance* instance, const uint8_t* sprite, int x, int y, int width, int height, int flags);
+void w4_runtimeBlitSub (w4_Instance* instance, const uint8_t* sprite, int x, int y, int width, int height, int srcX, int srcY, int stride, int flags);
+void w4_runtimeLine (w4_Instance* instance, int x1, int y1, int x2, int y2);
+void w4_runtimeHLine (w4_Instance* instance, int x, int y, int len);
+void w4_runtimeVLine (w4_Instance* instance, int x, int y, int len);
+void w4_runtimeOval (w4_Instance* instance, int x, int y, int width, int height);
+void w4_runtimeRect (w4_Instance* instance, int x, int y, int width, int height);
+void w4_runtimeText (w4_Instance* instance, const uint8_t* str, int x, int y);
+void w4_runtimeTextUtf8 (w4_Instance* instance, const uint8_t* str, int byteLength, int x, int y);
+void w4_runtimeTextUtf16 (w4_Instance* instance, const uint16_t* str, int byteLength, int x, int y);
+
+void w4_runtimeTone (w4_Instance* instance, int frequency, int duration, int volume, int flags);
 
-void w4_runtimeSetGamepad (int idx, uint8_t gamepad);
-void w4_runtimeSetMouse (int16_t x, int16_t y, uint8_t buttons);
+int w4_runtimeDiskr (w4_Instance* instance, uint8_t* dest, int size);
+int w4_runtimeDiskw (w4_Instance* instance, const uint8_t* src, int size);
 
-void w4_runtimeBlit (const uint8_t* sprite, int x, int y, int width, int height, int flags);
-void w4_runtimeBlitSub (const uint8_t* sprite, int x, int y, int width, int height, int srcX, int srcY, int stride, int flags);
-void w4_runtimeLine (int x1, int y1, int x2, int y2);
-void w4_runtimeHLine (int x, int y, int len);
-void w4_runtimeVLine (int x, int y, int len);
-void w4_runtimeOval (int x, int y, int width, int height);
-void w4_runtimeRect (int x, int y, int width, int height);
-void w4_runtimeText (const uint8_t* str, int x, int y);
-void w4_runtimeTextUtf8 (const uint8_t* str, int byteLength, int x, int y);
-void w4_runtimeTextUtf16 (const uint16_t* str, int byteLength, int x, int y);
+void w4_runtimeTrace (w4_Instance* instance, const uint8_t* str);
+void w4_runtimeTraceUtf8 (w4_Instance* instance, const uint8_t* str, int byteLength);
+void w4_runtimeTraceUtf16 (w4_Instance* instance, const uint16_t* str, int byteLength);
+void w4_runtimeTracef (w4_Instance* instance, const uint8_t* str, const void* stack);
 
-void w4_runtimeTone (int frequency, int duration, int volume, int flags);
+void w4_runtimeUpdate (w4_Instance* instance);
 
-int w4_runtimeDiskr (uint8_t* dest, int size);
-int w4_runtimeDiskw (const uint8_t* src, int size);
+/** Runs a frame like w4_runtimeUpdate, without presenting it to the window. */
+void w4_runtimeStep (w4_Instance* instance);
 
-void w4_runtimeTrace (const uint8_t* str);
-void w4_runtimeTraceUtf8 (const uint8_t* str, int byteLength);
-void w4_runtimeTraceUtf16 (const uint16_t* str, int byteLength);
-void w4_runtimeTracef (const uint8_t* str, const void* stack);
+/** Presents the current framebuffer to the window again, without running a frame. */
+void w4_runtimeComposite (w4_Instance* instance);
 
-void w4_runtimeUpdate ();
+/** The number of host functions the cart has called in every finished frame. */
+uint64_t w4_runtimeHostCalls (const w4_Instance* instance);
 
+/**
+ * Enables timing the cart and each host function it calls. Calls, pixels and bytes are always
+ * counted, but reading the clock around every call has a cost, so timing is off by default.
+ */
+void w4_runtimeSetProfiling (w4_Instance* instance, bool enabled);
+
+/** Totals for every frame the instance has finished. Can be read between frames. */
+const w4_Profile* w4_runtimeProfile (const w4_Instance* instance);
+
+/** The same for only the last frame the instance finished. */
+const w4_Profile* w4_runtimeFrameProfile (const w4_Instance* instance);
+
+/** Generates interleaved stereo audio for the instance, see w4_apuWriteSamples. */
+void w4_runtimeWriteSamples (w4_Instance* instance, int16_t* output, unsigned long frames);
+
+/**
+ * A serialized state starts with the 64 KB of memory, followed by the rest of the state.
+ * Unserializing returns false if the audio state has an unknown version, the memory and disk are
+ * still restored but the sound is reset.
+ */
 int w4_runtimeSerializeSize ();
-void w4_runtimeSerialize (void* dest);
-void w4_runtimeUnserialize (const void* src);
+void w4_runtimeSerialize (w4_Instance* instance, void* dest);
+bool w4_runtimeUnserialize (w4_Instance* instance, const void* src);
+
+/**
+ * Like w4_runtimeSerialize, but dest already holds the state serialized at the given version, and
+ * only the blocks of memory that changed since then are copied. Pass version 0 if dest doesn't
+ * hold a state yet. Returns the version of the new state. Versions are specific to an instance.
+ */
+uint32_t w4_runtimeSerializeIncremental (w4_Instance* instance, void* dest, uint32_t version);
+
+/**
+ * Like w4_runtimeUnserialize, for a state serialized at the given version with
+ * w4_runtimeSerializeIncremental. Only the blocks of memory that changed since then are copied.
+ */
+bool w4_runtimeUnserializeIncremental (w4_Instance* instance, const void* src, uint32_t version);
+
+/**
+ * A 64-bit hash of everything that affects how the cart runs: memory, disk and the tones playing.
+ * Two instances that get the same inputs produce the same hash every frame, on any platform, so
+ * comparing hashes finds the exact frame where they diverged.
+ */
+uint64_t w4_runtimeHash (w4_Instance* instance);
+
+/** The same hash as w4_runtimeHash, for a state from w4_runtimeSerialize. */
+uint64_t w4_runtimeHashState (const void* state);
+
+/** Whether a block of memory changed after the given version, see dirty.h. */
+bool w4_runtimeChangedSince (w4_Instance* instance, int block, uint32_t version);
@@ -0,0 +1,80 @@
+#include "trace.h"
+
+#if defined(W4_TRACE)
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "instance.h"
+#include "util.h"
+
+// Events are buffered until there's less room than this left
+#define BUFFER_SIZE (64*1024)
+#define MAX_EVENT_SIZE 256
+
+static FILE* file;
+static uint64_t startTime;
+
+bool w4_traceOpen (const char* path) {
+    file = fopen(path, "w");
+    if (file == NULL) {
+        return false;
+    }
+    // Times are written relative to this, so they fit in a double with full precision
+    startTime = w4_nanos() - 1;
+    fprintf(file, "[\n");
+    return true;
+}
+
+void w4_traceClose () {
+    if (file) {
+        fprintf(file, "{\"name\": \"process_name\", \"ph\": \"M\", \"pid\": 0, \"tid\": 0, "
+            "\"args\": {\"name\": \"wasm4\"}}\n]\n");
+        fclose(file);
+        file = NULL;
+    }
+}
+
+uint64_t w4_traceNow () {
+    return file ? w4_nanos() - startTime : 0;
+}
+
+void w4_traceEvent (w4_Instance* instance, const char* name, uint64_t start) {
+    if (!file || start == 0) {
+        return;
+    }
+    uint64_t end = w4_nanos() - startTime;
+
+    if (!instance->traceBuffer) {
+        instance->traceBuffer = xmalloc(BUFFER_SIZE);
+        instance->traceLength = snprintf(instance->traceBuffer, BUFFER_SIZE,
+            "{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 0, \"tid\": %d, "
+            "\"args\": {\"name\": \"instance %d\"}},\n", instance->traceId, instance->traceId);
+    } else if (instance->traceLength > BUFFER_SIZE - MAX_EVENT_SIZE) {
+        w4_traceFlush(instance);
+    }
+
+    // Each event is written whole, with a trailing comma. w4_traceClose ends the list
+    instance->traceLength += snprintf(instance->traceBuffer + instance->traceLength,
+        BUFFER_SIZE - instance->traceLength,
+        "{\"name\": \"%s\", \"ph\": \"X\", \"ts\": %.3f, \"dur\": %.3f, \"pid\": 0, \"tid\": %d},\n",
+        name, start / 1e3, (end - start) / 1e3, instance->traceId);
+}
+
+void w4_traceFlush (w4_Instance* instance) {
+    if (file && instance->traceLength > 0) {
+        // A single write, so the chunks of instances on different threads don't interleave
+        fwrite(instance->traceBuffer, 1, instance->traceLength, file);
+    }
+    instance->traceLength = 0;
+}
+
+void w4_traceDestroy (w4_Instance* instance) {
+    if (instance->traceBuffer) {
+        w4_traceFlush(instance);
+        free(instance->traceBuffer);
+        instance->traceBuffer = NULL;
+    }
+}
+
+#endif
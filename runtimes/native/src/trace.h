@@ -0,0 +1,45 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "runtime.h"
+
+// Timing of the phases of each frame, written as Chrome trace events that can be opened in
+// chrome://tracing or ui.perfetto.dev. Only built with the TRACE cmake option, otherwise the
+// W4_TRACE_ macros compile to nothing.
+//
+// Each instance buffers its own events and writes them out once per frame, so instances on
+// different threads can be traced together. Each instance shows up as its own thread.
+
+#if defined(W4_TRACE)
+
+/** Starts writing events to a file. Returns false if it can't be opened. */
+bool w4_traceOpen (const char* path);
+
+/** Finishes the file. Events buffered by instances that haven't been flushed are lost. */
+void w4_traceClose ();
+
+/** The current time in nanoseconds, or 0 if no trace is open. */
+uint64_t w4_traceNow ();
+
+/** Records an event on the instance's thread, from start until now. */
+void w4_traceEvent (w4_Instance* instance, const char* name, uint64_t start);
+
+/** Writes out the instance's buffered events. */
+void w4_traceFlush (w4_Instance* instance);
+
+/** Frees the instance's buffer, after flushing it. */
+void w4_traceDestroy (w4_Instance* instance);
+
+#define W4_TRACE_BEGIN(var) uint64_t var = w4_traceNow()
+#define W4_TRACE_END(instance, var, name) w4_traceEvent(instance, name, var)
+#define W4_TRACE_FLUSH(instance) w4_traceFlush(instance)
+
+#else
+
+#define W4_TRACE_BEGIN(var)
+#define W4_TRACE_END(instance, var, name)
+#define W4_TRACE_FLUSH(instance)
+
+#endif
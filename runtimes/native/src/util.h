@@ -13,3 +13,6 @@ double w4_readf64LE (const void* ptr);
 
 void w4_write16LE (void* ptr, uint16_t value);
 void w4_write32LE (void* ptr, uint32_t value);
+
+/** A monotonic clock in nanoseconds, for measuring durations. */
+uint64_t w4_nanos ();
@@ -2,10 +2,13 @@
 
 #include <stdint.h>
 
-uint8_t* w4_wasmInit ();
-void w4_wasmDestroy ();
+#include "runtime.h"
 
-void w4_wasmLoadModule (const uint8_t* wasmBuffer, int byteLength);
+/** Creates the wasm backend state for an instance and returns its 64 KB memory. */
+uint8_t* w4_wasmInit (w4_Instance* instance);
+void w4_wasmDestroy (w4_Instance* instance);
 
-void w4_wasmCallStart ();
-void w4_wasmCallUpdate ();
+void w4_wasmLoadModule (w4_Instance* instance, const uint8_t* wasmBuffer, int byteLength);
+
+void w4_wasmCallStart (w4_Instance* instance);
+void w4_wasmCallUpdate (w4_Instance* instance);
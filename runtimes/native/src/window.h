@@ -2,6 +2,16 @@
 
 #include <stdint.h>
 
-void w4_windowBoot (const char* title);
+#include "runtime.h"
+
+struct w4_Movie;
+struct w4_Netplay;
+
+/**
+ * Runs the main loop. If netplay is given, frames are run through it, see backend/netplay.h. If a
+ * movie is given, it's played back from its current frame, then the input is recorded onto it.
+ */
+void w4_windowBoot (w4_Instance* instance, const char* title, struct w4_Netplay* netplay,
+    struct w4_Movie* movie);
 
 void w4_windowComposite (const uint32_t* palette, const uint8_t* framebuffer);